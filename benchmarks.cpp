@@ -0,0 +1,803 @@
+#include "RedBlackTree.h"
+#include "BlockedRedBlackTree.h"
+#include "FixedRedBlackTree.h"
+#include "SmallRedBlackTree.h"
+#include "SlidingWindow.h"
+#include "ChangeFeed.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <stdexcept>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <string>
+#include <queue>
+#include <set>
+#include <functional>
+#include <atomic>
+
+using namespace std;
+
+/** Throughput benchmarks for RedBlackTree and its variants. Run with no arguments to run all of them,
+ * or pass the names of the ones to run. Build with `make benchmarks`. */
+
+typedef chrono::steady_clock Clock;
+
+static double secondsSince(const Clock::time_point& start) {
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static void report(const char* label, size_t ops, double seconds) {
+	cout << "  " << label << ": " << seconds * 1000 << " ms, "
+	     << ops / seconds / 1e6 << " Mops/s\n";
+}
+
+static void fillTree(RedBlackTree<int>& tree, int num_insert, int modulo) {
+	for (int i = 0; i < num_insert; i++) tree.insert(rand()%modulo);
+}
+
+static void batchBenchmark() {
+	int num_initial = 1000000;
+	int modulo = 2000000;
+	int batch_sizes[] = {1000, 50000, 500000};
+	cout << "applyBatch() against looping insert()/remove() on a tree of "
+	     << num_initial << " random integers [0, " << modulo-1 << "]\n";
+	for (size_t b = 0; b < sizeof(batch_sizes)/sizeof(batch_sizes[0]); b++) {
+		vector<RedBlackTree<int>::BatchOp> ops;
+		for (int i = 0; i < batch_sizes[b]; i++) {
+			RedBlackTree<int>::BatchOp op = {rand()%modulo, rand()%2 == 0};
+			ops.push_back(op);
+		}
+		RedBlackTree<int> looped;
+		fillTree(looped, num_initial, modulo);
+		RedBlackTree<int> batched(looped);
+		cout << " batch of " << ops.size() << " operations\n";
+
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < ops.size(); i++) {
+			if (ops[i].insert) looped.insert(ops[i].value);
+			else if (looped.contains(ops[i].value)) looped.remove(ops[i].value);
+		}
+		report("insert()/remove() loop", ops.size(), secondsSince(start));
+
+		start = Clock::now();
+		batched.applyBatch(ops);
+		report("applyBatch()", ops.size(), secondsSince(start));
+	}
+}
+
+static void parallelCopyBenchmark() {
+	int num_insert = 4000000;
+	unsigned max_threads = thread::hardware_concurrency();
+	if (max_threads == 0) max_threads = 1;
+	cout << "Copy constructor and destructor of a tree of " << num_insert
+	     << " distinct integers by thread count (" << max_threads << " hardware threads)\n";
+	vector<RedBlackTree<int>::BatchOp> ops;
+	for (int i = 0; i < num_insert; i++) {
+		RedBlackTree<int>::BatchOp op = {i, true};
+		ops.push_back(op);
+	}
+	RedBlackTree<int> original;
+	original.applyBatch(ops);
+	for (unsigned threads = 1; threads <= max(64u, max_threads); threads *= 2) {
+		ThreadPool pool(threads);
+		original.setThreadPool(&pool);
+		cout << " " << threads << " threads\n";
+		Clock::time_point start = Clock::now();
+		RedBlackTree<int>* copy = new RedBlackTree<int>(original);
+		report("copy", num_insert, secondsSince(start));
+		start = Clock::now();
+		delete copy;
+		report("destroy", num_insert, secondsSince(start));
+		original.setThreadPool(NULL);
+		if (threads >= max_threads) break;
+	}
+}
+
+template <typename Balance>
+static void runBalanceMix(const char* mix, int lookup_percent, int num_initial, int num_ops, int modulo) {
+	RedBlackTree<int, Balance> tree;
+	for (int i = 0; i < num_initial; i++) tree.insert(rand()%modulo);
+	size_t initial_rotations = tree.rotations();
+	size_t found = 0;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		int kind = rand()%100;
+		if (kind < lookup_percent) found += tree.contains(next);
+		else if (kind%2 == 0) tree.insert(next);
+		else if (tree.contains(next)) tree.remove(next);
+	}
+	double seconds = secondsSince(start);
+	cout << "  " << Balance::name() << ", " << mix << ": height " << tree.height() << ", "
+	     << double(tree.rotations() - initial_rotations) / num_ops << " rotations/op, "
+	     << num_ops / seconds / 1e6 << " Mops/s, " << found << " lookup hits\n";
+}
+
+template <typename Balance>
+static void runBalancePolicy(int num_initial, int num_ops, int modulo) {
+	runBalanceMix<Balance>("read-heavy (90% lookups)", 90, num_initial, num_ops, modulo);
+	runBalanceMix<Balance>("write-heavy (50% inserts, 50% removes)", 0, num_initial, num_ops, modulo);
+}
+
+static void balanceBenchmark() {
+	int num_initial = 1000000;
+	int num_ops = 2000000;
+	int modulo = 4000000;
+	cout << "Balancing policies on a tree of " << num_initial << " random integers, "
+	     << num_ops << " operations per mix\n";
+	runBalancePolicy<RedBlackBalance>(num_initial, num_ops, modulo);
+	runBalancePolicy<LeftLeaningBalance>(num_initial, num_ops, modulo);
+	runBalancePolicy<AvlBalance>(num_initial, num_ops, modulo);
+	runBalancePolicy<WavlBalance>(num_initial, num_ops, modulo);
+}
+
+template <typename Tree>
+static void runLookupScan(const char* label, Tree& tree, const vector<int>& keys, int scans) {
+	cout << " " << label << " (height " << tree.height() << ")\n";
+	Clock::time_point start = Clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < keys.size(); i++) found += tree.count(keys[i]);
+	report("random lookups", keys.size(), secondsSince(start));
+
+	start = Clock::now();
+	long long sum = 0;
+	for (int i = 0; i < scans; i++) tree.forEach([&sum](int value, size_t count) { sum += value * (long long)count; });
+	report("in-order scans", (size_t)scans * tree.size(), secondsSince(start));
+	if (found == 0 && sum == 0) cout << "  (empty)\n"; // Keep the loops from being optimized away
+}
+
+static void blockedBenchmark() {
+	int num_insert = 1000000;
+	int num_lookups = 2000000;
+	int modulo = 4000000;
+	int scans = 20;
+	cout << "Blocked tree against one value per node on " << num_insert << " random integers [0, "
+	     << modulo-1 << "], " << num_lookups << " lookups and " << scans << " full scans\n";
+	vector<int> values, keys;
+	for (int i = 0; i < num_insert; i++) values.push_back(rand()%modulo);
+	for (int i = 0; i < num_lookups; i++) keys.push_back((i%2 == 0) ? values[rand()%num_insert] : rand()%modulo);
+
+	RedBlackTree<int> plain;
+	for (size_t i = 0; i < values.size(); i++) plain.insert(values[i]);
+	runLookupScan("RedBlackTree", plain, keys, scans);
+	plain.clear();
+
+	BlockedRedBlackTree<int, 16> blocked16;
+	for (size_t i = 0; i < values.size(); i++) blocked16.insert(values[i]);
+	runLookupScan("BlockedRedBlackTree, 16 per block", blocked16, keys, scans);
+	blocked16.clear();
+
+	BlockedRedBlackTree<int, 64> blocked64;
+	for (size_t i = 0; i < values.size(); i++) blocked64.insert(values[i]);
+	runLookupScan("BlockedRedBlackTree, 64 per block", blocked64, keys, scans);
+}
+
+static void reportLatency(const char* label, vector<double>& nanos) {
+	sort(nanos.begin(), nanos.end());
+	cout << "  " << label << ": p50 " << nanos[nanos.size() / 2] << " ns, p99 "
+	     << nanos[nanos.size() * 99 / 100] << " ns, max " << nanos.back() << " ns\n";
+}
+
+static void runRemoveLatency(const char* label, RedBlackTree<int>& tree, const vector<int>& values) {
+	vector<double> nanos;
+	nanos.reserve(values.size());
+	for (size_t i = 0; i < values.size(); i++) {
+		Clock::time_point start = Clock::now();
+		tree.remove(values[i]);
+		nanos.push_back(secondsSince(start) * 1e9);
+	}
+	reportLatency(label, nanos);
+}
+
+static void lazyRemoveBenchmark() {
+	int num_insert = 1000000;
+	int num_remove = 200000;
+	int purge_step = 1024;
+	cout << "Remove latency on a tree of " << num_insert << " distinct integers, "
+	     << num_remove << " removes\n";
+	vector<int> values;
+	for (int i = 0; i < num_insert; i++) values.push_back(i);
+	random_shuffle(values.begin(), values.end());
+	RedBlackTree<int> eager;
+	for (size_t i = 0; i < values.size(); i++) eager.insert(values[i]);
+	RedBlackTree<int> lazy(eager);
+	lazy.setLazyRemove(true);
+	values.resize(num_remove);
+
+	runRemoveLatency("remove()", eager, values);
+	runRemoveLatency("lazy remove()", lazy, values);
+
+	vector<double> nanos;
+	while (lazy.tombstones() != 0) {
+		Clock::time_point start = Clock::now();
+		lazy.purgeTombstones(purge_step);
+		nanos.push_back(secondsSince(start) * 1e9);
+	}
+	reportLatency("purgeTombstones(1024)", nanos);
+}
+
+static void runClear(const char* label, RedBlackTree<int>& tree, int num_insert, int num_after) {
+	for (int i = 0; i < num_insert; i++) tree.insert(rand());
+	Clock::time_point start = Clock::now();
+	tree.clear();
+	double clear_seconds = secondsSince(start);
+	vector<double> nanos;
+	for (int i = 0; i < num_after; i++) {
+		start = Clock::now();
+		tree.insert(rand());
+		nanos.push_back(secondsSince(start) * 1e9);
+	}
+	cout << "  " << label << ": clear() " << clear_seconds * 1000 << " ms\n";
+	reportLatency(" then insert()", nanos);
+	tree.setDeferredFree(0);
+	Reclaimer::shared().drain();
+}
+
+static void deferredFreeBenchmark() {
+	int num_insert = 1000000;
+	int num_after = 200000;
+	ThreadPool serial(1);
+	Reclaimer::shared().drain(); // Start the thread before timing
+	cout << "clear() on a tree of " << num_insert << " random integers, then " << num_after
+	     << " inserts\n";
+	RedBlackTree<int> sync;
+	sync.setThreadPool(&serial);
+	runClear("immediate", sync, num_insert, num_after);
+	RedBlackTree<int> sliced;
+	sliced.setDeferredFree(64);
+	runClear("deferred, 64 per operation", sliced, num_insert, num_after);
+	RedBlackTree<int> background;
+	background.setDeferredFree(0, true);
+	runClear("deferred to the reclaimer thread", background, num_insert, num_after);
+}
+
+static void rangeBenchmark() {
+	int num_insert = 1000000;
+	int modulo = 1000000;
+	int widths[] = {1000, 100000, 500000};
+	cout << "removeRange() against looping remove() on a tree of " << num_insert
+	     << " random integers [0, " << modulo-1 << "]\n";
+	RedBlackTree<int> original;
+	fillTree(original, num_insert, modulo);
+	for (size_t w = 0; w < sizeof(widths)/sizeof(widths[0]); w++) {
+		RedBlackTree<int> looped(original);
+		RedBlackTree<int> ranged(original);
+		cout << " range of " << widths[w] << " values, " << original.countRange(0, widths[w] - 1)
+		     << " elements\n";
+		Clock::time_point start = Clock::now();
+		for (int i = 0; i < widths[w]; i++)
+			while (looped.contains(i)) looped.remove(i);
+		report("remove() loop", widths[w], secondsSince(start));
+
+		start = Clock::now();
+		ranged.removeRange(0, widths[w] - 1);
+		report("removeRange()", widths[w], secondsSince(start));
+	}
+}
+
+static double timeLookups(const RedBlackTree<int>& tree, const vector<int>& keys) {
+	Clock::time_point start = Clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < keys.size(); i++) found += tree.count(keys[i]);
+	double seconds = secondsSince(start);
+	if (found == 0) cout << "  (no hits)\n"; // Keep the loop from being optimized away
+	return seconds;
+}
+
+static void compactBenchmark() {
+	int num_insert = 1000000;
+	int num_churn = 3000000;
+	int num_lookups = 2000000;
+	int modulo = 4000000;
+	int step = 4096;
+	cout << "Lookups on a tree of " << num_insert << " random integers after " << num_churn
+	     << " random inserts and removes, before and after compacting\n";
+	RedBlackTree<int> tree;
+	fillTree(tree, num_insert, modulo);
+	for (int i = 0; i < num_churn; i++) { // Scatter the nodes across the heap
+		int next = rand()%modulo;
+		if (tree.contains(next)) tree.remove(next);
+		else tree.insert(next);
+	}
+	vector<int> keys;
+	for (int i = 0; i < num_lookups; i++) keys.push_back(rand()%modulo);
+	RedBlackTree<int> stepped(tree);
+	for (int i = 0; i < num_churn / 4; i++) { // Scatter the copy too
+		int next = rand()%modulo;
+		if (stepped.contains(next)) stepped.remove(next);
+		else stepped.insert(next);
+	}
+	report("lookups, scattered copy", keys.size(), timeLookups(stepped, keys));
+	size_t nodes = 0;
+	stepped.forEach([&nodes](int, size_t) { nodes++; });
+	vector<double> nanos;
+	Clock::time_point start;
+	for (size_t moved = 0; moved < nodes; ) { // One full pass
+		start = Clock::now();
+		moved += stepped.compactStep(step);
+		nanos.push_back(secondsSince(start) * 1e9);
+	}
+	reportLatency("compactStep(4096)", nanos);
+	report("lookups, compacted in steps", keys.size(), timeLookups(stepped, keys));
+
+	report("lookups, scattered", keys.size(), timeLookups(tree, keys));
+	start = Clock::now();
+	tree.compact();
+	cout << "  compact(): " << secondsSince(start) * 1000 << " ms\n";
+	report("lookups, compacted", keys.size(), timeLookups(tree, keys));
+}
+
+/** A string without a KeyPrefix specialization, so nodes hold no prefix */
+struct PlainString: public string {
+	PlainString() {}
+	PlainString(const string& value): string(value) {}
+};
+
+static string uuidKey() {
+	const char* hex = "0123456789abcdef";
+	string key;
+	for (int i = 0; i < 32; i++) {
+		if (i == 8 || i == 12 || i == 16 || i == 20) key += '-';
+		key += hex[rand()%16];
+	}
+	return key;
+}
+
+static string urlKey() {
+	const char* hosts[] = {"https://example.com", "https://www.example.org", "http://api.example.net"};
+	string key = hosts[rand()%3];
+	key += "/users/" + to_string(rand()%100000) + "/items/" + to_string(rand()%1000);
+	return key;
+}
+
+template <typename Key>
+static void runStringKeys(const char* label, const vector<string>& values, const vector<string>& probes) {
+	vector<Key> keys(values.begin(), values.end());
+	vector<Key> lookups(probes.begin(), probes.end());
+	RedBlackTree<Key> tree;
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < keys.size(); i++) tree.insert(keys[i]);
+	cout << " " << label << "\n";
+	report("inserts", keys.size(), secondsSince(start));
+	start = Clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < lookups.size(); i++) found += tree.count(lookups[i]);
+	report("lookups", lookups.size(), secondsSince(start));
+	if (found == 0) cout << "  (no hits)\n"; // Keep the loop from being optimized away
+}
+
+static void stringKeyBenchmark() {
+	int num_insert = 500000;
+	int num_lookups = 1000000;
+	cout << "String keys with and without inline prefixes, " << num_insert << " inserts and "
+	     << num_lookups << " lookups (half hits)\n";
+	for (int kind = 0; kind < 2; kind++) {
+		vector<string> values, probes;
+		for (int i = 0; i < num_insert; i++) values.push_back((kind == 0) ? uuidKey() : urlKey());
+		for (int i = 0; i < num_lookups; i++)
+			probes.push_back((i%2 == 0) ? values[rand()%num_insert] : ((kind == 0) ? uuidKey() : urlKey()));
+		cout << ((kind == 0) ? "UUID keys\n" : "URL keys\n");
+		runStringKeys<PlainString>("no prefix", values, probes);
+		runStringKeys<string>("8 byte prefix", values, probes);
+	}
+}
+
+/** Hold model: every operation pops the smallest value and pushes it back a random
+ * distance later, as an event queue does */
+template <typename Queue, typename Pop, typename Push>
+static void runHold(const char* label, Queue& queue, int num_ops, Pop pop, Push push) {
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < num_ops; i++) push(queue, pop(queue) + rand()%1000);
+	report(label, num_ops, secondsSince(start));
+}
+
+static void priorityBenchmark() {
+	int sizes[] = {1000, 100000, 1000000};
+	int num_ops = 1000000;
+	cout << "popMin() and insert() as a priority queue, " << num_ops << " hold operations\n";
+	for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		vector<int> initial;
+		for (int i = 0; i < sizes[s]; i++) initial.push_back(rand()%1000);
+		cout << " " << sizes[s] << " queued values\n";
+
+		priority_queue<int, vector<int>, greater<int> > heap(initial.begin(), initial.end());
+		runHold("std::priority_queue", heap, num_ops,
+			[](priority_queue<int, vector<int>, greater<int> >& q) { int v = q.top(); q.pop(); return v; },
+			[](priority_queue<int, vector<int>, greater<int> >& q, int v) { q.push(v); });
+
+		multiset<int> sorted(initial.begin(), initial.end());
+		runHold("std::multiset", sorted, num_ops,
+			[](multiset<int>& q) { int v = *q.begin(); q.erase(q.begin()); return v; },
+			[](multiset<int>& q, int v) { q.insert(v); });
+
+		RedBlackTree<int> searched;
+		for (size_t i = 0; i < initial.size(); i++) searched.insert(initial[i]);
+		runHold("remove(min())", searched, num_ops,
+			[](RedBlackTree<int>& q) { int v = q.min(); q.remove(v); return v; },
+			[](RedBlackTree<int>& q, int v) { q.insert(v); });
+
+		RedBlackTree<int> popped;
+		for (size_t i = 0; i < initial.size(); i++) popped.insert(initial[i]);
+		runHold("popMin()", popped, num_ops,
+			[](RedBlackTree<int>& q) { return q.popMin(); },
+			[](RedBlackTree<int>& q, int v) { q.insert(v); });
+	}
+}
+
+/** Replaces held values with new ones and looks one up, once per entry of slots */
+template <typename Tree>
+static void runChurn(const char* label, Tree& tree, vector<int> held, const vector<int>& slots,
+		     const vector<int>& values) {
+	Clock::time_point start = Clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < slots.size(); i++) {
+		tree.remove(held[slots[i]]);
+		held[slots[i]] = values[i];
+		tree.insert(values[i]);
+		found += tree.count(held[slots[slots.size() - 1 - i]]);
+	}
+	report(label, slots.size(), secondsSince(start));
+	if (found == 0) throw logic_error("Lost every value.");
+}
+
+static void fixedBenchmark() {
+	const int size = 4096;
+	int num_ops = 1000000;
+	int modulo = 1000000;
+	cout << "Remove, insert and lookup churn on " << size << " values, FixedRedBlackTree against RedBlackTree\n";
+	vector<int> held;
+	for (int i = 0; i < size; i++) held.push_back(rand()%modulo);
+	static FixedRedBlackTree<int, size> fixed;
+	RedBlackTree<int> tree;
+	for (int i = 0; i < size; i++) {
+		fixed.insert(held[i]);
+		tree.insert(held[i]);
+	}
+	vector<int> slots, values;
+	for (int i = 0; i < num_ops; i++) {
+		slots.push_back(rand()%size);
+		values.push_back(rand()%modulo);
+	}
+	runChurn("RedBlackTree", tree, held, slots, values);
+	runChurn("FixedRedBlackTree<int, 4096>", fixed, held, slots, values);
+	cout << "  bytes per value: " << tree.memoryUsage().bytesPerKey << " for RedBlackTree, "
+	     << (double)sizeof(fixed) / size << " for FixedRedBlackTree\n";
+}
+
+/** Fills many trees with a few values each, then looks values up in all of them */
+template <typename Tree>
+static void runManyTrees(const char* label, int num_trees, const vector<int>& values, int per_tree,
+			 size_t (*bytes)(const Tree&)) {
+	Clock::time_point start = Clock::now();
+	vector<Tree> trees(num_trees);
+	for (int t = 0; t < num_trees; t++)
+		for (int i = 0; i < per_tree; i++) trees[t].insert(values[t * per_tree + i]);
+	report((string(label) + " build").c_str(), values.size(), secondsSince(start));
+
+	start = Clock::now();
+	size_t found = 0;
+	for (int round = 0; round < 4; round++)
+		for (int t = 0; t < num_trees; t++)
+			for (int i = 0; i < per_tree; i++) found += trees[t].count(values[t * per_tree + (i * 7 + round) % per_tree]);
+	report((string(label) + " lookup").c_str(), 4 * values.size(), secondsSince(start));
+	size_t total = 0;
+	for (int t = 0; t < num_trees; t++) total += bytes(trees[t]);
+	cout << "  " << label << ": " << (double)total / num_trees << " bytes per tree\n";
+	if (found < 4 * values.size()) throw logic_error("Lost a value.");
+}
+
+static size_t treeBytes(const RedBlackTree<int>& tree) {
+	return tree.memoryUsage().totalBytes;
+}
+
+static size_t smallTreeBytes(const SmallRedBlackTree<int>& tree) {
+	return tree.memoryBytes();
+}
+
+static void smallBenchmark() {
+	int sizes[] = {4, 12, 40};
+	int num_values = 2000000;
+	cout << "Many small trees, RedBlackTree against SmallRedBlackTree with 16 inline values\n";
+	for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		int num_trees = num_values / sizes[s];
+		vector<int> values;
+		for (int i = 0; i < num_trees * sizes[s]; i++) values.push_back(rand());
+		cout << " " << num_trees << " trees of " << sizes[s] << " values\n";
+		runManyTrees<RedBlackTree<int> >("RedBlackTree", num_trees, values, sizes[s], treeBytes);
+		runManyTrees<SmallRedBlackTree<int> >("SmallRedBlackTree", num_trees, values, sizes[s], smallTreeBytes);
+	}
+}
+
+/** Runs a mix of 20 point lookups per insert or remove */
+static void runPointLookups(const char* label, RedBlackTree<int>& tree, const vector<int>& keys) {
+	Clock::time_point start = Clock::now();
+	size_t found = 0;
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (i%21 != 0) found += tree.count(keys[i]);
+		else if (tree.contains(keys[i])) tree.remove(keys[i]);
+		else tree.insert(keys[i]);
+	}
+	report(label, keys.size(), secondsSince(start));
+	RedBlackTree<int>::MemoryUsage usage = tree.memoryUsage();
+	cout << "  " << label << ": " << usage.bytesPerKey << " bytes per key, " << found << " hits\n";
+}
+
+static void hashIndexBenchmark() {
+	int sizes[] = {1000, 100000, 1000000};
+	int num_ops = 2000000;
+	cout << "Point lookups with and without the hash index, 20 lookups per update\n";
+	for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		int modulo = 2 * sizes[s];
+		RedBlackTree<int> plain;
+		fillTree(plain, sizes[s], modulo);
+		RedBlackTree<int> indexed(plain);
+		indexed.setHashIndex(true);
+		vector<int> keys;
+		for (int i = 0; i < num_ops; i++) keys.push_back(rand()%modulo);
+		cout << " " << sizes[s] << " values\n";
+		runPointLookups("tree descent", plain, keys);
+		runPointLookups("hash index", indexed, keys);
+	}
+}
+
+static void parallelTraversalBenchmark() {
+	int num_insert = 4000000;
+	int modulo = 2000000;
+	cout << "parallelForEach(), parallelReduce() and parallelTransform() over a tree of " << num_insert
+	     << " random integers [0, " << modulo-1 << "] by thread count (" << thread::hardware_concurrency()
+	     << " hardware threads)\n";
+	RedBlackTree<int> tree;
+	fillTree(tree, num_insert, modulo);
+	long long expected = 0;
+	tree.forEach([&expected](int value, size_t count) { expected += (long long)value * count; });
+	for (unsigned threads = 1; threads <= 64; threads *= 2) {
+		ThreadPool pool(threads);
+		tree.setThreadPool(&pool);
+		cout << " " << threads << " threads\n";
+		atomic<size_t> multiples(0); // Rarely touched, so threads seldom contend for it
+		Clock::time_point start = Clock::now();
+		tree.parallelForEach([&multiples](int value, size_t count) {
+			if (value % 1024 == 0) multiples += count;
+		});
+		report("parallelForEach()", num_insert, secondsSince(start));
+		start = Clock::now();
+		long long sum = tree.parallelReduce(0LL, [](int value, size_t count) { return (long long)value * count; },
+						    [](long long left, long long right) { return left + right; });
+		report("parallelReduce()", num_insert, secondsSince(start));
+		start = Clock::now();
+		RedBlackTree<int> mapped = tree.parallelTransform([](int value) { return value * 2; });
+		report("parallelTransform()", num_insert, secondsSince(start));
+		if (sum != expected) throw logic_error("parallelReduce() disagrees with forEach().");
+		mapped.setThreadPool(NULL);
+		tree.setThreadPool(NULL);
+	}
+}
+
+static void runUpdates(const char* label, RedBlackTree<int>& tree, const vector<int>& keys) {
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < keys.size(); i++) {
+		if (i % 2 == 0) tree.insert(keys[i]);
+		else if (tree.contains(keys[i])) tree.remove(keys[i]);
+	}
+	report(label, keys.size(), secondsSince(start));
+}
+
+static void changeFeedBenchmark() {
+	int num_initial = 1000000;
+	int num_ops = 2000000;
+	int modulo = 2000000;
+	cout << "Keeping a follower in step with a tree of " << num_initial << " random integers [0, "
+	     << modulo-1 << "] under " << num_ops << " inserts and removes\n";
+	vector<int> keys;
+	for (int i = 0; i < num_ops; i++) keys.push_back(rand()%modulo);
+	RedBlackTree<int> plain;
+	fillTree(plain, num_initial, modulo);
+	RedBlackTree<int> followed(plain);
+	RedBlackTree<int> mirror(plain);
+	runUpdates("no subscribers", plain, keys);
+
+	ChangeFeed<int> feed(1 << 16);
+	followed.subscribe(&feed);
+	atomic<bool> done(false);
+	thread follower([&]() {
+		vector<ChangeEvent<int> > events;
+		while (true) {
+			bool finished = done.load();
+			events.clear();
+			feed.poll(events);
+			for (size_t i = 0; i < events.size(); i++) {
+				if (events[i].op == kChangeInsert) mirror.insert(events[i].value);
+				else mirror.remove(events[i].value);
+			}
+			if (finished && events.empty()) return;
+			if (events.empty()) this_thread::yield();
+		}
+	});
+	runUpdates("subscribed, follower applying deltas", followed, keys);
+	done = true;
+	follower.join();
+	followed.unsubscribe(&feed);
+	cout << "  " << feed.nextSequence() << " events, " << feed.dropped() << " dropped, mirror "
+	     << ((mirror.size() == followed.size()) ? "in step" : "out of step") << "\n";
+
+	Clock::time_point start = Clock::now();
+	RedBlackTree<int> copy(followed);
+	report("one full copy, for comparison", copy.size(), secondsSince(start));
+}
+
+static void merkleBenchmark() {
+	int num_insert = 1000000;
+	int modulo = 2000000;
+	int diffs[] = {1, 100, 10000};
+	cout << "Comparing replicas of a tree of " << num_insert << " random integers [0, " << modulo-1 << "]\n";
+	vector<int> keys;
+	for (int i = 0; i < num_insert; i++) keys.push_back(rand()%modulo);
+	RedBlackTree<int> plain;
+	RedBlackTree<int, RedBlackBalance, true> hashed;
+	hashed.setMerkleHashes(true);
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < keys.size(); i++) plain.insert(keys[i]);
+	report("insert() without hashes", keys.size(), secondsSince(start));
+	start = Clock::now();
+	for (size_t i = 0; i < keys.size(); i++) hashed.insert(keys[i]);
+	report("insert() with hashes", keys.size(), secondsSince(start));
+	for (size_t d = 0; d < sizeof(diffs)/sizeof(diffs[0]); d++) {
+		RedBlackTree<int, RedBlackBalance, true> replica(hashed);
+		for (int i = 0; i < diffs[d]; i++) replica.insert(rand()%modulo);
+		cout << " " << diffs[d] << " differences\n";
+		start = Clock::now();
+		vector<pair<int, size_t> > left, right;
+		hashed.forEach([&left](int value, size_t count) { left.push_back(make_pair(value, count)); });
+		replica.forEach([&right](int value, size_t count) { right.push_back(make_pair(value, count)); });
+		size_t differing = 0;
+		for (size_t i = 0, j = 0; i < left.size() || j < right.size(); differing++) {
+			if (j == right.size() || (i < left.size() && left[i].first < right[j].first)) i++;
+			else if (i == left.size() || right[j].first < left[i].first) j++;
+			else if (left[i++].second == right[j++].second) differing--;
+		}
+		report("full traversal of both", num_insert, secondsSince(start));
+		start = Clock::now();
+		size_t found = hashed.diff(replica).size();
+		report("diff()", num_insert, secondsSince(start));
+		if (found != differing) throw logic_error("diff() disagrees with the traversal.");
+	}
+}
+
+template <typename Remove>
+static void runRemoves(const char* label, const RedBlackTree<int>& original, const vector<int>& keys, Remove remove) {
+	RedBlackTree<int> tree(original);
+	size_t removed = 0;
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < keys.size(); i++) removed += remove(tree, keys[i]);
+	report(label, keys.size(), secondsSince(start));
+	if (removed + tree.size() != static_cast<size_t>(original.size())) throw logic_error("Removals disagree.");
+}
+
+static void tryRemoveBenchmark() {
+	int num_insert = 1000000;
+	int num_ops = 1000000;
+	int modulo = 1000000;
+	double miss_rates[] = {0.33, 0.9};
+	cout << "Removes of values from a tree of " << num_insert << " random integers [0, " << modulo-1 << "]\n";
+	RedBlackTree<int> original;
+	fillTree(original, num_insert, modulo);
+	for (size_t m = 0; m < sizeof(miss_rates)/sizeof(miss_rates[0]); m++) {
+		vector<int> keys;
+		for (int i = 0; i < num_ops; i++) {
+			if (rand() < miss_rates[m] * RAND_MAX) keys.push_back(modulo + rand()%modulo); // Never inserted
+			else keys.push_back(rand()%modulo); // Usually present
+		}
+		cout << " at least " << miss_rates[m] * 100 << "% misses\n";
+		runRemoves("remove() catching misses", original, keys, [](RedBlackTree<int>& tree, int key) -> size_t {
+			try {
+				tree.remove(key);
+				return 1;
+			} catch (const invalid_argument&) {
+				return 0;
+			}
+		});
+		runRemoves("contains() then remove()", original, keys, [](RedBlackTree<int>& tree, int key) -> size_t {
+			if (!tree.contains(key)) return 0;
+			tree.remove(key);
+			return 1;
+		});
+		runRemoves("tryRemove()", original, keys, [](RedBlackTree<int>& tree, int key) -> size_t {
+			return tree.tryRemove(key) ? 1 : 0;
+		});
+		runRemoves("find() then erase()", original, keys, [](RedBlackTree<int>& tree, int key) -> size_t {
+			RedBlackTree<int>::Position position = tree.find(key);
+			return tree.erase(position);
+		});
+	}
+}
+
+/** Streams per_second timestamps in microseconds for each simulated second, a few out of
+ * order, and calls expire(window, cutoff) after every period of them with the window
+ * span seconds long. The inserts are timed apart from the expiry calls. */
+template <typename Window, typename Expire>
+static void runWindow(const char* label, Window& window, int num_seconds, int per_second, int span, int period,
+		Expire expire) {
+	vector<int> jitter(per_second);
+	for (int i = 0; i < per_second; i++) jitter[i] = rand()%50;
+	vector<double> nanos;
+	double insertSeconds = 0;
+	long long num_events = static_cast<long long>(num_seconds) * per_second;
+	for (long long event = 0; event < num_events; event += period) {
+		Clock::time_point start = Clock::now();
+		for (long long i = event; i < event + period; i++) window.insert(i - jitter[i % per_second]);
+		insertSeconds += secondsSince(start);
+		long long cutoff = event + period - static_cast<long long>(span) * per_second;
+		if (cutoff <= 0) continue;
+		start = Clock::now();
+		expire(window, cutoff);
+		nanos.push_back(secondsSince(start) * 1e9);
+	}
+	cout << " " << label << "\n";
+	report("inserts", num_events, insertSeconds);
+	reportLatency("expiry", nanos);
+}
+
+static void slidingWindowBenchmark() {
+	int num_seconds = 10;
+	int per_second = 1000000;
+	int span = 2;
+	cout << num_seconds << " s of " << per_second << " events/s through a window of " << span << " s\n";
+	RedBlackTree<long long> looped;
+	runWindow("remove() loop from min(), every second", looped, num_seconds, per_second, span, per_second,
+		[](RedBlackTree<long long>& tree, long long cutoff) {
+			while (!tree.empty() && tree.min() < cutoff) {
+				long long oldest = tree.min();
+				tree.remove(oldest);
+			}
+		});
+	looped.clear();
+	SlidingWindow<long long> immediate(0);
+	runWindow("expireBefore(), every second, freeing during expiry", immediate, num_seconds, per_second, span,
+		per_second, [](SlidingWindow<long long>& window, long long cutoff) { window.expireBefore(cutoff); });
+	SlidingWindow<long long> deferred;
+	runWindow("expireBefore(), every second, 64 frees per later operation", deferred, num_seconds, per_second,
+		span, per_second, [](SlidingWindow<long long>& window, long long cutoff) { window.expireBefore(cutoff); });
+	SlidingWindow<long long> stepped;
+	runWindow("expireBefore() every 10 ms, at most 20000 keys per step", stepped, num_seconds, per_second, span,
+		per_second / 100, [](SlidingWindow<long long>& window, long long cutoff) { window.expireBefore(cutoff, 20000); });
+}
+
+struct Benchmark {
+	const char* name;
+	void (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+	{"batch", batchBenchmark},
+	{"parallel-copy", parallelCopyBenchmark},
+	{"balance", balanceBenchmark},
+	{"blocked", blockedBenchmark},
+	{"lazy-remove", lazyRemoveBenchmark},
+	{"deferred-free", deferredFreeBenchmark},
+	{"range", rangeBenchmark},
+	{"compact", compactBenchmark},
+	{"string-keys", stringKeyBenchmark},
+	{"priority", priorityBenchmark},
+	{"fixed", fixedBenchmark},
+	{"small", smallBenchmark},
+	{"hash-index", hashIndexBenchmark},
+	{"parallel-traversal", parallelTraversalBenchmark},
+	{"change-feed", changeFeedBenchmark},
+	{"merkle", merkleBenchmark},
+	{"try-remove", tryRemoveBenchmark},
+	{"sliding-window", slidingWindowBenchmark},
+};
+
+int main(int argc, char **argv) {
+	srand(42);
+	size_t num_benchmarks = sizeof(benchmarks)/sizeof(benchmarks[0]);
+	for (size_t i = 0; i < num_benchmarks; i++) {
+		bool selected = (argc == 1);
+		for (int j = 1; j < argc; j++) selected = selected || strcmp(argv[j], benchmarks[i].name) == 0;
+		if (selected) benchmarks[i].run();
+	}
+	return 0;
+}
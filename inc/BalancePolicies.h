@@ -0,0 +1,758 @@
+#ifndef BALANCEPOLICIES_H
+#define BALANCEPOLICIES_H
+
+#include <cstddef>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Balancing policies for RedBlackTree.
+ *
+ * A policy decides how a node is colored or ranked when it is linked in, and
+ * restores the balance of the tree after an insertion or an unlink. Every policy
+ * provides:
+ *
+ * initLeaf(node) - Sets the balance data of a node about to become a leaf.
+ * initBalanced(node, depth, redDepth, height) - Sets the balance data of a node in
+ *     a perfectly balanced rebuild, where only the level at redDepth is incomplete.
+ * afterInsert(tree, node) - Restores balance after node was linked in as a leaf.
+ * unlink(tree, node) - Splices out a node with at most one child and restores balance.
+ * verify(tree) - Checks the invariants of the policy.
+ *
+ * Policies use the red flag and the rank of each node. They reach the tree only
+ * through BalanceAccess, which trees befriend.
+ *
+ * Resources used:
+ *
+ * Introduction to Algorithms (Cormen, Leierson, Rivest, Stein)
+ * Rank-Balanced Trees (Haeupler, Sen, Tarjan)
+ * Left-leaning Red-Black Trees (Sedgewick)
+ *
+ */
+
+/** The tree operations available to balancing policies */
+class BalanceAccess {
+public:
+    /** Returns the root of the tree */
+    template <typename Tree>
+    static typename Tree::Node* root(const Tree& tree) {
+	    return tree.root;
+    }
+
+    /** Rotates child up over its parent. left => child was a right child */
+    template <typename Tree, typename Node>
+    static void rotate(Tree& tree, Node* const child, const bool left) {
+	    tree.rotate(child, left);
+    }
+
+    /** Replaces oldChild of parent with newChild. A NULL parent replaces the root */
+    template <typename Tree, typename Node>
+    static void replaceChild(Tree& tree, Node* const parent, const Node* const oldChild, Node* const newChild) {
+	    if (parent == NULL) tree.root = newChild;
+	    else if (parent->lChild == oldChild) parent->lChild = newChild;
+	    else parent->rChild = newChild;
+	    if (newChild != NULL) newChild->parent = parent;
+    }
+};
+
+/** Classic red-black balancing. Satisfies the following:
+ *
+ * 1) Each node is red or black.
+ * 2) Root and NULL leaves are black.
+ * 3) Each red node must have two black child nodes.
+ * 4) Any path from a node to its descendant leaves has the same number of
+ * black nodes.
+ */
+struct RedBlackBalance {
+    /** Returns the name of the policy */
+    static const char* name() { return "red-black"; }
+
+    /** New leaves are red */
+    template <typename Node>
+    static void initLeaf(Node* const node);
+
+    /** Only the incomplete bottom level is red */
+    template <typename Node>
+    static void initBalanced(Node* const node, const int depth, const int redDepth, const int height);
+
+    /** Fixes any errors in coloring from insertion */
+    template <typename Tree, typename Node>
+    static void afterInsert(Tree& tree, Node* const child);
+
+    /** Splices out a node with at most one child and fixes the coloring */
+    template <typename Tree, typename Node>
+    static void unlink(Tree& tree, Node* const node);
+
+    /** Checks all red-black properties */
+    template <typename Tree>
+    static bool verify(const Tree& tree);
+
+    /** Returns the grandparent node */
+    template <typename Node>
+    static Node* grandparent(const Node* const child);
+
+    /** Returns the Uncle node */
+    template <typename Node>
+    static Node* uncle(const Node* const child);
+
+    /** Restores tree properties after delete. */
+    template <typename Tree, typename Node>
+    static void deleteRestoreTree(Tree& tree, Node* const parent, const Node* const notSibling);
+
+    /** Checks if the root is black */
+    template <typename Node>
+    static bool blackRoot(const Node* const root);
+
+    /** Verifies that red nodes have only black children */
+    template <typename Node>
+    static bool verifyRedChild(const Node* const currNode);
+
+    /** Returns the black height of a subtree, counting the NULL leaves. -1 if the
+     * subtree has paths with different black heights. */
+    template <typename Node>
+    static int blackHeight(const Node* const currNode);
+};
+
+/** Left-leaning red-black balancing. A red-black tree that in addition only has a
+ * red right child where the left child is red as well, so 3-nodes always lean
+ * left. Inserts split 4-nodes on the way back up as in Sedgewick's 2-3 variant;
+ * balanced rebuilds may leave 4-nodes at the bottom level. */
+struct LeftLeaningBalance {
+    /** Returns the name of the policy */
+    static const char* name() { return "left-leaning red-black"; }
+
+    /** New leaves are red */
+    template <typename Node>
+    static void initLeaf(Node* const node);
+
+    /** Only the incomplete bottom level is red */
+    template <typename Node>
+    static void initBalanced(Node* const node, const int depth, const int redDepth, const int height);
+
+    /** Fixes up every node on the path from the new leaf to the root */
+    template <typename Tree, typename Node>
+    static void afterInsert(Tree& tree, Node* const node);
+
+    /** Unlinks as in a red-black tree, then fixes up the path to the root */
+    template <typename Tree, typename Node>
+    static void unlink(Tree& tree, Node* const node);
+
+    /** Checks the red-black properties and that red links lean left */
+    template <typename Tree>
+    static bool verify(const Tree& tree);
+
+    /** Returns if a node is red. NULL leaves are black */
+    template <typename Node>
+    static bool isRed(const Node* const node);
+
+    /** Rotates right leaning reds left, splits 4-nodes and returns the subtree root */
+    template <typename Tree, typename Node>
+    static Node* fixUp(Tree& tree, Node* node);
+
+    /** Recursively checks that no red right child has a black sibling */
+    template <typename Node>
+    static bool verifyLeftLeaning(const Node* const currNode);
+};
+
+/** AVL balancing. The rank of each node is its height, with leaves at 0 and NULL
+ * leaves at -1, and the heights of the two children of a node differ by at most 1. */
+struct AvlBalance {
+    /** Returns the name of the policy */
+    static const char* name() { return "AVL"; }
+
+    /** New leaves have height 0 */
+    template <typename Node>
+    static void initLeaf(Node* const node);
+
+    /** The rank is the height of the subtree */
+    template <typename Node>
+    static void initBalanced(Node* const node, const int depth, const int redDepth, const int height);
+
+    /** Updates heights up the tree and rotates at most once */
+    template <typename Tree, typename Node>
+    static void afterInsert(Tree& tree, Node* const node);
+
+    /** Splices out the node and rebalances up the tree until a height is unchanged */
+    template <typename Tree, typename Node>
+    static void unlink(Tree& tree, Node* const node);
+
+    /** Checks that heights are correct and balanced */
+    template <typename Tree>
+    static bool verify(const Tree& tree);
+
+    /** Returns the height of a node. -1 for NULL */
+    template <typename Node>
+    static int height(const Node* const node);
+
+    /** Recomputes the height of a node from its children */
+    template <typename Node>
+    static void updateHeight(Node* const node);
+
+    /** Restores the balance of node with at most two rotations and returns the subtree root */
+    template <typename Tree, typename Node>
+    static Node* rebalance(Tree& tree, Node* const node);
+
+    /** Returns the height of a subtree, or -2 if it is not a valid AVL tree */
+    template <typename Node>
+    static int verifiedHeight(const Node* const currNode);
+};
+
+/** Weak AVL balancing. Every rank difference between a node and its child is 1 or
+ * 2, leaves have rank 0 and NULL leaves have rank -1. Inserts rebalance like AVL,
+ * while deletes rotate at most twice and amortize to O(1) rank changes. */
+struct WavlBalance {
+    /** Returns the name of the policy */
+    static const char* name() { return "WAVL"; }
+
+    /** New leaves have rank 0 */
+    template <typename Node>
+    static void initLeaf(Node* const node);
+
+    /** The rank is the height of the subtree */
+    template <typename Node>
+    static void initBalanced(Node* const node, const int depth, const int redDepth, const int height);
+
+    /** Promotes up the tree while there is a 0-child, then rotates at most twice */
+    template <typename Tree, typename Node>
+    static void afterInsert(Tree& tree, Node* const node);
+
+    /** Splices out the node and demotes up the tree while there is a 3-child, then
+     * rotates at most twice */
+    template <typename Tree, typename Node>
+    static void unlink(Tree& tree, Node* const node);
+
+    /** Checks the rank rules */
+    template <typename Tree>
+    static bool verify(const Tree& tree);
+
+    /** Returns the rank of a node. -1 for NULL */
+    template <typename Node>
+    static int rank(const Node* const node);
+
+    /** Recursively checks the rank rules */
+    template <typename Node>
+    static bool verifyRanks(const Node* const currNode);
+};
+
+/** Implementation details */
+
+/** Colors a new leaf red
+ * @node The new leaf */
+template <typename Node>
+void RedBlackBalance::initLeaf(Node* const node) {
+	node->red = true;
+	node->rank = 0;
+}
+
+/** Colors a node of a balanced rebuild
+ * @node The node
+ * @depth The depth of the node
+ * @redDepth The depth of the incomplete bottom level
+ * @height The height of the subtree of the node */
+template <typename Node>
+void RedBlackBalance::initBalanced(Node* const node, const int depth, const int redDepth, const int height) {
+	node->red = (depth == redDepth);
+	node->rank = static_cast<signed char>(height);
+}
+
+/** Gets called to restore red black properties
+ * @child The current node being looked at. Viewed as child */
+template <typename Tree, typename Node>
+void RedBlackBalance::afterInsert(Tree& tree, Node* const child) {
+	// NOTE: This should not get called on a NULL node, so child should never be NULL.
+	Node* root = BalanceAccess::root(tree);
+	if (root->red) { // Root is wrong color.
+		root->red = false;
+		return;
+	}
+	if (!child->parent->red) return; // Case I. Regular insertion.
+	if (child->red && child->parent->red) {
+		if (uncle(child) != NULL && uncle(child)->red) { // Case II. Parent && Uncle are red.
+			grandparent(child)->red = true; // Solution: Swap colors from grand gen to par gen
+			uncle(child)->red = false;
+			child->parent->red = false;
+			afterInsert(tree, grandparent(child)); // Fix any issues that this might have caused.
+		} else {
+			/** Case III. Child is opposite child that parent is and parent/uncle diff colors */
+			/** Solution: Rotate so that parent and child are both lChild or rChild.
+			 * Finish by doing Case IV */
+			// NOTE: Grandparent should never be NULL if there's a red red discrepancy!
+			if (grandparent(child)->lChild == child->parent && child == child->parent->rChild) {
+				Node* origParent = child->parent;
+				BalanceAccess::rotate(tree, child, true); // Left rotate
+				afterInsert(tree, origParent); // Proceed to Case IV with new child.
+			} else if (grandparent(child)->rChild == child->parent && child == child->parent->lChild) {
+				Node* origParent = child->parent;
+				BalanceAccess::rotate(tree, child, false); // Right rotate
+				afterInsert(tree, origParent); // Case IV
+			} else { // Case IV: Parent and Child are on same side.
+				/** Solution: Rotate parent and grandparent and then swap colors */
+				Node* origParent = child->parent;
+				Node* origGrandparent = grandparent(child);
+				origParent->red = origGrandparent->red;
+				origGrandparent->red = !origGrandparent->red;
+				if (origParent == origGrandparent->lChild) BalanceAccess::rotate(tree, origParent, false);
+				else BalanceAccess::rotate(tree, origParent, true);
+			}
+		}
+	}
+}
+
+/** Splices out a node and restores the red black properties
+ * @node A node with at most one child */
+template <typename Tree, typename Node>
+void RedBlackBalance::unlink(Tree& tree, Node* const node) {
+	Node* parent = node->parent;
+	Node* child = (node->lChild != NULL) ? node->lChild : node->rChild;
+	if (child != NULL) {
+	/** Case I: Node has one child.
+	 * NOTE: Parent must be black, child must be red.
+	 * If parent is red, then it must have one black child, which violates
+	 * black height.
+	 * If parent is black and child is black, then it again violates black height.
+	 */
+		child->red = false;
+		BalanceAccess::replaceChild(tree, parent, node, child);
+	} else {
+	/** Case II: Node has two NULL children.
+	 * If red or the root, just replace it with NULL. */
+		BalanceAccess::replaceChild(tree, parent, node, child);
+	/** If node is black. Restore tree props. */
+		if (parent != NULL && !node->red) deleteRestoreTree(tree, parent, static_cast<Node*>(NULL));
+	}
+}
+
+/** Verifies all red black properties
+ * @tree The tree */
+template <typename Tree>
+bool RedBlackBalance::verify(const Tree& tree) {
+	return blackRoot(BalanceAccess::root(tree)) && verifyRedChild(BalanceAccess::root(tree))
+	       && blackHeight(BalanceAccess::root(tree)) != -1;
+}
+
+/** Returns whether or not the root is black. Returns true if NULL root
+ * @root The root of the tree */
+template <typename Node>
+bool RedBlackBalance::blackRoot(const Node* const root) {
+	if (root == NULL) return true; // Handle NULL root
+	return !root->red;
+}
+
+/** Returns grandparent node
+ * @child The child node */
+template <typename Node>
+Node* RedBlackBalance::grandparent(const Node* const child) {
+	if (child == NULL || child->parent == NULL) return NULL;
+	return child->parent->parent;
+}
+
+/** Returns uncle node
+ * @child The child node */
+template <typename Node>
+Node* RedBlackBalance::uncle(const Node* const child) {
+	if (grandparent(child) == NULL) return NULL;
+	if (grandparent(child)->rChild == child->parent) return grandparent(child)->lChild;
+	return grandparent(child)->rChild;
+}
+
+/** Restores tree properties after delete.
+ * @parent The parent of the node that's messing up rb properties
+ * @notSibling The node that's messing up rb properties */
+template <typename Tree, typename Node>
+void RedBlackBalance::deleteRestoreTree(Tree& tree, Node* const parent, const Node* const notSibling) {
+	/** Case 0: */
+	if (parent == NULL) return; // At the root. Do nothing.
+
+	/** Find the sibling node */
+	Node* sibling = parent->rChild;
+	bool left = false;
+	if (parent->lChild != notSibling) {
+		sibling = parent->lChild;
+		left = true;
+	}
+
+	/** Case I: Sibling is red => Parent is black */
+	if (sibling->red) {
+		sibling->red = parent->red; // Swap colors and rotate
+		parent->red = !parent->red;
+		BalanceAccess::rotate(tree, sibling, !left);
+		deleteRestoreTree(tree, parent, notSibling); // Recurse in new position
+	} else if (!parent->red && !sibling->red &&
+	     	   (sibling->lChild == NULL || !sibling->lChild->red) &&
+		   (sibling->rChild == NULL || !sibling->rChild->red)) {
+	/** Case II: Parent is black. Sibling is black. Both sibling children are black or NULL. */
+		sibling->red = true; // Just recolor.
+		deleteRestoreTree(tree, parent->parent, parent);
+	} else if (parent->red && (sibling->lChild == NULL || !sibling->lChild->red)
+			       && (sibling->rChild == NULL || !sibling->rChild->red)) {
+	/** Case III: Parent is red => Sibling must be black. And both sibling children must
+	 * be black or NULL. */
+		sibling->red = parent->red;
+		parent->red = !parent->red; // Just swap colors
+	} else if ((!left && (sibling->rChild == NULL || !sibling->rChild->red) && sibling->lChild->red) || ((left && (sibling->lChild == NULL || !sibling->lChild->red)) && sibling->rChild->red)) {
+	/** Case IV: Inside sibling child is red. Outside sibling child is black. */
+		Node* child;
+		if (left) child = sibling->rChild;
+		else child = sibling->lChild;
+		sibling->red = child->red;
+		child->red = !child->red; // Swap colors and rotate into case V.
+		BalanceAccess::rotate(tree, child, left);
+		deleteRestoreTree(tree, parent, notSibling);
+	} else if ((!left && sibling->rChild != NULL && sibling->rChild->red) ||
+	           (left && sibling->lChild != NULL && sibling->lChild->red)) {
+	/** Case V: If the outer sibling child is red */
+		bool temp;
+		temp = sibling->red;
+		sibling->red = parent->red;
+		parent->red = temp; //Swap colors
+		if (!left) sibling->rChild->red = false;
+		else sibling->lChild->red = false; // Turn outer sibling child black
+		BalanceAccess::rotate(tree, sibling, !left); // Rotate
+	}
+}
+
+/** Verifies the property that red nodes have black children recursively starting from currNode
+ * @currNode The current node being verified */
+template <typename Node>
+bool RedBlackBalance::verifyRedChild(const Node* const currNode) {
+	if (currNode == NULL) return true; // Stop at leaves
+	if (currNode->lChild == NULL && currNode->rChild == NULL) return true; // Check cases of red-red parent/child
+	if (((currNode->lChild != NULL && currNode->lChild->red) ||
+	     (currNode->rChild != NULL && currNode->rChild->red)) && currNode->red) return false;
+	if (!verifyRedChild(currNode->lChild) || !verifyRedChild(currNode->rChild)) return false;
+	return true;
+}
+
+/** Returns black height of a subtree in one pass, or -1 if it is unequal somewhere
+ * @currNode The root of the subtree */
+template <typename Node>
+int RedBlackBalance::blackHeight(const Node* const currNode) {
+	if (currNode == NULL) return 1; // 1 for leaves
+	int left = blackHeight(currNode->lChild);
+	int right = blackHeight(currNode->rChild);
+	if (left == -1 || left != right) return -1;
+	if (currNode->red) return left; // If not black, return child's blackheight
+	return left + 1; // Otherwise, add one to child's blackheight
+}
+
+/** Colors a new leaf red
+ * @node The new leaf */
+template <typename Node>
+void LeftLeaningBalance::initLeaf(Node* const node) {
+	RedBlackBalance::initLeaf(node);
+}
+
+/** Colors a node of a balanced rebuild. Rebuilds put the extra node of an uneven
+ * split on the left, so the red bottom level never leans right on its own.
+ * @node The node
+ * @depth The depth of the node
+ * @redDepth The depth of the incomplete bottom level
+ * @height The height of the subtree of the node */
+template <typename Node>
+void LeftLeaningBalance::initBalanced(Node* const node, const int depth, const int redDepth, const int height) {
+	RedBlackBalance::initBalanced(node, depth, redDepth, height);
+}
+
+/** Fixes up all ancestors of a new leaf
+ * @node The new leaf */
+template <typename Tree, typename Node>
+void LeftLeaningBalance::afterInsert(Tree& tree, Node* const node) {
+	for (Node* currNode = node->parent; currNode != NULL; currNode = fixUp(tree, currNode)->parent);
+	BalanceAccess::root(tree)->red = false;
+}
+
+/** Splices out a node. The red-black delete leaves a valid red-black tree whose
+ * only right leaning reds are around the path it rebalanced, which the fix up
+ * walk from the old parent to the root then rotates back.
+ * @node A node with at most one child */
+template <typename Tree, typename Node>
+void LeftLeaningBalance::unlink(Tree& tree, Node* const node) {
+	Node* parent = node->parent;
+	RedBlackBalance::unlink(tree, node);
+	for (Node* currNode = parent; currNode != NULL; currNode = fixUp(tree, currNode)->parent);
+	if (BalanceAccess::root(tree) != NULL) BalanceAccess::root(tree)->red = false;
+}
+
+/** Verifies the red-black properties and that reds lean left
+ * @tree The tree */
+template <typename Tree>
+bool LeftLeaningBalance::verify(const Tree& tree) {
+	return RedBlackBalance::verify(tree) && verifyLeftLeaning(BalanceAccess::root(tree));
+}
+
+/** Returns if a node is red
+ * @node The node. May be NULL */
+template <typename Node>
+bool LeftLeaningBalance::isRed(const Node* const node) {
+	return node != NULL && node->red;
+}
+
+/** Applies Sedgewick's fix up to one node
+ * @node The node being fixed
+ * @return The node now at the top of its subtree */
+template <typename Tree, typename Node>
+Node* LeftLeaningBalance::fixUp(Tree& tree, Node* node) {
+	if (isRed(node->lChild) && isRed(node->rChild)) { // Split a 4-node left by a rebuild before a rotation moves its reds apart
+		node->red = !node->red;
+		node->lChild->red = false;
+		node->rChild->red = false;
+	}
+	if (isRed(node->rChild) && !isRed(node->lChild)) { // Rotate a right leaning red left
+		Node* child = node->rChild;
+		BalanceAccess::rotate(tree, child, true);
+		child->red = node->red;
+		node->red = true;
+		node = child;
+	}
+	if (isRed(node->lChild) && isRed(node->lChild->lChild)) { // Two reds in a row on the left
+		Node* child = node->lChild;
+		BalanceAccess::rotate(tree, child, false);
+		child->red = node->red;
+		node->red = true;
+		node = child;
+	}
+	if (isRed(node->lChild) && isRed(node->rChild)) { // Split a 4-node
+		node->red = !node->red;
+		node->lChild->red = false;
+		node->rChild->red = false;
+	}
+	return node;
+}
+
+/** Verifies that every red right child has a red sibling
+ * @currNode The current node being verified */
+template <typename Node>
+bool LeftLeaningBalance::verifyLeftLeaning(const Node* const currNode) {
+	if (currNode == NULL) return true; // Stop at leaves
+	if (isRed(currNode->rChild) && !isRed(currNode->lChild)) return false;
+	return verifyLeftLeaning(currNode->lChild) && verifyLeftLeaning(currNode->rChild);
+}
+
+/** Gives a new leaf height 0
+ * @node The new leaf */
+template <typename Node>
+void AvlBalance::initLeaf(Node* const node) {
+	node->red = false;
+	node->rank = 0;
+}
+
+/** Sets the height of a node of a balanced rebuild
+ * @node The node
+ * @height The height of the subtree of the node */
+template <typename Node>
+void AvlBalance::initBalanced(Node* const node, const int, const int, const int height) {
+	node->red = false;
+	node->rank = static_cast<signed char>(height);
+}
+
+/** Walks up from a new leaf updating heights. Once a subtree is rotated or keeps
+ * its height, nothing above it changes.
+ * @node The new leaf */
+template <typename Tree, typename Node>
+void AvlBalance::afterInsert(Tree& tree, Node* const node) {
+	Node* currNode = node->parent;
+	while (currNode != NULL) {
+		int origHeight = currNode->rank;
+		Node* subtree = rebalance(tree, currNode);
+		if (subtree->rank == origHeight) return;
+		currNode = subtree->parent;
+	}
+}
+
+/** Splices out a node and walks up rebalancing until a subtree keeps its height
+ * @node A node with at most one child */
+template <typename Tree, typename Node>
+void AvlBalance::unlink(Tree& tree, Node* const node) {
+	Node* currNode = node->parent;
+	BalanceAccess::replaceChild(tree, currNode, node, (node->lChild != NULL) ? node->lChild : node->rChild);
+	while (currNode != NULL) {
+		int origHeight = currNode->rank;
+		Node* subtree = rebalance(tree, currNode);
+		if (subtree->rank == origHeight) return;
+		currNode = subtree->parent;
+	}
+}
+
+/** Verifies heights and balance factors
+ * @tree The tree */
+template <typename Tree>
+bool AvlBalance::verify(const Tree& tree) {
+	return verifiedHeight(BalanceAccess::root(tree)) != -2;
+}
+
+/** Returns the height of a node
+ * @node The node. May be NULL */
+template <typename Node>
+int AvlBalance::height(const Node* const node) {
+	if (node == NULL) return -1;
+	return node->rank;
+}
+
+/** Sets the height of a node from its children
+ * @node The node */
+template <typename Node>
+void AvlBalance::updateHeight(Node* const node) {
+	int left = height(node->lChild);
+	int right = height(node->rChild);
+	node->rank = static_cast<signed char>(1 + ((left > right) ? left : right));
+}
+
+/** Rotates a node whose children's heights differ by 2 and updates heights
+ * @node The node being rebalanced
+ * @return The node now at the top of its subtree */
+template <typename Tree, typename Node>
+Node* AvlBalance::rebalance(Tree& tree, Node* const node) {
+	int balance = height(node->lChild) - height(node->rChild);
+	if (balance > 1 || balance < -1) {
+		bool leftHeavy = balance > 1;
+		Node* child = leftHeavy ? node->lChild : node->rChild;
+		Node* inner = leftHeavy ? child->rChild : child->lChild;
+		Node* outer = leftHeavy ? child->lChild : child->rChild;
+		if (height(inner) > height(outer)) { // Inner grandchild is taller: rotate it up first
+			BalanceAccess::rotate(tree, inner, leftHeavy);
+			updateHeight(child);
+			updateHeight(inner);
+			child = inner;
+		}
+		BalanceAccess::rotate(tree, child, !leftHeavy);
+		updateHeight(node);
+		updateHeight(child);
+		return child;
+	}
+	updateHeight(node);
+	return node;
+}
+
+/** Returns the height of a subtree after checking it
+ * @currNode The root of the subtree */
+template <typename Node>
+int AvlBalance::verifiedHeight(const Node* const currNode) {
+	if (currNode == NULL) return -1;
+	int left = verifiedHeight(currNode->lChild);
+	int right = verifiedHeight(currNode->rChild);
+	if (left == -2 || right == -2 || left - right > 1 || right - left > 1) return -2;
+	int currHeight = 1 + ((left > right) ? left : right);
+	if (currNode->rank != currHeight) return -2;
+	return currHeight;
+}
+
+/** Gives a new leaf rank 0
+ * @node The new leaf */
+template <typename Node>
+void WavlBalance::initLeaf(Node* const node) {
+	AvlBalance::initLeaf(node);
+}
+
+/** Sets the rank of a node of a balanced rebuild to its height, which satisfies
+ * the rank rules since sibling heights differ by at most 1.
+ * @node The node
+ * @height The height of the subtree of the node */
+template <typename Node>
+void WavlBalance::initBalanced(Node* const node, const int depth, const int redDepth, const int height) {
+	AvlBalance::initBalanced(node, depth, redDepth, height);
+}
+
+/** Rebalances after an insert
+ * @node The new leaf */
+template <typename Tree, typename Node>
+void WavlBalance::afterInsert(Tree& tree, Node* const node) {
+	Node* child = node;
+	Node* parent = child->parent;
+	while (parent != NULL && rank(parent) == rank(child)) { // child is a 0-child
+		Node* sibling = (parent->lChild == child) ? parent->rChild : parent->lChild;
+		if (rank(parent) - rank(sibling) == 1) { // Promote and continue up
+			parent->rank++;
+			child = parent;
+			parent = parent->parent;
+			continue;
+		}
+		bool childLeft = (parent->lChild == child); // Sibling is a 2-child: rotate
+		Node* inner = childLeft ? child->rChild : child->lChild;
+		if (rank(child) - rank(inner) == 2) { // Single rotation
+			BalanceAccess::rotate(tree, child, !childLeft);
+			parent->rank--;
+		} else { // Double rotation
+			BalanceAccess::rotate(tree, inner, childLeft);
+			BalanceAccess::rotate(tree, inner, !childLeft);
+			inner->rank++;
+			child->rank--;
+			parent->rank--;
+		}
+		return;
+	}
+}
+
+/** Splices out a node and rebalances
+ * @node A node with at most one child */
+template <typename Tree, typename Node>
+void WavlBalance::unlink(Tree& tree, Node* const node) {
+	Node* parent = node->parent;
+	Node* child = (node->lChild != NULL) ? node->lChild : node->rChild;
+	BalanceAccess::replaceChild(tree, parent, node, child);
+	if (parent == NULL) return;
+	if (parent->lChild == NULL && parent->rChild == NULL && parent->rank == 1) { // 2,2 leaf
+		parent->rank = 0;
+		child = parent;
+		parent = parent->parent;
+	}
+	while (parent != NULL && rank(parent) - rank(child) == 3) { // child is a 3-child
+		Node* sibling = (parent->lChild == child) ? parent->rChild : parent->lChild;
+		if (rank(parent) - rank(sibling) == 2) { // Demote and continue up
+			parent->rank--;
+			child = parent;
+			parent = parent->parent;
+			continue;
+		}
+		bool childLeft = (parent->rChild == sibling);
+		Node* inner = childLeft ? sibling->lChild : sibling->rChild;
+		Node* outer = childLeft ? sibling->rChild : sibling->lChild;
+		if (rank(sibling) - rank(inner) == 2 && rank(sibling) - rank(outer) == 2) { // Demote both
+			parent->rank--;
+			sibling->rank--;
+			child = parent;
+			parent = parent->parent;
+			continue;
+		}
+		if (rank(sibling) - rank(outer) == 1) { // Single rotation
+			BalanceAccess::rotate(tree, sibling, childLeft);
+			sibling->rank++;
+			parent->rank--;
+			if (parent->lChild == NULL && parent->rChild == NULL) parent->rank--; // Leaves are rank 0
+		} else { // Double rotation
+			BalanceAccess::rotate(tree, inner, !childLeft);
+			BalanceAccess::rotate(tree, inner, childLeft);
+			inner->rank += 2;
+			sibling->rank--;
+			parent->rank -= 2;
+		}
+		return;
+	}
+}
+
+/** Verifies the rank rules
+ * @tree The tree */
+template <typename Tree>
+bool WavlBalance::verify(const Tree& tree) {
+	return verifyRanks(BalanceAccess::root(tree));
+}
+
+/** Returns the rank of a node
+ * @node The node. May be NULL */
+template <typename Node>
+int WavlBalance::rank(const Node* const node) {
+	if (node == NULL) return -1;
+	return node->rank;
+}
+
+/** Verifies rank differences of 1 or 2 and rank 0 leaves
+ * @currNode The current node being verified */
+template <typename Node>
+bool WavlBalance::verifyRanks(const Node* const currNode) {
+	if (currNode == NULL) return true; // Stop at leaves
+	int left = rank(currNode) - rank(currNode->lChild);
+	int right = rank(currNode) - rank(currNode->rChild);
+	if (left < 1 || left > 2 || right < 1 || right > 2) return false;
+	if (currNode->lChild == NULL && currNode->rChild == NULL && currNode->rank != 0) return false;
+	return verifyRanks(currNode->lChild) && verifyRanks(currNode->rChild);
+}
+
+#endif // BALANCEPOLICIES_H
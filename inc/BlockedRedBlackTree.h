@@ -0,0 +1,548 @@
+#ifndef BLOCKEDREDBLACKTREE_H
+#define BLOCKEDREDBLACKTREE_H
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include "BalancePolicies.h"
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Red Black Tree whose nodes each hold a sorted block of up to BlockSize values,
+ * each with a count for duplicates.
+ *
+ * The blocks cover disjoint ranges of values, and an in-order walk of the blocks
+ * visits the values in sorted order. A full block is split in half, with the
+ * upper half linked in as a new block right after it. A block that drops below a
+ * quarter full is merged with its successor, or takes values from it, and empty
+ * blocks are unlinked. The blocks themselves are balanced by the same policies as
+ * RedBlackTree, so the tree is about log2(BlockSize) levels shorter and a lookup
+ * touches one contiguous array of values at the bottom instead of one node per level.
+ *
+ */
+
+template <typename ElemType, std::size_t BlockSize = 16, typename Balance = RedBlackBalance>
+class BlockedRedBlackTree {
+friend class RedBlackTreeTest;
+friend class BalanceAccess;
+public:
+    /** Constructor */
+    BlockedRedBlackTree();
+
+    /** Copy Constructor */
+    BlockedRedBlackTree(const BlockedRedBlackTree &other);
+
+    /** Assignment Operator */
+    BlockedRedBlackTree& operator= (const BlockedRedBlackTree &other);
+
+    /** Destructor */
+    ~BlockedRedBlackTree();
+
+    /** Inserts an element */
+    void insert(const ElemType& value);
+
+    /** Deletes one copy of value. Throws std::invalid_argument if it is not in the tree */
+    void remove(const ElemType& value);
+
+    /** Checks if an element is in the tree */
+    bool contains(const ElemType& value) const;
+
+    /** Returns the number of times an element is in the tree. */
+    std::size_t count(const ElemType& value) const;
+
+    /** Returns the number of elements in the tree */
+    int size() const;
+
+    /** Returns if the tree is empty or not */
+    bool empty() const;
+
+    /** Clears the tree */
+    void clear();
+
+    /** Returns the number of blocks in the tree */
+    std::size_t blocks() const;
+
+    /** Returns the number of edges on the longest path from the root to a leaf. -1 if empty */
+    int height() const;
+
+    /** Calls visit(value, count) for every distinct value in order */
+    template <typename Visitor>
+    void forEach(Visitor visit) const;
+
+private:
+    typedef struct Node {
+	    Node* parent;
+	    Node* lChild;
+	    Node* rChild;
+	    bool red; // False => Black
+	    signed char rank; // Height or rank, for rank balanced policies
+	    unsigned short used; // Number of values in the block
+	    ElemType values[BlockSize]; // Sorted
+	    std::size_t counts[BlockSize]; // For any duplicates
+    } Node;
+
+    static_assert(BlockSize >= 4 && BlockSize < 65536, "BlockSize must be in [4, 65535]");
+
+    Node* root;
+    int numElems;
+    std::size_t numBlocks;
+
+    /** Returns the block that holds value, or that value would be inserted into */
+    Node* findBlock(const ElemType& value) const;
+
+    /** Returns the position of the first value in a block that is not less than value */
+    std::size_t lowerBound(const Node* const block, const ElemType& value) const;
+
+    /** Makes a new empty block */
+    Node* makeBlock();
+
+    /** Moves the upper half of a full block into a new block linked in right after it */
+    Node* split(Node* const block);
+
+    /** Merges an underfull block with its successor, or takes values from it */
+    void refill(Node* const block);
+
+    /** Performs a single rotation */
+    void rotate(Node* child, const bool left);
+
+    /** Unlinks a block and rebalances, leaving the block detached */
+    void unlinkNode(Node* currNode);
+
+    /** Swaps the tree positions of a block and its in-order predecessor */
+    void swapNodes(Node* const node, Node* const pred);
+
+    /** Returns the next block in order. NULL if node is the last */
+    Node* nextNode(const Node* node) const;
+
+    /** Returns the leftmost block of a subtree */
+    Node* leftmost(Node* node) const;
+
+    /** Recursively deletes the tree */
+    void recursiveDelete(Node* currNode);
+
+    /** Copies a tree recursively */
+    Node* copyTree(const Node* const from, Node* const parent) const;
+
+    /** Returns the height of the subtree at currNode */
+    int subtreeHeight(const Node* const currNode) const;
+
+    /** Recursively checks that parent and children pointers match */
+    bool parentChildMatch(const Node* const currNode) const;
+
+    /** Checks that blocks are non-empty, sorted and ordered and that counts sum to the size */
+    bool verifyBlocks() const;
+
+    /** Wrapper for verifying all properties */
+    bool verifyProperties() const;
+};
+
+/** Implementation details */
+
+/** Constructor */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::BlockedRedBlackTree():
+	root(NULL),
+	numElems(0),
+	numBlocks(0)
+{}
+
+/** Copy Constructor */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::BlockedRedBlackTree(const BlockedRedBlackTree &other):
+	root(copyTree(other.root, NULL)),
+	numElems(other.numElems),
+	numBlocks(other.numBlocks)
+{}
+
+/** Assignment Operator */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+BlockedRedBlackTree<ElemType, BlockSize, Balance>&
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::operator= (const BlockedRedBlackTree &other) {
+	if (this != &other) {
+		clear(); // Delete tree
+		root = copyTree(other.root, NULL);
+		numElems = other.numElems;
+		numBlocks = other.numBlocks;
+	}
+	return *this;
+}
+
+/** Destructor */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::~BlockedRedBlackTree() {
+	recursiveDelete(root);
+}
+
+/** Inserts a value into its block, splitting the block first if it is full
+ * @value The value to insert */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::insert(const ElemType& value) {
+	numElems++;
+	Node* block = findBlock(value);
+	if (block == NULL) { // Insert root block
+		block = root = makeBlock();
+		Balance::afterInsert(*this, root);
+	}
+	std::size_t pos = lowerBound(block, value);
+	if (pos < block->used && block->values[pos] == value) { // Duplicate insert
+		block->counts[pos]++;
+		return;
+	}
+	if (block->used == BlockSize) {
+		Node* upper = split(block);
+		if (pos > block->used) { // Belongs in the upper half
+			pos -= block->used;
+			block = upper;
+		}
+	}
+	for (std::size_t i = block->used; i > pos; i--) { // Shift up to make room
+		block->values[i] = block->values[i-1];
+		block->counts[i] = block->counts[i-1];
+	}
+	block->values[pos] = value;
+	block->counts[pos] = 1;
+	block->used++;
+}
+
+/** Removes one copy of a value. Empty blocks are unlinked and sparse blocks refilled.
+ * @value Value being removed */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::remove(const ElemType& value) {
+	Node* block = findBlock(value);
+	std::size_t pos = (block == NULL) ? 0 : lowerBound(block, value);
+	if (block == NULL || pos == block->used || !(block->values[pos] == value)) // Error handle
+		throw std::invalid_argument("That value is not in the tree.");
+	--numElems; // Decrement size
+	if (block->counts[pos] != 1) { // If count is greater than 1, no deletion necessary
+		--block->counts[pos];
+		return;
+	}
+	block->used--;
+	for (std::size_t i = pos; i < block->used; i++) { // Shift down to close the gap
+		block->values[i] = block->values[i+1];
+		block->counts[i] = block->counts[i+1];
+	}
+	if (block->used == 0) {
+		unlinkNode(block);
+		delete block;
+		numBlocks--;
+	} else if (block->used < BlockSize / 4) refill(block);
+}
+
+/** Checks if a value is in the tree
+ * @value The value to be checked */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+bool BlockedRedBlackTree<ElemType, BlockSize, Balance>::contains(const ElemType& value) const {
+	return count(value) != 0;
+}
+
+/** Returns the number of times a value is in the tree
+ * @value Value being searched for */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+std::size_t BlockedRedBlackTree<ElemType, BlockSize, Balance>::count(const ElemType& value) const {
+	const Node* block = findBlock(value);
+	if (block == NULL) return 0;
+	std::size_t pos = lowerBound(block, value);
+	if (pos == block->used || !(block->values[pos] == value)) return 0;
+	return block->counts[pos];
+}
+
+/** Returns number of elements in tree */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+int BlockedRedBlackTree<ElemType, BlockSize, Balance>::size() const {
+	return numElems;
+}
+
+/** Returns if tree is empty */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+bool BlockedRedBlackTree<ElemType, BlockSize, Balance>::empty() const {
+	return size() == 0;
+}
+
+/** Clears the tree */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::clear() {
+	recursiveDelete(root);
+	root = NULL;
+	numElems = 0;
+	numBlocks = 0;
+}
+
+/** Returns number of blocks in tree */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+std::size_t BlockedRedBlackTree<ElemType, BlockSize, Balance>::blocks() const {
+	return numBlocks;
+}
+
+/** Returns the height of the tree of blocks */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+int BlockedRedBlackTree<ElemType, BlockSize, Balance>::height() const {
+	return subtreeHeight(root);
+}
+
+/** Visits all values in order, walking from block to block through parent pointers
+ * @visit Called with each value and its count */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+template <typename Visitor>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::forEach(Visitor visit) const {
+	if (root == NULL) return;
+	for (const Node* block = leftmost(root); block != NULL; block = nextNode(block))
+		for (std::size_t i = 0; i < block->used; i++) visit(block->values[i], block->counts[i]);
+}
+
+/** Descends to the block whose range holds value. Values outside of every range
+ * belong to the block where the descent runs out of children.
+ * @value Value being searched for
+ * @return The block. NULL if the tree is empty */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+typename BlockedRedBlackTree<ElemType, BlockSize, Balance>::Node*
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::findBlock(const ElemType& value) const {
+	Node* currNode = root;
+	while (currNode != NULL) {
+		Node* next = NULL;
+		if (value < currNode->values[0]) next = currNode->lChild;
+		else if (currNode->values[currNode->used-1] < value) next = currNode->rChild;
+		if (next == NULL) return currNode;
+		currNode = next;
+	}
+	return NULL;
+}
+
+/** Binary searches a block
+ * @block The block
+ * @value Value being searched for */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+std::size_t BlockedRedBlackTree<ElemType, BlockSize, Balance>::lowerBound(const Node* const block,
+									   const ElemType& value) const {
+	return std::lower_bound(block->values, block->values + block->used, value) - block->values;
+}
+
+/** Makes an empty block that is not linked in */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+typename BlockedRedBlackTree<ElemType, BlockSize, Balance>::Node*
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::makeBlock() {
+	Node* block = new Node;
+	block->parent = NULL;
+	block->lChild = NULL;
+	block->rChild = NULL;
+	block->used = 0;
+	Balance::initLeaf(block);
+	numBlocks++;
+	return block;
+}
+
+/** Splits a full block. The new block is linked in as the leftmost leaf of the
+ * right subtree, which is where its values belong in order.
+ * @block The full block
+ * @return The new block holding the upper half */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+typename BlockedRedBlackTree<ElemType, BlockSize, Balance>::Node*
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::split(Node* const block) {
+	Node* upper = makeBlock();
+	std::size_t half = BlockSize / 2;
+	for (std::size_t i = half; i < BlockSize; i++) {
+		upper->values[i - half] = block->values[i];
+		upper->counts[i - half] = block->counts[i];
+	}
+	upper->used = static_cast<unsigned short>(BlockSize - half);
+	block->used = static_cast<unsigned short>(half);
+	if (block->rChild == NULL) {
+		block->rChild = upper;
+		upper->parent = block;
+	} else {
+		Node* parent = leftmost(block->rChild);
+		parent->lChild = upper;
+		upper->parent = parent;
+	}
+	Balance::afterInsert(*this, upper);
+	return upper;
+}
+
+/** Refills a block below a quarter full from its successor. If both fit in one
+ * block they are merged and the successor is unlinked; otherwise values move over
+ * until the two blocks are even.
+ * @block The underfull block */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::refill(Node* const block) {
+	Node* next = nextNode(block);
+	if (next == NULL) return; // Last block may stay small
+	std::size_t moving = next->used; // Merge everything
+	if (block->used + next->used > BlockSize) moving = (next->used - block->used) / 2;
+	for (std::size_t i = 0; i < moving; i++) {
+		block->values[block->used + i] = next->values[i];
+		block->counts[block->used + i] = next->counts[i];
+	}
+	block->used = static_cast<unsigned short>(block->used + moving);
+	next->used = static_cast<unsigned short>(next->used - moving);
+	for (std::size_t i = 0; i < next->used; i++) {
+		next->values[i] = next->values[i + moving];
+		next->counts[i] = next->counts[i + moving];
+	}
+	if (next->used == 0) {
+		unlinkNode(next);
+		delete next;
+		numBlocks--;
+	}
+}
+
+/** Does a tree rotation at given block
+ * @child The child block to be rotated up left or right
+ * @left The direction of the rotation */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::rotate(Node* child, const bool left) {
+	Node* origParent = child->parent; // Store original pointers
+	Node* origGrandparent = origParent->parent;
+	child->parent = origGrandparent;
+	origParent->parent = child;
+	Node* origGrandchild;
+	if (left) { // Left rotate
+		origGrandchild = child->lChild;
+		child->lChild = origParent;
+		origParent->rChild = origGrandchild;
+	} else { // Right rotate
+		origGrandchild = child->rChild;
+		child->rChild = origParent;
+		origParent->lChild = origGrandchild;
+	}
+	if (origGrandchild != NULL) origGrandchild->parent = origParent; // Reconnect grandchild
+	if (origGrandparent == NULL) root = child; // If no grandparent, then at root.
+	else if (origGrandparent->lChild == origParent) origGrandparent->lChild = child;
+	else origGrandparent->rChild = child;
+}
+
+/** Detaches a block from the tree without freeing it
+ * @currNode The block to be unlinked */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::unlinkNode(Node* currNode) {
+	if (currNode->lChild != NULL && currNode->rChild != NULL) { // Move down next to a leaf
+		Node* pred = currNode->lChild;
+		while (pred->rChild != NULL) pred = pred->rChild;
+		swapNodes(currNode, pred);
+	}
+	Balance::unlink(*this, currNode); // At most one child now
+	currNode->parent = NULL;
+	currNode->lChild = NULL;
+	currNode->rChild = NULL;
+}
+
+/** Swaps the positions, colors and ranks of a block and its in-order predecessor,
+ * so no values are moved.
+ * @node A block with two children
+ * @pred The in-order predecessor of node */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::swapNodes(Node* const node, Node* const pred) {
+	Node* origParent = node->parent; // Store original pointers
+	Node* origLeft = node->lChild;
+	Node* origPredParent = pred->parent;
+	Node* origPredLeft = pred->lChild; // pred has no right child
+	std::swap(node->red, pred->red);
+	std::swap(node->rank, pred->rank);
+	pred->parent = origParent; // Move pred up into node's position
+	if (origParent == NULL) root = pred;
+	else if (origParent->lChild == node) origParent->lChild = pred;
+	else origParent->rChild = pred;
+	pred->rChild = node->rChild;
+	pred->rChild->parent = pred;
+	if (origPredParent == node) { // pred was node's left child
+		pred->lChild = node;
+		node->parent = pred;
+	} else {
+		pred->lChild = origLeft;
+		origLeft->parent = pred;
+		origPredParent->rChild = node;
+		node->parent = origPredParent;
+	}
+	node->lChild = origPredLeft; // Move node down into pred's position
+	if (origPredLeft != NULL) origPredLeft->parent = node;
+	node->rChild = NULL;
+}
+
+/** Returns the in-order successor of a block
+ * @node The given block */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+typename BlockedRedBlackTree<ElemType, BlockSize, Balance>::Node*
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::nextNode(const Node* node) const {
+	if (node->rChild != NULL) return leftmost(node->rChild);
+	while (node->parent != NULL && node->parent->rChild == node) node = node->parent;
+	return node->parent;
+}
+
+/** Returns the leftmost block of a subtree
+ * @node The root of the subtree */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+typename BlockedRedBlackTree<ElemType, BlockSize, Balance>::Node*
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::leftmost(Node* node) const {
+	while (node->lChild != NULL) node = node->lChild;
+	return node;
+}
+
+/** Frees memory of current block and all of its children recursively
+ * @currNode The current block being deleted */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+void BlockedRedBlackTree<ElemType, BlockSize, Balance>::recursiveDelete(Node* currNode) {
+	if (currNode == NULL) return; // Stop at leaves
+	recursiveDelete(currNode->lChild);
+	recursiveDelete(currNode->rChild);
+	delete currNode;
+}
+
+/** Copies a tree recursively
+ * @from The current block to be copied from
+ * @parent The parent of the copy
+ * @return The copy */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+typename BlockedRedBlackTree<ElemType, BlockSize, Balance>::Node*
+BlockedRedBlackTree<ElemType, BlockSize, Balance>::copyTree(const Node* const from, Node* const parent) const {
+	if (from == NULL) return NULL; // Stop at leaves
+	Node* into = new Node(*from); // Copies the block and its balance data
+	into->parent = parent;
+	into->lChild = copyTree(from->lChild, into);
+	into->rChild = copyTree(from->rChild, into);
+	return into;
+}
+
+/** Returns the height of a subtree. -1 for NULL
+ * @currNode The root of the subtree */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+int BlockedRedBlackTree<ElemType, BlockSize, Balance>::subtreeHeight(const Node* const currNode) const {
+	if (currNode == NULL) return -1;
+	return 1 + std::max(subtreeHeight(currNode->lChild), subtreeHeight(currNode->rChild));
+}
+
+/** Recursively checks for match between parent and child pointers
+ * @currNode Block being checked */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+bool BlockedRedBlackTree<ElemType, BlockSize, Balance>::parentChildMatch(const Node* const currNode) const {
+	if (currNode == NULL) return true; // Stop at leaves
+	if (currNode->lChild != NULL && currNode->lChild->parent != currNode) return false;
+	if (currNode->rChild != NULL && currNode->rChild->parent != currNode) return false;
+	return parentChildMatch(currNode->lChild) && parentChildMatch(currNode->rChild);
+}
+
+/** Verifies the blocks in order */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+bool BlockedRedBlackTree<ElemType, BlockSize, Balance>::verifyBlocks() const {
+	if (root == NULL) return numElems == 0 && numBlocks == 0;
+	std::size_t sum = 0;
+	std::size_t seenBlocks = 0;
+	const ElemType* last = NULL;
+	for (const Node* block = leftmost(root); block != NULL; block = nextNode(block)) {
+		if (block->used == 0 || block->used > BlockSize) return false;
+		for (std::size_t i = 0; i < block->used; i++) {
+			if (last != NULL && !(*last < block->values[i])) return false;
+			if (block->counts[i] == 0) return false;
+			last = &block->values[i];
+			sum += block->counts[i];
+		}
+		seenBlocks++;
+	}
+	return sum == static_cast<std::size_t>(numElems) && seenBlocks == numBlocks;
+}
+
+/** Wrapper for verifying all properties */
+template <typename ElemType, std::size_t BlockSize, typename Balance>
+bool BlockedRedBlackTree<ElemType, BlockSize, Balance>::verifyProperties() const {
+	return Balance::verify(*this) && parentChildMatch(root) && verifyBlocks();
+}
+
+#endif // BLOCKEDREDBLACKTREE_H
@@ -0,0 +1,157 @@
+#ifndef CHANGEFEED_H
+#define CHANGEFEED_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Stream of the changes made to a RedBlackTree, so a follower can keep a mirror
+ * of it up to date by applying deltas instead of copying the whole tree.
+ *
+ * A feed is a ring buffer with one producer, the thread changing the tree, and
+ * one consumer, the follower. Neither side locks: the producer only writes the
+ * tail and the consumer only writes the head, and each keeps its own copy of the
+ * other's index so it only reads the shared one when the ring looks full or empty.
+ * The consumer takes every waiting event in one poll().
+ *
+ * The producer never waits. When the ring is full, the event is dropped and its
+ * sequence number is skipped, so the follower sees the gap and copies the tree again.
+ *
+ */
+
+/** Changes a feed can carry */
+enum ChangeOp {
+    kChangeInsert = 0,
+    kChangeRemove = 1,
+    kChangeClear = 2,
+    kChangeResync = 3 // The tree changed in bulk. Followers copy it again
+};
+
+/** One change. count is the number of copies of value left after it. */
+template <typename ElemType>
+struct ChangeEvent {
+    std::uint64_t sequence;
+    ChangeOp op;
+    ElemType value; // Default constructed for clear and resync events
+    std::size_t count;
+};
+
+template <typename ElemType>
+class ChangeFeed {
+public:
+    /** Constructor. capacity is rounded up to a power of two. */
+    explicit ChangeFeed(const std::size_t capacity = 4096);
+
+    /** Appends an event. Returns false if the ring was full and it was dropped.
+     * Producer thread only. */
+    bool publish(const ChangeOp op, const ElemType& value, const std::size_t count);
+
+    /** Moves up to maxEvents waiting events to the end of events. Returns the number
+     * moved. Consumer thread only. */
+    std::size_t poll(std::vector<ChangeEvent<ElemType> >& events, const std::size_t maxEvents = SIZE_MAX);
+
+    /** Returns the sequence number the next event will get */
+    std::uint64_t nextSequence() const;
+
+    /** Returns the number of events dropped because the ring was full */
+    std::uint64_t dropped() const;
+
+    /** Returns the number of events the ring holds */
+    std::size_t capacity() const;
+
+private:
+    std::vector<ChangeEvent<ElemType> > ring;
+    std::size_t mask;
+    alignas(64) std::atomic<std::uint64_t> tail; // Written by the producer
+    std::uint64_t cachedHead; // Producer's last look at head
+    std::atomic<std::uint64_t> sequence;
+    std::atomic<std::uint64_t> numDropped;
+    alignas(64) std::atomic<std::uint64_t> head; // Written by the consumer
+    std::uint64_t cachedTail; // Consumer's last look at tail
+
+    ChangeFeed(const ChangeFeed&);
+    ChangeFeed& operator= (const ChangeFeed&);
+};
+
+/** Implementation details */
+
+/** Constructor
+ * @capacity The fewest events the ring should hold */
+template <typename ElemType>
+ChangeFeed<ElemType>::ChangeFeed(const std::size_t capacity):
+	tail(0),
+	cachedHead(0),
+	sequence(0),
+	numDropped(0),
+	head(0),
+	cachedTail(0)
+{
+	std::size_t size = 1;
+	while (size < capacity) size *= 2;
+	ring.resize(size);
+	mask = size - 1;
+}
+
+/** Writes the event into the slot at tail, then releases it to the consumer by
+ * moving tail past it
+ * @op The change
+ * @value The value changed
+ * @count The copies of value left */
+template <typename ElemType>
+bool ChangeFeed<ElemType>::publish(const ChangeOp op, const ElemType& value, const std::size_t count) {
+	const std::uint64_t next = sequence.load(std::memory_order_relaxed);
+	sequence.store(next + 1, std::memory_order_relaxed);
+	const std::uint64_t position = tail.load(std::memory_order_relaxed);
+	if (position - cachedHead == ring.size()) { // Looks full; see how far the consumer got
+		cachedHead = head.load(std::memory_order_acquire);
+		if (position - cachedHead == ring.size()) {
+			numDropped.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	}
+	ChangeEvent<ElemType>& event = ring[position & mask];
+	event.sequence = next;
+	event.op = op;
+	event.value = value;
+	event.count = count;
+	tail.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+/** Copies out the events between head and tail, then hands their slots back to the
+ * producer by moving head past them
+ * @events Receives the events
+ * @maxEvents The most events to take */
+template <typename ElemType>
+std::size_t ChangeFeed<ElemType>::poll(std::vector<ChangeEvent<ElemType> >& events, const std::size_t maxEvents) {
+	const std::uint64_t position = head.load(std::memory_order_relaxed);
+	if (position == cachedTail) cachedTail = tail.load(std::memory_order_acquire);
+	std::size_t available = static_cast<std::size_t>(cachedTail - position);
+	if (available > maxEvents) available = maxEvents;
+	for (std::size_t i = 0; i < available; i++) events.push_back(ring[(position + i) & mask]);
+	head.store(position + available, std::memory_order_release);
+	return available;
+}
+
+/** Returns the next sequence number */
+template <typename ElemType>
+std::uint64_t ChangeFeed<ElemType>::nextSequence() const {
+	return sequence.load(std::memory_order_relaxed);
+}
+
+/** Returns the drop count */
+template <typename ElemType>
+std::uint64_t ChangeFeed<ElemType>::dropped() const {
+	return numDropped.load(std::memory_order_relaxed);
+}
+
+/** Returns the ring size */
+template <typename ElemType>
+std::size_t ChangeFeed<ElemType>::capacity() const {
+	return ring.size();
+}
+
+#endif // CHANGEFEED_H
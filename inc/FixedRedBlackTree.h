@@ -0,0 +1,486 @@
+#ifndef FIXEDREDBLACKTREE_H
+#define FIXEDREDBLACKTREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Red Black Tree with room for N distinct values that never touches the heap.
+ *
+ * Nodes live in an array inside the tree and link to each other by index,
+ * 16 bits wide when N allows and 32 bits otherwise, so the tree can sit on the
+ * stack or inside another object. It is trivially copyable when ElemType is, so
+ * it can then be copied with memcpy. Removed nodes go on a free list threaded
+ * through their left links. Slots past the highest one ever used are handed out
+ * in order, so clear() touches no node. The constructor does zero the array
+ * once, since a C++17 constexpr constructor has to initialize every member; that
+ * costs O(N) per tree constructed.
+ *
+ * Once N distinct values are held, insert() of a new value throws
+ * std::length_error and tryInsert() returns false; duplicates of held values
+ * still fit. All operations are constexpr when ElemType is a literal type,
+ * including reuse of the free list; an operation that would throw is a compile
+ * error in a constant expression instead.
+ *
+ * Balancing is the classic red-black scheme (see BalancePolicies.h). The
+ * policies work on pointers, so it is written out here on indices.
+ *
+ */
+
+template <typename ElemType, std::size_t N>
+class FixedRedBlackTree {
+friend class RedBlackTreeTest;
+public:
+    /** Constructor. Zeroes the node array in O(N) */
+    constexpr FixedRedBlackTree();
+
+    /** Inserts an element. Throws std::length_error if it needs a node and none is free */
+    constexpr void insert(const ElemType& value);
+
+    /** Inserts an element. Returns false, leaving the tree as it was, if it needs a
+     * node and none is free */
+    constexpr bool tryInsert(const ElemType& value);
+
+    /** Deletes one copy of value. Throws std::invalid_argument if it is not in the tree */
+    constexpr void remove(const ElemType& value);
+
+    /** Checks if an element is in the tree */
+    constexpr bool contains(const ElemType& value) const;
+
+    /** Returns the number of times an element is in the tree. */
+    constexpr std::size_t count(const ElemType& value) const;
+
+    /** Returns the number of elements in the tree */
+    constexpr int size() const;
+
+    /** Returns if the tree is empty or not */
+    constexpr bool empty() const;
+
+    /** Returns true if no node is free, so only duplicates can be inserted */
+    constexpr bool full() const;
+
+    /** Returns the number of distinct values the tree can hold */
+    static constexpr std::size_t capacity() { return N; }
+
+    /** Clears the tree in O(1) */
+    constexpr void clear();
+
+    /** Returns the number of edges on the longest path from the root to a leaf. -1 if empty */
+    constexpr int height() const;
+
+    /** Calls visit(value, count) for every distinct value in order */
+    template <typename Visitor>
+    constexpr void forEach(Visitor visit) const;
+
+private:
+    typedef typename std::conditional<(N < 0xffff), std::uint16_t, std::uint32_t>::type Index;
+
+    static_assert(N > 0 && N < 0xffffffff, "N must be in [1, 2^32 - 2]");
+
+    /** Index of no node */
+    static constexpr Index kNil = std::numeric_limits<Index>::max();
+
+    typedef struct Node {
+	    ElemType value;
+	    std::size_t count; // For any duplicates
+	    Index parent;
+	    Index lChild; // Next free node while on the free list
+	    Index rChild;
+	    bool red; // False => Black
+    } Node;
+
+    Node nodes[N];
+    Index root;
+    Index freeList; // Head of the removed nodes. kNil => None
+    Index used; // Slots at and past used have never been handed out
+    Index numNodes;
+    int numElems;
+
+    /** Returns the node holding value, or kNil */
+    constexpr Index findNode(const ElemType& value) const;
+
+    /** Takes a node off the free list or from the unused slots. kNil if full */
+    constexpr Index allocate();
+
+    /** Returns whether a node is red. kNil is black */
+    constexpr bool isRed(const Index node) const;
+
+    /** Rotates child up over its parent. left => child was a right child */
+    constexpr void rotate(const Index child, const bool left);
+
+    /** Fixes any errors in coloring from insertion */
+    constexpr void insertRestoreTree(Index child);
+
+    /** Splices out a node with at most one child and fixes the coloring */
+    constexpr void unlink(const Index node);
+
+    /** Restores tree properties after a black node was spliced out from above child */
+    constexpr void deleteRestoreTree(Index child, Index parent);
+
+    /** Returns the leftmost node of a subtree */
+    constexpr Index leftmost(Index node) const;
+
+    /** Returns the next node in order. kNil if node is the last */
+    constexpr Index nextNode(Index node) const;
+
+    /** Returns the black height of a subtree, counting the NULL leaves. -1 if unequal */
+    int blackHeight(const Index node) const;
+
+    /** Checks parents, order, colors, counts and that every slot is in use or free */
+    bool verifyProperties() const;
+};
+
+/** Implementation details */
+
+/** Constructor. Value-initializes the nodes, which constexpr requires */
+template <typename ElemType, std::size_t N>
+constexpr FixedRedBlackTree<ElemType, N>::FixedRedBlackTree():
+	nodes(),
+	root(kNil),
+	freeList(kNil),
+	used(0),
+	numNodes(0),
+	numElems(0)
+{}
+
+/** Inserts a value
+ * @value The value to insert */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::insert(const ElemType& value) {
+	if (!tryInsert(value)) throw std::length_error("The tree is full.");
+}
+
+/** Descends to the value's place, counting a duplicate or linking a new red leaf
+ * @value The value to insert */
+template <typename ElemType, std::size_t N>
+constexpr bool FixedRedBlackTree<ElemType, N>::tryInsert(const ElemType& value) {
+	Index parent = kNil;
+	bool left = false;
+	for (Index currNode = root; currNode != kNil; ) {
+		if (value == nodes[currNode].value) {
+			nodes[currNode].count++;
+			numElems++;
+			return true;
+		}
+		parent = currNode;
+		left = value < nodes[currNode].value;
+		currNode = left ? nodes[currNode].lChild : nodes[currNode].rChild;
+	}
+	Index node = allocate();
+	if (node == kNil) return false;
+	nodes[node].value = value;
+	nodes[node].count = 1;
+	nodes[node].parent = parent;
+	nodes[node].lChild = kNil;
+	nodes[node].rChild = kNil;
+	nodes[node].red = true;
+	if (parent == kNil) root = node;
+	else if (left) nodes[parent].lChild = node;
+	else nodes[parent].rChild = node;
+	numNodes++;
+	numElems++;
+	insertRestoreTree(node);
+	return true;
+}
+
+/** Deletes an element from the tree if it exists. Otherwise, it throws an error.
+ * @value Value being removed */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::remove(const ElemType& value) {
+	Index node = findNode(value);
+	if (node == kNil) throw std::invalid_argument("That value is not in the tree.");
+	--numElems;
+	if (--nodes[node].count != 0) return; // Duplicates left
+	if (nodes[node].lChild != kNil && nodes[node].rChild != kNil) { // Take over the successor's slot in the order
+		Index succ = leftmost(nodes[node].rChild);
+		nodes[node].value = nodes[succ].value;
+		nodes[node].count = nodes[succ].count;
+		node = succ;
+	}
+	unlink(node);
+	nodes[node].lChild = freeList;
+	freeList = node;
+	numNodes--;
+}
+
+/** Checks if a value is in the tree
+ * @value The value to be checked */
+template <typename ElemType, std::size_t N>
+constexpr bool FixedRedBlackTree<ElemType, N>::contains(const ElemType& value) const {
+	return findNode(value) != kNil;
+}
+
+/** Returns the number of times a value is in the tree
+ * @value Value being searched for */
+template <typename ElemType, std::size_t N>
+constexpr std::size_t FixedRedBlackTree<ElemType, N>::count(const ElemType& value) const {
+	Index node = findNode(value);
+	return (node == kNil) ? 0 : nodes[node].count;
+}
+
+/** Returns number of elements in tree */
+template <typename ElemType, std::size_t N>
+constexpr int FixedRedBlackTree<ElemType, N>::size() const {
+	return numElems;
+}
+
+/** Returns if tree is empty */
+template <typename ElemType, std::size_t N>
+constexpr bool FixedRedBlackTree<ElemType, N>::empty() const {
+	return size() == 0;
+}
+
+/** Returns if every node is in use */
+template <typename ElemType, std::size_t N>
+constexpr bool FixedRedBlackTree<ElemType, N>::full() const {
+	return numNodes == N;
+}
+
+/** Clears the tree. Values are left in their slots until they are reused. */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::clear() {
+	root = kNil;
+	freeList = kNil;
+	used = 0;
+	numNodes = 0;
+	numElems = 0;
+}
+
+/** Returns the height of the tree, walking it in order and tracking depth */
+template <typename ElemType, std::size_t N>
+constexpr int FixedRedBlackTree<ElemType, N>::height() const {
+	int maxDepth = -1;
+	int depth = 0;
+	Index currNode = root;
+	if (currNode == kNil) return -1;
+	while (nodes[currNode].lChild != kNil) {
+		currNode = nodes[currNode].lChild;
+		depth++;
+	}
+	while (currNode != kNil) {
+		if (depth > maxDepth) maxDepth = depth;
+		if (nodes[currNode].rChild != kNil) { // Leftmost node of the right subtree
+			currNode = nodes[currNode].rChild;
+			depth++;
+			while (nodes[currNode].lChild != kNil) {
+				currNode = nodes[currNode].lChild;
+				depth++;
+			}
+			continue;
+		}
+		while (nodes[currNode].parent != kNil && nodes[nodes[currNode].parent].rChild == currNode) {
+			currNode = nodes[currNode].parent;
+			depth--;
+		}
+		currNode = nodes[currNode].parent;
+		depth--;
+	}
+	return maxDepth;
+}
+
+/** Visits all values in order without recursion
+ * @visit Called with each value and its count */
+template <typename ElemType, std::size_t N>
+template <typename Visitor>
+constexpr void FixedRedBlackTree<ElemType, N>::forEach(Visitor visit) const {
+	if (root == kNil) return;
+	for (Index node = leftmost(root); node != kNil; node = nextNode(node))
+		visit(nodes[node].value, nodes[node].count);
+}
+
+/** Iterative search from the root
+ * @value Value being searched for */
+template <typename ElemType, std::size_t N>
+constexpr typename FixedRedBlackTree<ElemType, N>::Index
+FixedRedBlackTree<ElemType, N>::findNode(const ElemType& value) const {
+	Index currNode = root;
+	while (currNode != kNil && !(value == nodes[currNode].value))
+		currNode = (value < nodes[currNode].value) ? nodes[currNode].lChild : nodes[currNode].rChild;
+	return currNode;
+}
+
+/** Reuses the most recently freed node first, while it is likely still in cache */
+template <typename ElemType, std::size_t N>
+constexpr typename FixedRedBlackTree<ElemType, N>::Index FixedRedBlackTree<ElemType, N>::allocate() {
+	if (freeList != kNil) {
+		Index node = freeList;
+		freeList = nodes[node].lChild;
+		return node;
+	}
+	if (used == N) return kNil;
+	return used++;
+}
+
+/** Returns the color of a node
+ * @node The node, or kNil */
+template <typename ElemType, std::size_t N>
+constexpr bool FixedRedBlackTree<ElemType, N>::isRed(const Index node) const {
+	return node != kNil && nodes[node].red;
+}
+
+/** Performs a single rotation, as RedBlackTree::rotate() does
+ * @child The node moving up
+ * @left Whether this is a left rotation, i.e. child is a right child */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::rotate(const Index child, const bool left) {
+	Index parent = nodes[child].parent;
+	Index grandparent = nodes[parent].parent;
+	Index inner = left ? nodes[child].lChild : nodes[child].rChild; // Changes sides
+	if (left) {
+		nodes[parent].rChild = inner;
+		nodes[child].lChild = parent;
+	} else {
+		nodes[parent].lChild = inner;
+		nodes[child].rChild = parent;
+	}
+	if (inner != kNil) nodes[inner].parent = parent;
+	nodes[parent].parent = child;
+	nodes[child].parent = grandparent;
+	if (grandparent == kNil) root = child;
+	else if (nodes[grandparent].lChild == parent) nodes[grandparent].lChild = child;
+	else nodes[grandparent].rChild = child;
+}
+
+/** Recolors while the uncle is red, then rotates once or twice
+ * @child The new red leaf */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::insertRestoreTree(Index child) {
+	while (child != root && isRed(nodes[child].parent)) {
+		Index parent = nodes[child].parent;
+		Index grandparent = nodes[parent].parent; // Red parent => Not the root
+		bool parentLeft = nodes[grandparent].lChild == parent;
+		Index uncle = parentLeft ? nodes[grandparent].rChild : nodes[grandparent].lChild;
+		if (isRed(uncle)) { // Push the blackness down from the grandparent
+			nodes[parent].red = false;
+			nodes[uncle].red = false;
+			nodes[grandparent].red = true;
+			child = grandparent;
+			continue;
+		}
+		if ((nodes[parent].lChild == child) != parentLeft) { // Inner grandchild. Make it outer
+			rotate(child, parentLeft);
+			child = parent;
+			parent = nodes[child].parent;
+		}
+		nodes[parent].red = false;
+		nodes[grandparent].red = true;
+		rotate(parent, !parentLeft);
+	}
+	nodes[root].red = false;
+}
+
+/** Replaces a node by its only child, if any
+ * @node A node with at most one child */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::unlink(const Index node) {
+	Index child = (nodes[node].lChild != kNil) ? nodes[node].lChild : nodes[node].rChild;
+	Index parent = nodes[node].parent;
+	if (child != kNil) nodes[child].parent = parent;
+	if (parent == kNil) root = child;
+	else if (nodes[parent].lChild == node) nodes[parent].lChild = child;
+	else nodes[parent].rChild = child;
+	if (nodes[node].red) return; // Black heights are unchanged
+	if (isRed(child)) nodes[child].red = false;
+	else deleteRestoreTree(child, parent);
+}
+
+/** Moves the missing black up the tree until a red node or a rotation absorbs it.
+ * child may be kNil, so its parent is tracked separately.
+ * @child The node one black short
+ * @parent Its parent */
+template <typename ElemType, std::size_t N>
+constexpr void FixedRedBlackTree<ElemType, N>::deleteRestoreTree(Index child, Index parent) {
+	while (child != root && !isRed(child)) {
+		bool left = nodes[parent].lChild == child; // A black sibling exists, so kNil is unambiguous
+		Index sibling = left ? nodes[parent].rChild : nodes[parent].lChild;
+		if (isRed(sibling)) { // Make the sibling black
+			nodes[sibling].red = false;
+			nodes[parent].red = true;
+			rotate(sibling, left);
+			sibling = left ? nodes[parent].rChild : nodes[parent].lChild;
+		}
+		Index outer = left ? nodes[sibling].rChild : nodes[sibling].lChild;
+		Index inner = left ? nodes[sibling].lChild : nodes[sibling].rChild;
+		if (!isRed(outer) && !isRed(inner)) { // Take one black off both sides
+			nodes[sibling].red = true;
+			child = parent;
+			parent = nodes[child].parent;
+			continue;
+		}
+		if (!isRed(outer)) { // Make the red nephew outer
+			nodes[inner].red = false;
+			nodes[sibling].red = true;
+			rotate(inner, !left);
+			outer = sibling;
+			sibling = inner;
+		}
+		nodes[sibling].red = nodes[parent].red;
+		nodes[parent].red = false;
+		nodes[outer].red = false;
+		rotate(sibling, left);
+		return;
+	}
+	if (child != kNil) nodes[child].red = false;
+}
+
+/** Follows left links down
+ * @node The root of the subtree */
+template <typename ElemType, std::size_t N>
+constexpr typename FixedRedBlackTree<ElemType, N>::Index FixedRedBlackTree<ElemType, N>::leftmost(Index node) const {
+	while (nodes[node].lChild != kNil) node = nodes[node].lChild;
+	return node;
+}
+
+/** Returns the in-order successor of a node, climbing through parents when it has no
+ * right child.
+ * @node The given node */
+template <typename ElemType, std::size_t N>
+constexpr typename FixedRedBlackTree<ElemType, N>::Index FixedRedBlackTree<ElemType, N>::nextNode(Index node) const {
+	if (nodes[node].rChild != kNil) return leftmost(nodes[node].rChild);
+	while (nodes[node].parent != kNil && nodes[nodes[node].parent].rChild == node) node = nodes[node].parent;
+	return nodes[node].parent;
+}
+
+/** Returns black height of a subtree in one pass, or -1 if it is unequal somewhere
+ * @node The root of the subtree */
+template <typename ElemType, std::size_t N>
+int FixedRedBlackTree<ElemType, N>::blackHeight(const Index node) const {
+	if (node == kNil) return 1; // 1 for leaves
+	int left = blackHeight(nodes[node].lChild);
+	int right = blackHeight(nodes[node].rChild);
+	if (left == -1 || left != right) return -1;
+	if (nodes[node].red) return left;
+	return left + 1;
+}
+
+/** Verifies the tree in O(N) */
+template <typename ElemType, std::size_t N>
+bool FixedRedBlackTree<ElemType, N>::verifyProperties() const {
+	if (isRed(root) || blackHeight(root) == -1) return false;
+	if (root != kNil && nodes[root].parent != kNil) return false;
+	std::size_t free = 0;
+	for (Index node = freeList; node != kNil; node = nodes[node].lChild)
+		if (++free > N) return false; // Cycle
+	if (numNodes + free != used) return false;
+	std::size_t visited = 0;
+	std::size_t sum = 0;
+	Index prev = kNil;
+	for (Index node = (root == kNil) ? kNil : leftmost(root); node != kNil; node = nextNode(node)) {
+		const Node& currNode = nodes[node];
+		if (currNode.lChild != kNil && nodes[currNode.lChild].parent != node) return false;
+		if (currNode.rChild != kNil && nodes[currNode.rChild].parent != node) return false;
+		if (currNode.red && (isRed(currNode.lChild) || isRed(currNode.rChild))) return false;
+		if (prev != kNil && !(nodes[prev].value < currNode.value)) return false;
+		if (currNode.count == 0) return false;
+		sum += currNode.count;
+		prev = node;
+		visited++;
+	}
+	return visited == numNodes && sum == static_cast<std::size_t>(numElems);
+}
+
+#endif // FIXEDREDBLACKTREE_H
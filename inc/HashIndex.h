@@ -0,0 +1,249 @@
+#ifndef HASHINDEX_H
+#define HASHINDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Open addressing hash table from values to the tree nodes holding them, used by
+ * RedBlackTree to answer point lookups without descending the tree.
+ *
+ * The table stores node pointers only; the key of a slot is its node's value.
+ * Each slot keeps the hash of that value too, so a probe past a slot with a
+ * different hash never touches the node. Collisions are resolved by linear
+ * probing, and erasing shifts later entries of the run back, so no deleted
+ * markers pile up. The table doubles at half full and starts at 16 slots.
+ *
+ * Types without a usable std::hash get an empty index that holds nothing, so
+ * trees of them compile unchanged but cannot turn the index on.
+ *
+ */
+
+/** Whether std::hash<ElemType> can be constructed and called */
+template <typename ElemType, typename = void>
+struct Hashable: std::false_type {};
+
+template <typename ElemType>
+struct Hashable<ElemType, decltype(static_cast<void>(std::hash<ElemType>()(std::declval<const ElemType&>())))>:
+    std::true_type {};
+
+/** Whether hashing a value cannot throw. True for types that cannot be hashed at all */
+template <typename ElemType, bool = Hashable<ElemType>::value>
+struct NothrowHashable: std::true_type {};
+
+template <typename ElemType>
+struct NothrowHashable<ElemType, true>:
+    std::integral_constant<bool, noexcept(std::hash<ElemType>()(std::declval<const ElemType&>()))> {};
+
+template <typename ElemType, typename Node, bool Enabled = Hashable<ElemType>::value>
+class HashIndex {
+public:
+    /** Constructor. Allocates nothing until the first insert. */
+    HashIndex();
+
+    /** Adds a node. Its value must not be in the table yet. */
+    void insert(Node* const node);
+
+    /** Returns the node holding value. NULL if there is none */
+    Node* find(const ElemType& value) const;
+
+    /** Removes a node */
+    void erase(const Node* const node);
+
+    /** Points the entry of oldNode at newNode, which holds the same value. oldNode is
+     * not dereferenced, so its value may have been moved out. */
+    void replace(const Node* const oldNode, Node* const newNode);
+
+    /** Removes every node and sizes the table for expected nodes */
+    void reset(const std::size_t expected);
+
+    /** Allocates ahead what reset(expected) needs, so that reset cannot throw */
+    void reserve(const std::size_t expected);
+
+    /** Returns the number of nodes */
+    std::size_t size() const;
+
+    /** Returns the bytes held by the table */
+    std::size_t bytes() const;
+
+private:
+    struct Slot {
+	    std::size_t hash;
+	    Node* node; // NULL => Empty
+    };
+
+    std::vector<Slot> slots; // Size is zero or a power of two
+    std::size_t numNodes;
+
+    /** Mixes std::hash, which is the identity for integers on common libraries */
+    static std::size_t hashOf(const ElemType& value);
+
+    /** Returns the table size reset() picks for expected nodes */
+    static std::size_t capacityFor(const std::size_t expected);
+
+    /** Returns the slot holding node, whose value is value */
+    std::size_t slotOf(const ElemType& value, const Node* const node) const;
+
+    /** Moves every node into a table of the given size */
+    void grow(const std::size_t capacity);
+
+    /** Places a node into the first empty slot of its run */
+    void place(const std::size_t hash, Node* const node);
+};
+
+/** Stand-in for types that cannot be hashed */
+template <typename ElemType, typename Node>
+class HashIndex<ElemType, Node, false> {
+public:
+    void insert(Node* const) {}
+    Node* find(const ElemType&) const { return NULL; }
+    void erase(const Node* const) {}
+    void replace(const Node* const, Node* const) {}
+    void reset(const std::size_t) {}
+    void reserve(const std::size_t) {}
+    std::size_t size() const { return 0; }
+    std::size_t bytes() const { return 0; }
+};
+
+/** Implementation details */
+
+/** Constructor */
+template <typename ElemType, typename Node, bool Enabled>
+HashIndex<ElemType, Node, Enabled>::HashIndex():
+	numNodes(0)
+{}
+
+/** Adds a node, growing first if the table would be over half full
+ * @node The node */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::insert(Node* const node) {
+	if (2 * (numNodes + 1) > slots.size()) grow((slots.empty()) ? 16 : 2 * slots.size());
+	place(hashOf(node->value), node);
+	numNodes++;
+}
+
+/** Probes from the home slot of value until an empty slot
+ * @value Value being searched for */
+template <typename ElemType, typename Node, bool Enabled>
+Node* HashIndex<ElemType, Node, Enabled>::find(const ElemType& value) const {
+	if (slots.empty()) return NULL;
+	std::size_t hash = hashOf(value);
+	std::size_t mask = slots.size() - 1;
+	for (std::size_t i = hash & mask; slots[i].node != NULL; i = (i + 1) & mask)
+		if (slots[i].hash == hash && slots[i].node->value == value) return slots[i].node;
+	return NULL;
+}
+
+/** Empties the node's slot, then moves back each later entry of the run that may
+ * sit in the gap without passing its home slot
+ * @node The node */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::erase(const Node* const node) {
+	std::size_t mask = slots.size() - 1;
+	std::size_t gap = slotOf(node->value, node);
+	for (std::size_t i = (gap + 1) & mask; slots[i].node != NULL; i = (i + 1) & mask) {
+		std::size_t home = slots[i].hash & mask;
+		if (((i - home) & mask) < ((i - gap) & mask)) continue; // Would move before home
+		slots[gap] = slots[i];
+		gap = i;
+	}
+	slots[gap].node = NULL;
+	numNodes--;
+}
+
+/** Repoints an entry
+ * @oldNode The node in the table
+ * @newNode The node replacing it */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::replace(const Node* const oldNode, Node* const newNode) {
+	slots[slotOf(newNode->value, oldNode)].node = newNode;
+}
+
+/** Clears the table, freeing it if no nodes are expected
+ * @expected The number of nodes about to be inserted */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::reset(const std::size_t expected) {
+	numNodes = 0;
+	if (expected == 0) { // Free the table
+		std::vector<Slot>().swap(slots);
+		return;
+	}
+	slots.assign(capacityFor(expected), Slot());
+}
+
+/** Grows the storage of the table without changing its contents
+ * @expected The number of nodes a later reset() expects */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::reserve(const std::size_t expected) {
+	if (expected != 0) slots.reserve(capacityFor(expected));
+}
+
+/** Returns the smallest power of two table at most half full
+ * @expected The number of nodes */
+template <typename ElemType, typename Node, bool Enabled>
+std::size_t HashIndex<ElemType, Node, Enabled>::capacityFor(const std::size_t expected) {
+	std::size_t capacity = 16;
+	while (capacity < 2 * expected) capacity *= 2;
+	return capacity;
+}
+
+/** Returns the node count */
+template <typename ElemType, typename Node, bool Enabled>
+std::size_t HashIndex<ElemType, Node, Enabled>::size() const {
+	return numNodes;
+}
+
+/** Returns the table size in bytes */
+template <typename ElemType, typename Node, bool Enabled>
+std::size_t HashIndex<ElemType, Node, Enabled>::bytes() const {
+	return slots.capacity() * sizeof(Slot);
+}
+
+/** Multiplies by 2^64 / phi and folds the high bits down, so every bit of the hash
+ * reaches the low bits used to pick a slot
+ * @value The value */
+template <typename ElemType, typename Node, bool Enabled>
+std::size_t HashIndex<ElemType, Node, Enabled>::hashOf(const ElemType& value) {
+	std::uint64_t hash = static_cast<std::uint64_t>(std::hash<ElemType>()(value)) * 0x9e3779b97f4a7c15ULL;
+	return static_cast<std::size_t>(hash ^ (hash >> 32));
+}
+
+/** Probes for a node by pointer
+ * @value The value of the node
+ * @node A node in the table */
+template <typename ElemType, typename Node, bool Enabled>
+std::size_t HashIndex<ElemType, Node, Enabled>::slotOf(const ElemType& value, const Node* const node) const {
+	std::size_t mask = slots.size() - 1;
+	std::size_t i = hashOf(value) & mask;
+	while (slots[i].node != node) i = (i + 1) & mask;
+	return i;
+}
+
+/** Rehashes into a larger table
+ * @capacity The new number of slots */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::grow(const std::size_t capacity) {
+	std::vector<Slot> old(capacity, Slot());
+	old.swap(slots);
+	for (std::size_t i = 0; i < old.size(); i++)
+		if (old[i].node != NULL) place(old[i].hash, old[i].node);
+}
+
+/** Probes linearly for an empty slot
+ * @hash The hash of the node's value
+ * @node The node */
+template <typename ElemType, typename Node, bool Enabled>
+void HashIndex<ElemType, Node, Enabled>::place(const std::size_t hash, Node* const node) {
+	std::size_t mask = slots.size() - 1;
+	std::size_t i = hash & mask;
+	while (slots[i].node != NULL) i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].node = node;
+}
+
+#endif // HASHINDEX_H
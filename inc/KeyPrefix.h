@@ -0,0 +1,90 @@
+#ifndef KEYPREFIX_H
+#define KEYPREFIX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Key traits hook that lets RedBlackTree keep a short prefix of each value inline
+ * in its node, so most comparisons are decided without touching the value.
+ *
+ * KeyPrefix<ElemType>::make() must map values to integers such that a smaller
+ * prefix always means a smaller value. Equal prefixes decide nothing, and the
+ * values themselves are compared. Specialize KeyPrefix to enable it for a type;
+ * types without a specialization store nothing extra.
+ *
+ */
+
+template <typename ElemType>
+struct KeyPrefix {
+    static const bool enabled = false;
+};
+
+/** Strings use their first 8 bytes, big-endian and zero padded, which orders the
+ * same way as std::string's char_traits comparison */
+template <>
+struct KeyPrefix<std::string> {
+    static const bool enabled = true;
+
+    /** Returns the prefix of a string */
+    static std::uint64_t make(const std::string& value) {
+	    std::uint64_t prefix = 0;
+	    const std::size_t length = (value.size() < 8) ? value.size() : 8;
+	    for (std::size_t i = 0; i < length; i++)
+		    prefix |= static_cast<std::uint64_t>(static_cast<unsigned char>(value[i])) << (56 - 8 * i);
+	    return prefix;
+    }
+};
+
+/** Base of the tree's nodes. Empty unless prefixes are enabled for ElemType. */
+template <typename ElemType, bool Enabled = KeyPrefix<ElemType>::enabled>
+struct PrefixSlot {
+    void setPrefix(const ElemType&) {}
+};
+
+template <typename ElemType>
+struct PrefixSlot<ElemType, true> {
+    std::uint64_t prefix;
+
+    void setPrefix(const ElemType& value) {
+	    prefix = KeyPrefix<ElemType>::make(value);
+    }
+};
+
+/** A value being searched for. Its prefix is computed once per search. */
+template <typename ElemType, bool Enabled = KeyPrefix<ElemType>::enabled>
+class KeyProbe {
+public:
+    explicit KeyProbe(const ElemType& value): value(value) {}
+
+    /** Returns a negative number, zero or a positive number as the value is less
+     * than, equal to or greater than the value of node */
+    template <typename Node>
+    int compare(const Node* const node) const {
+	    if (value == node->value) return 0;
+	    return (value < node->value) ? -1 : 1;
+    }
+
+    const ElemType& value;
+};
+
+template <typename ElemType>
+class KeyProbe<ElemType, true> {
+public:
+    explicit KeyProbe(const ElemType& value): value(value), prefix(KeyPrefix<ElemType>::make(value)) {}
+
+    /** Compares prefixes, and the values only when the prefixes are equal */
+    template <typename Node>
+    int compare(const Node* const node) const {
+	    if (prefix != node->prefix) return (prefix < node->prefix) ? -1 : 1;
+	    if (value == node->value) return 0;
+	    return (value < node->value) ? -1 : 1;
+    }
+
+    const ElemType& value;
+    const std::uint64_t prefix;
+};
+
+#endif // KEYPREFIX_H
@@ -0,0 +1,115 @@
+#ifndef NODEARENA_H
+#define NODEARENA_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Bump allocator used by RedBlackTree::compact() to lay nodes out next to each
+ * other in the order they will be visited.
+ *
+ * Storage comes from chunks aligned to their own size, so any slot finds its
+ * chunk by masking its address. Each chunk counts the slots handed out from it,
+ * plus one while it is the arena's open chunk, and is freed when that count
+ * drops to zero. Slots can therefore be released from any tree or thread, in
+ * any order, long after the arena that made them is gone.
+ *
+ */
+
+class NodeArena {
+public:
+    /** Size and alignment of every chunk */
+    static const std::size_t kChunkBytes = 1 << 16;
+
+    /** Constructor */
+    NodeArena();
+
+    /** Releases the open chunk. Slots already handed out stay valid. */
+    ~NodeArena();
+
+    /** Returns storage for one object, placed right after the previous one when
+     * it fits in the open chunk. NULL if the object can never fit in a chunk. */
+    void* allocate(const std::size_t size, const std::size_t align);
+
+    /** Starts a new chunk on the next allocate(), so a new layout does not
+     * continue inside an old one */
+    void seal();
+
+    /** Returns a slot from allocate(). Safe to call from any thread. */
+    static void release(void* const slot);
+
+private:
+    struct Chunk {
+	    std::atomic<std::size_t> refs; // Live slots, plus one while open
+    };
+
+    Chunk* open; // NULL => Allocate a new chunk first
+    std::size_t used; // Bytes of the open chunk in use
+
+    NodeArena(const NodeArena&);
+    NodeArena& operator= (const NodeArena&);
+
+    /** Drops one reference to a chunk, freeing it on the last one */
+    static void unref(Chunk* const chunk);
+};
+
+/** Implementation details */
+
+/** Constructor */
+inline NodeArena::NodeArena():
+	open(NULL),
+	used(0)
+{}
+
+/** Destructor */
+inline NodeArena::~NodeArena() {
+	seal();
+}
+
+/** Bumps the fill mark of the open chunk
+ * @size The size of the object
+ * @align The alignment of the object */
+inline void* NodeArena::allocate(const std::size_t size, const std::size_t align) {
+	std::size_t start = (sizeof(Chunk) + align - 1) / align * align;
+	if (start + size > kChunkBytes) return NULL; // Too large for any chunk
+	if (open != NULL) {
+		start = (used + align - 1) / align * align;
+		if (start + size > kChunkBytes) seal(); // Full
+	}
+	if (open == NULL) {
+		open = new (::operator new(kChunkBytes, std::align_val_t(kChunkBytes))) Chunk;
+		open->refs = 1;
+		used = sizeof(Chunk);
+		start = (used + align - 1) / align * align;
+	}
+	open->refs.fetch_add(1);
+	used = start + size;
+	return reinterpret_cast<char*>(open) + start;
+}
+
+/** Lets go of the open chunk */
+inline void NodeArena::seal() {
+	if (open != NULL) unref(open);
+	open = NULL;
+	used = 0;
+}
+
+/** Releases a slot
+ * @slot Storage returned by allocate(), with its object already destroyed */
+inline void NodeArena::release(void* const slot) {
+	std::uintptr_t address = reinterpret_cast<std::uintptr_t>(slot);
+	unref(reinterpret_cast<Chunk*>(address & ~static_cast<std::uintptr_t>(kChunkBytes - 1)));
+}
+
+/** Drops a reference
+ * @chunk The chunk */
+inline void NodeArena::unref(Chunk* const chunk) {
+	if (chunk->refs.fetch_sub(1) != 1) return;
+	chunk->~Chunk();
+	::operator delete(chunk, std::align_val_t(kChunkBytes));
+}
+
+#endif // NODEARENA_H
@@ -0,0 +1,113 @@
+#ifndef RECLAIMER_H
+#define RECLAIMER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Background thread that runs cleanup jobs, used by RedBlackTree to free
+ * detached subtrees off the calling thread.
+ *
+ * Jobs are run one at a time in the order they were posted. post() never
+ * blocks on a running job, so handing off a large subtree costs the caller
+ * one queue push.
+ *
+ */
+
+class Reclaimer {
+public:
+    /** Starts the background thread */
+    Reclaimer();
+
+    /** Runs the jobs still queued and joins the thread */
+    ~Reclaimer();
+
+    /** Queues a job to run on the background thread */
+    void post(const std::function<void()>& job);
+
+    /** Waits until every job posted so far has finished */
+    void drain();
+
+    /** Returns a reclaimer shared by all trees */
+    static Reclaimer& shared();
+
+private:
+    std::deque<std::function<void()> > jobs;
+    std::mutex lock;
+    std::condition_variable ready; // Jobs were posted or stopping was set
+    std::condition_variable idle; // The queue ran empty
+    bool stopping;
+    bool busy; // Guarded by lock. A job is running
+    std::thread worker;
+
+    Reclaimer(const Reclaimer&);
+    Reclaimer& operator= (const Reclaimer&);
+
+    /** Loop run by the background thread */
+    void run();
+};
+
+/** Implementation details */
+
+/** Constructor */
+inline Reclaimer::Reclaimer():
+	stopping(false),
+	busy(false),
+	worker(&Reclaimer::run, this)
+{}
+
+/** Destructor */
+inline Reclaimer::~Reclaimer() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		stopping = true;
+	}
+	ready.notify_all();
+	worker.join();
+}
+
+/** Queues a job
+ * @job Called once on the background thread */
+inline void Reclaimer::post(const std::function<void()>& job) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		jobs.push_back(job);
+	}
+	ready.notify_one();
+}
+
+/** Waits for the queue to run empty */
+inline void Reclaimer::drain() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (busy || !jobs.empty()) idle.wait(guard);
+}
+
+/** Returns the shared reclaimer. It is never destroyed, so trees that are destroyed
+ * during static destruction can still post to it. */
+inline Reclaimer& Reclaimer::shared() {
+	static Reclaimer* reclaimer = new Reclaimer;
+	return *reclaimer;
+}
+
+/** Runs jobs until stopping is set and the queue is empty */
+inline void Reclaimer::run() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		while (!stopping && jobs.empty()) ready.wait(guard);
+		if (jobs.empty()) return; // Stopping with nothing left to do
+		std::function<void()> job = jobs.front();
+		jobs.pop_front();
+		busy = true;
+		guard.unlock();
+		job();
+		guard.lock();
+		busy = false;
+		if (jobs.empty()) idle.notify_all();
+	}
+}
+
+#endif // RECLAIMER_H
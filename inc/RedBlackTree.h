@@ -4,6 +4,23 @@
 #include <sstream>
 #include <queue>
 #include <iostream>
+#include <ostream>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include "ThreadPool.h"
+#include "Reclaimer.h"
+#include "NodeArena.h"
+#include "KeyPrefix.h"
+#include "BalancePolicies.h"
+#include "TraceRecorder.h"
+#include "HashIndex.h"
+#include "ChangeFeed.h"
 
 /** Copyright (c) 2014 Evan Liu
  *
@@ -17,6 +34,10 @@
  * 4) Any path from a node to its descendant leaves has the same number of
  * black nodes. 
  *
+ * The balancing is a policy (see BalancePolicies.h). RedBlackBalance gives the
+ * properties above; LeftLeaningBalance, AvlBalance and WavlBalance keep the same
+ * public API with different height and rotation trade-offs.
+ *
  * Resources used:
  *
  * MIT OpenCourseware Lecture
@@ -24,18 +45,91 @@
  *
  */
 
-template <typename ElemType>
+/** Base of the tree's nodes. Holds the Merkle hash of the node's subtree only in
+ * trees declared with Merkle set, so other trees pay nothing for it. */
+template <bool Enabled>
+struct HashSlot {
+    std::uint64_t hash() const { return 0; }
+    void setHash(const std::uint64_t) {}
+};
+
+template <>
+struct HashSlot<true> {
+    std::uint64_t subtreeHash; // Sum of pairHash() over the subtree, while merkleHashes is set
+
+    std::uint64_t hash() const { return subtreeHash; }
+    void setHash(const std::uint64_t value) { subtreeHash = value; }
+};
+
+template <typename ElemType, typename Balance = RedBlackBalance, bool Merkle = false>
 class RedBlackTree {
 friend class RedBlackTreeTest;
+friend class BalanceAccess;
 public:
+    /** Owns a node detached from a tree, along with all of its duplicates */
+    class NodeHandle;
+    typedef NodeHandle node_type;
+
+    /** Where a value sits in the tree, as returned by find() */
+    class Position;
+
+    /** Whether the removals that do not throw are noexcept: comparing, hashing, copying
+     * and destroying values must not throw. Those removals absorb running out of memory
+     * by keeping tombstones or queued nodes for later, and trace errors stay in the
+     * recorder's stream. */
+    static constexpr bool kNothrowRemove =
+	    noexcept(std::declval<const ElemType&>() < std::declval<const ElemType&>()) &&
+	    noexcept(std::declval<const ElemType&>() == std::declval<const ElemType&>()) &&
+	    NothrowHashable<ElemType>::value && std::is_nothrow_copy_assignable<ElemType>::value &&
+	    std::is_nothrow_destructible<ElemType>::value;
+
+    /** A single insert or remove, as passed to applyBatch() */
+    struct BatchOp {
+	    ElemType value;
+	    bool insert; // False => Remove
+	    std::size_t copies = 1; // Number of copies inserted or removed
+    };
+
+    /** Bytes held by a tree, as returned by memoryUsage() */
+    struct MemoryUsage {
+	    std::size_t nodes; // Including tombstones
+	    std::size_t pooledNodes; // Nodes laid out by compact() in NodeArena chunks
+	    std::size_t nodeBytes; // sizeof(Node) for every node
+	    std::size_t overheadBytes; // Estimated malloc headers and rounding
+	    std::size_t treeBytes; // The tree object and its free queue array
+	    std::size_t indexBytes; // The hash index table, if enabled
+	    std::size_t totalBytes;
+	    double bytesPerKey; // totalBytes / size(). 0 if empty
+    };
+
+    /** Shape of a tree, as returned by shapeStats() */
+    struct ShapeStats {
+	    int height; // Edges on the longest path. -1 if empty
+	    int blackHeight; // Black nodes from the root to the leftmost NULL leaf, counting the leaf
+	    double averageDepth; // Mean depth of a lookup hit, weighted by duplicate counts
+	    int maxDepth; // Depth of the deepest node, which equals height
+	    double redRatio; // Red nodes over all nodes
+	    std::size_t distinct; // Live nodes
+	    std::size_t tombstones;
+	    std::size_t maxCount; // Largest duplicate count
+	    std::vector<std::size_t> duplicates; // [i] => Live nodes with count in [2^i, 2^(i+1))
+    };
+
+    /** A value whose count differs between two trees, as returned by diff() */
+    struct DiffEntry {
+	    ElemType value;
+	    std::size_t count; // In this tree
+	    std::size_t otherCount; // In the other tree
+    };
+
     /** Constructor */
     RedBlackTree();
 
     /** Copy Constructor */
-    RedBlackTree(const RedBlackTree<ElemType> &other);
+    RedBlackTree(const RedBlackTree<ElemType, Balance, Merkle> &other);
 
     /** Assignment Operator */
-    RedBlackTree<ElemType>& operator= (const RedBlackTree<ElemType> &other);
+    RedBlackTree<ElemType, Balance, Merkle>& operator= (const RedBlackTree<ElemType, Balance, Merkle> &other);
 
     /** Destructor */
     ~RedBlackTree();
@@ -43,6 +137,23 @@ public:
     /** Inserts an element */
     void insert(const ElemType& value);
 
+    /** Inserts value without searching if it is larger than every value in the tree,
+     * as in a stream of increasing keys. Returns false, changing nothing, otherwise. */
+    bool append(const ElemType& value);
+
+    /** Links a node extracted from a tree back in without allocating. If the value is
+     * already in the tree, the handle's count is added to it. The handle is left empty. */
+    void insert(NodeHandle&& handle);
+
+    /** Detaches the node holding value, with all of its duplicates, without freeing it.
+     * Returns an empty handle if the value is not in the tree. */
+    NodeHandle extract(const ElemType& value);
+
+    /** Moves every node of other into this tree without allocating or copying values.
+     * other is left empty. Tombstones of a lazy other are dropped unless this tree is
+     * lazy too. */
+    void merge(RedBlackTree<ElemType, Balance, Merkle>& other);
+
     /** Returns the number of elements in the tree */
     int size() const;
 
@@ -55,6 +166,19 @@ public:
     /** Prints out the tree */
     void print() const;
 
+    /** Streams the tree to out in Graphviz DOT format. Nodes deeper than maxDepth
+     * (root is depth 0) are skipped; a negative maxDepth exports the whole tree. */
+    void exportDot(std::ostream& out, const int maxDepth = -1) const;
+
+    /** Streams the part of the tree with values in [lo, hi] in Graphviz DOT format */
+    void exportDot(std::ostream& out, const ElemType& lo, const ElemType& hi, const int maxDepth = -1) const;
+
+    /** Streams the tree to out as nested JSON objects */
+    void exportJson(std::ostream& out, const int maxDepth = -1) const;
+
+    /** Streams the part of the tree with values in [lo, hi] as nested JSON objects */
+    void exportJson(std::ostream& out, const ElemType& lo, const ElemType& hi, const int maxDepth = -1) const;
+
     /** Checks if an element is in the tree */
     bool contains(const ElemType& value) const;
 
@@ -63,56 +187,254 @@ public:
 
     /** Deletes a node corresponding to the value if it exists in the tree */
     void remove(const ElemType &value);
+
+    /** Deletes one copy of value. Returns false instead of throwing if it is not in the tree */
+    bool tryRemove(const ElemType& value) noexcept(kNothrowRemove);
+
+    /** Deletes up to n copies of value and returns how many were deleted */
+    std::size_t removeN(const ElemType& value, const std::size_t n) noexcept(kNothrowRemove);
+
+    /** Deletes every copy of value and returns how many there were */
+    std::size_t eraseAll(const ElemType& value) noexcept(kNothrowRemove);
+
+    /** Returns the position of value, or an empty position if it is not in the tree */
+    Position find(const ElemType& value) const;
+
+    /** Deletes up to n copies of the value at position without searching for it, and
+     * returns how many were deleted. An empty position deletes nothing. */
+    std::size_t erase(const Position& position, const std::size_t n = 1) noexcept(kNothrowRemove);
+
+    /** Returns the smallest value in O(1). Throws std::out_of_range if the tree is empty.
+     * Both ends are kept free of tombstones, so neither has to skip any. */
+    const ElemType& min() const;
+
+    /** Returns the largest value in O(1). Throws std::out_of_range if the tree is empty */
+    const ElemType& max() const;
+
+    /** Removes one copy of the smallest value and returns it, without searching */
+    ElemType popMin();
+
+    /** Removes one copy of the largest value and returns it, without searching */
+    ElemType popMax();
+
+    /** Returns the number of elements with values in [lo, hi], counting duplicates */
+    std::size_t countRange(const ElemType& lo, const ElemType& hi) const;
+
+    /** Deletes every element with a value in [lo, hi] and returns how many there were.
+     * Costs O(k log n) for k distinct values in the range, and O(n) once they are
+     * half of the tree. */
+    std::size_t removeRange(const ElemType& lo, const ElemType& hi);
+
+    /** Deletes the elements with values less than cutoff from the front of the tree, at
+     * most maxNodes distinct values per call, and returns how many were deleted. No
+     * search is needed, and each deleted value costs amortized O(1). */
+    std::size_t removeBelow(const ElemType& cutoff, const std::size_t maxNodes = static_cast<std::size_t>(-1));
     
     /** Clears the tree */
     void clear();
 
+    /** Sets the pool used to copy and free large trees. NULL => ThreadPool::shared() */
+    void setThreadPool(ThreadPool* const pool);
+
+    /** Logs every insert(), remove(), contains() and count() call to recorder, which
+     * must outlive the tree or be unset first. NULL stops recording. Integral values only. */
+    void setRecorder(TraceRecorder* const recorder);
+
+    /** Publishes every insert(), remove(), popMin(), popMax(), extract() and clear() to
+     * feed from now on. applyBatch(), removeRange(), merge() and assignment publish
+     * kChangeResync instead. feed must outlive the tree or be unsubscribed first, and
+     * copies of the tree do not inherit it. */
+    void subscribe(ChangeFeed<ElemType>* const feed);
+
+    /** Stops publishing to feed */
+    void unsubscribe(ChangeFeed<ElemType>* const feed);
+
+    /** Returns the number of edges on the longest path from the root to a leaf. -1 if empty */
+    int height() const;
+
+    /** Returns the number of rotations done since the tree was made */
+    std::size_t rotations() const;
+
+    /** Counts the bytes the tree holds in one O(n) pass. Nodes still waiting in the
+     * deferred free queue are not counted. */
+    MemoryUsage memoryUsage() const;
+
+    /** Measures depths, colors and duplicates in one O(n) pass without recursion.
+     * blackHeight and redRatio only mean something under the red-black policies. */
+    ShapeStats shapeStats() const;
+
+    /** Applies a batch of inserts and removes in key order. Operations on the same
+     * value keep their relative order. Returns the number of copies removes did not
+     * find; unlike remove(), these do not throw. */
+    std::size_t applyBatch(std::vector<BatchOp> ops);
+
+    /** Calls visit(value, count) for every distinct value in order */
+    template <typename Visitor>
+    void forEach(Visitor visit) const;
+
+    /** Calls visit(value, count) for every distinct value, splitting the tree by subtree
+     * across the pool. Calls run concurrently and in no particular order. */
+    template <typename Visitor>
+    void parallelForEach(Visitor visit) const;
+
+    /** Folds map(value, count) over every distinct value with combine, splitting the tree
+     * by subtree across the pool. combine must be associative with init as its identity.
+     * Partial results are combined in value order, so combine need not be commutative. */
+    template <typename Result, typename Mapper, typename Combiner>
+    Result parallelReduce(const Result& init, Mapper map, Combiner combine) const;
+
+    /** Returns a tree of the same shape with each value replaced by map(value), mapping
+     * subtrees in parallel. map must be strictly increasing so the values stay sorted. */
+    template <typename Mapper>
+    RedBlackTree<ElemType, Balance, Merkle> parallelTransform(Mapper map) const;
+
+    /** Makes remove() mark a value's last copy as a tombstone (count 0) instead of
+     * unlinking it. Once tombstones exceed maxTombstones of all entries, the tree is
+     * rebuilt without them. Turning the mode off removes all tombstones. */
+    void setLazyRemove(const bool lazy, const double maxTombstones = 0.25);
+
+    /** Returns the number of tombstones still linked into the tree */
+    std::size_t tombstones() const;
+
+    /** Visits at most maxNodes nodes, continuing from where the last call stopped, and
+     * unlinks the tombstones among them. Returns the number removed. */
+    std::size_t purgeTombstones(const std::size_t maxNodes);
+
+    /** Makes clear() hand its nodes to a free queue instead of freeing them. Each later
+     * insert(), remove(), applyBatch() or clear() frees at most maxFrees queued nodes.
+     * With background set, Reclaimer::shared() frees them instead. maxFrees of 0 and
+     * no background frees immediately, as by default. */
+    void setDeferredFree(const std::size_t maxFrees, const bool background = false);
+
+    /** Keeps a hash table from values to nodes, so contains(), count(), remove() and
+     * extract() find their node in O(1) expected time instead of descending the tree.
+     * Costs 32 to 64 bytes per distinct value. Turning it off frees the table. */
+    void setHashIndex(const bool enabled);
+
+    /** Keeps a hash of the (value, count) pairs below every node. The hash of a set of
+     * pairs does not depend on the shape holding them, so trees can be compared in O(1)
+     * and diffed in time proportional to their difference. Turning it on costs O(n).
+     * Only trees declared with Merkle set have room for the hashes. */
+    void setMerkleHashes(const bool enabled);
+
+    /** Returns the hash of all (value, count) pairs, 0 if empty. Equal contents give
+     * equal hashes. Throws std::logic_error if Merkle hashes are off. */
+    std::uint64_t contentHash() const;
+
+    /** Checks in O(1) if other holds the same values with the same counts. Different
+     * contents compare equal only on a 64 bit hash collision. Both trees need Merkle
+     * hashes on. */
+    bool sameContents(const RedBlackTree<ElemType, Balance, Merkle>& other) const;
+
+    /** Returns every value whose count differs from other's, in order. Only subtrees
+     * whose hash differs from other's hash of the same value range are entered, so d
+     * differences cost O(d log^2 n). Both trees need Merkle hashes on. */
+    std::vector<DiffEntry> diff(const RedBlackTree<ElemType, Balance, Merkle>& other) const;
+
+    /** Frees up to maxNodes queued nodes now. Returns the number freed. */
+    std::size_t reclaim(const std::size_t maxNodes);
+
+    /** Returns if nodes are queued to be freed by later operations */
+    bool reclaimPending() const;
+
+    /** Moves every node into contiguous storage in van Emde Boas order, keeping the
+     * shape, colors and ranks of the tree. Values are copied if their move may throw,
+     * and a throwing copy leaves the tree unchanged. */
+    void compact();
+
+    /** Moves the next subtrees of the tree, at most maxNodes nodes, into contiguous
+     * storage, continuing from where the last call stopped. Returns the number moved. */
+    std::size_t compactStep(const std::size_t maxNodes);
+
 private:
-    typedef struct Node {
+    typedef struct Node: PrefixSlot<ElemType>, HashSlot<Merkle> { // Prefix and hash slots are empty unless enabled
 	    Node* parent;
 	    ElemType value;
 	    bool red; // False => Black
+	    signed char rank; // Height or rank, for rank balanced policies
+	    bool pooled; // Lives in a NodeArena chunk instead of its own allocation
 	    Node* lChild;
 	    Node* rChild;
 	    std::size_t count; // For any duplicates 
     } Node;
 
     Node* root;
+    Node* minNode; // Leftmost node. NULL if empty
+    Node* maxNode; // Rightmost node. NULL if empty
     int numElems;
+    ThreadPool* threadPool; // NULL => ThreadPool::shared()
+    std::size_t numRotations;
+    bool lazyRemove;
+    double maxTombstoneFraction;
+    std::size_t numTombstones;
+    std::size_t numNodes; // Linked nodes, one per distinct value or tombstone
+    Node* purgeCursor; // Next node for purgeTombstones(). NULL => Start over
+    std::size_t maxFreesPerOp; // 0 => Free immediately unless backgroundFree
+    bool backgroundFree;
+    std::vector<Node*> freeQueue; // Detached subtrees, freed from the back
+    NodeArena arena; // Storage for compacted nodes
+    Node* compactCursor; // First node of the next compactStep(). NULL => Start over
+    TraceRecorder* recorder; // NULL => Not recording
+    bool hashIndex;
+    HashIndex<ElemType, Node> index; // Every linked node, while hashIndex is set
+    std::vector<ChangeFeed<ElemType>*> feeds; // Subscribers
+    bool merkleHashes;
+
+    /** A part of the tree handed to one parallel task */
+    struct Piece {
+	    Node* node;
+	    bool whole; // False => Just node, whose subtrees are pieces of their own
+	    std::size_t estimate; // Estimated size of the subtree, if whole
+    };
+
+    /** Trees with fewer elements are copied, freed and traversed on the calling thread only */
+    static const int kParallelThreshold = 1 << 16;
+
+    /** Records an operation if a recorder is set */
+    void trace(const TraceOp op, const ElemType& value) const;
+
+    /** Publishes a change to every subscribed feed */
+    void publish(const ChangeOp op, const ElemType& value, const std::size_t count) const;
 
     /** Recursively inserts a new value to the tree */
-    void recursiveInsert(const ElemType& value, Node* currNode);
+    void recursiveInsert(const KeyProbe<ElemType>& probe, Node* currNode);
+
+    /** Links a detached node into the tree, merging it into an equal node if there is one */
+    void insertNode(Node* const node);
 
     /** Makes a new node with value equal to value */
-    Node* makeNode(const ElemType& value, Node* const parent, const bool red = true) const;
+    Node* makeNode(const ElemType& value, Node* const parent) const;
 
     /** Recursively deletes the tree */
     void recursiveDelete(Node*& currNode);
 
-    /** Performs a single rotation */
-    void rotate(Node* child, const bool left);
+    /** Queues a detached subtree to be freed later */
+    void deferFree(Node* const subtree);
 
-    /** Returns the grandparent node */
-    Node* grandparent(const Node* const child) const;
+    /** Frees queued nodes, at most the per-operation limit */
+    void reclaimSlice();
 
-    /** Returns the Uncle node */
-    Node* uncle(const Node* const child) const;
+    /** Frees up to maxNodes nodes of the subtrees in a queue */
+    static std::size_t freeNodes(std::vector<Node*>& queue, const std::size_t maxNodes);
 
-    /** Returns sibling node */
-    Node* sibling(const Node* const child) const;
+    /** Frees a node, whether it has its own allocation or lives in an arena */
+    static void freeNode(Node* const node);
 
-    /** Fixes any errors in coloring from insertion/deletion */
-    void restoreTree(Node* const child);
+    /** Appends the top levels of a subtree to order in van Emde Boas order */
+    void layoutVeb(Node* const currNode, const int levels, std::vector<Node*>& order) const;
 
-    /** For debugging purposes: verifies that red nodes have only black children */
-    bool verifyRedChild(const Node* const currNode) const;
+    /** Lays out each subtree found depth levels below currNode in van Emde Boas order */
+    void layoutBottoms(Node* const currNode, const int depth, const int levels, std::vector<Node*>& order) const;
 
-    /** For debugging purposes: returns the blackheight of a given node recursively */
-    //TODO: Use memoization
-    int blackHeight(const Node* const currNode, const bool left) const;
+    /** Moves nodes into the arena. order[0] must be an ancestor of all the others.
+     * Leaves the tree unchanged if copying a value throws. */
+    void relocate(const std::vector<Node*>& order);
 
-    /** Recursive function to check all blackheights */
-    bool verifyBlackHeight(const Node* const currNode) const;
+    /** Returns the size of a subtree, or any value over limit once it is known to be larger */
+    std::size_t countUpTo(const Node* const currNode, const std::size_t limit) const;
+
+    /** Performs a single rotation */
+    void rotate(Node* child, const bool left);
 
     /** Recursively checks that parent and children pointers match */
     bool parentChildMatch(const Node* const currNode) const;
@@ -120,20 +442,76 @@ private:
     /** Finds the node in the tree with the given value if it exists. Returns NULL if not. */
     Node* const findNode(Node* const currNode, const ElemType &value) const;
     
-    /** Deals with all of the delete cases recursively */
+    /** Unlinks and frees a node */
     void rbDelete(Node* currNode);
 
-    /** Swaps counts and values */
-    void swap(Node* const left, Node* const right);
+    /** Deletes up to n copies held by a live node and returns how many were deleted */
+    std::size_t removeCopies(Node* const node, const std::size_t n) noexcept(kNothrowRemove);
+
+    /** Unlinks a node and rebalances, leaving the node detached */
+    void unlinkNode(Node* currNode);
+
+    /** Swaps the tree positions of a node and its in-order predecessor */
+    void swapNodes(Node* const node, Node* const pred);
 
     /** Returns in-order predecessor */
     Node* inOrderPredecessor(const Node* const node) const;
 
-    /** Returns num NULL children. 0 if given node is NULL */
-    int numNullChildren(const Node* const node) const;
+    /** Returns the next node in order. NULL if node is the last */
+    Node* nextNode(const Node* node) const;
+
+    /** Returns the previous node in order. NULL if node is the first */
+    Node* prevNode(const Node* node) const;
+
+    /** Updates minNode, maxNode and the hash index for a leaf that was just linked in */
+    void linkedLeaf(Node* const leaf);
+
+    /** Finds minNode and maxNode by walking down from the root */
+    void resetEnds();
+
+    /** Returns the node holding value, through the hash index when there is one */
+    Node* lookup(const ElemType& value) const;
+
+    /** Refills the hash index from the tree in O(n), if it is enabled */
+    void reindex();
+
+    /** Checks that the hash index holds exactly the linked nodes */
+    bool verifyIndex() const;
+
+    /** Returns the hash of one (value, count) pair. 0 for a count of 0 */
+    static std::uint64_t pairHash(const ElemType& value, const std::size_t count);
+
+    /** Returns the subtree hash of a node. 0 for NULL */
+    static std::uint64_t hashOf(const Node* const node);
+
+    /** Adds delta to the subtree hashes of a node and all of its ancestors */
+    static void addHash(Node* node, const std::uint64_t delta);
 
-    /** Restores tree properties after delete. */
-    void deleteRestoreTree(Node* const parent, const Node* const notSibling);
+    /** Updates the subtree hashes after the count of a node changed from oldCount */
+    void countChanged(Node* const node, const std::size_t oldCount);
+
+    /** Recomputes the subtree hashes of a subtree in O(n) and returns the root's */
+    static std::uint64_t rehash(Node* const currNode);
+
+    /** Returns the hash of the pairs with values strictly between lo and hi. NULL => Unbounded */
+    std::uint64_t rangeHash(const ElemType* const lo, const ElemType* const hi) const;
+
+    /** Returns the hash of the pairs with values less than bound, or not greater if inclusive */
+    std::uint64_t hashBelow(const ElemType& bound, const bool inclusive) const;
+
+    /** Appends the differences within a subtree of this tree, whose values lie strictly
+     * between lo and hi, to out */
+    void diffSubtree(const Node* const currNode, const ElemType* const lo, const ElemType* const hi,
+		     const RedBlackTree<ElemType, Balance, Merkle>& other, std::vector<DiffEntry>& out) const;
+
+    /** Checks every subtree hash against a recomputation */
+    bool verifyHashes() const;
+
+    /** Recursively checks subtree hashes. Returns the subtree's hash, or sets ok to false */
+    std::uint64_t hashSum(const Node* const currNode, bool& ok) const;
+
+    /** Returns the first node with a value not less than value. NULL if there is none */
+    Node* lowerBound(const ElemType& value) const;
 
     /** Recursive wrapper for verifying red nodes have only black children */
     bool verifyRedChild() const;
@@ -150,100 +528,828 @@ private:
     /** Copies a tree recursively */
     void copyTree(const Node* const from, Node* &into, Node* const parent) const;
 
-    /** Verfies that the sum of the counts is equal to the size */
+    /** Copies the tree at from into root, splitting large trees by subtree across the pool */
+    void parallelCopy(const Node* const from, const int numFrom);
+
+    /** Frees the tree at root, splitting large trees by subtree across the pool */
+    void parallelDelete();
+
+    /** Copies the top levels of a tree and records the subtrees left below splitDepth */
+    void copyTop(const Node* const from, Node* &into, Node* const parent, const int depth, const int splitDepth,
+		 std::vector<const Node*>& sources, std::vector<Node**>& slots, std::vector<Node*>& parents) const;
+
+    /** Frees the top levels of a tree and records the subtrees left below splitDepth */
+    void deleteTop(Node* const currNode, const int depth, const int splitDepth, std::vector<Node*>& subtrees);
+
+    /** Returns the pool for parallel work */
+    ThreadPool& pool() const;
+
+    /** Returns the depth at which large trees are split into parallel tasks */
+    int splitDepth() const;
+
+    /** Cuts the tree into pieces in value order, one task each, by splitting the largest
+     * estimated subtree until there are four subtrees per thread */
+    void splitPieces(std::vector<Piece>& pieces) const;
+
+    /** Estimates the size of a subtree from its leftmost and rightmost paths in O(log n) */
+    static std::size_t estimateSize(const Node* const currNode);
+
+    /** Calls visit(node) for every node of a piece in order */
+    template <typename Visitor>
+    static void visitPiece(const Piece& piece, Visitor& visit);
+
+    /** Recursively calls visit(node) for every node of a subtree in order */
+    template <typename Visitor>
+    static void visitSubtree(Node* const currNode, Visitor& visit);
+
+    /** Verfies that the sum of the counts is equal to the size, and that the tombstone
+     * and node counts match the tree */
     bool verifyCount() const;
 
     /** Recursively sums up the count of all descendant nodes of the currNode including
      * the currNode*/
     std::size_t countSum(const Node* const currNode) const;
 
+    /** Recursively counts the nodes with a count of zero */
+    std::size_t tombstoneSum(const Node* const currNode) const;
+
+    /** Checks that minNode and maxNode are the leftmost and rightmost nodes and are live */
+    bool verifyEnds() const;
+
     /** Wrapper for verifying all RB Properties */
     bool verifyProperties() const;
+
+    /** Returns the height of the subtree at currNode */
+    int subtreeHeight(const Node* const currNode) const;
+
+    /** Calls visit(node, depth) for every node in order, following parent pointers */
+    template <typename Visitor>
+    void forEachDepth(Visitor visit) const;
+
+    /** Returns the bytes malloc sets aside for a request, header included */
+    static std::size_t mallocBytes(const std::size_t size);
+
+    /** Appends the nodes of the subtree at currNode to nodes in order */
+    void collectNodes(Node* const currNode, std::vector<Node*>& nodes) const;
+
+    /** Links nodes[lo, hi) into a balanced subtree and returns its root */
+    Node* linkBalanced(std::vector<Node*>& nodes, const std::size_t lo, const std::size_t hi,
+		       Node* const parent, const int depth, const int redDepth);
+
+    /** Replaces the tree with a balanced tree built from sorted nodes */
+    void rebuild(std::vector<Node*>& nodes);
+
+    /** Appends a node to nodes, or frees it if it is a tombstone */
+    void keepLive(Node* const node, std::vector<Node*>& nodes);
+
+    /** Rebuilds the tree without its tombstones */
+    void dropTombstones();
+
+    /** Drops the tombstones once they are more than maxTombstoneFraction of the nodes */
+    void limitTombstones();
+
+    /** Unlinks tombstones from both ends, so minNode and maxNode hold live values */
+    void trimEnds();
+
+    /** Searches for value starting from finger instead of the root */
+    Node* fingerSearch(Node* const finger, const ElemType& value, Node*& parent) const;
+
+    /** Orders batch operations by value */
+    static bool batchLess(const BatchOp& left, const BatchOp& right);
+
+    /** Applies one batch operation to a count, adding the copies it could not remove to misses */
+    static void foldOp(const BatchOp& op, std::size_t& count, std::size_t& misses);
+
+    /** Recursively writes a node and its in-range descendants as DOT statements */
+    void exportDotNode(std::ostream& out, const Node* const currNode, const Node* const parent,
+		       const int depth, const int maxDepth, const ElemType* const lo, const ElemType* const hi) const;
+
+    /** Recursively writes a node and its in-range descendants as a JSON object */
+    void exportJsonNode(std::ostream& out, const Node* const currNode, const int depth,
+			const int maxDepth, const ElemType* const lo, const ElemType* const hi) const;
+
+    /** Writes a value as a quoted and escaped string (or bare, for arithmetic types in JSON) */
+    static void writeValue(std::ostream& out, const ElemType& value, const bool json);
+};
+
+template <typename ElemType, typename Balance, bool Merkle>
+class RedBlackTree<ElemType, Balance, Merkle>::NodeHandle {
+friend class RedBlackTree<ElemType, Balance, Merkle>;
+public:
+    /** Constructs an empty handle */
+    NodeHandle();
+
+    /** Move Constructor */
+    NodeHandle(NodeHandle&& other);
+
+    /** Move Assignment Operator */
+    NodeHandle& operator= (NodeHandle&& other);
+
+    /** Destructor. Frees the node if it was never inserted. */
+    ~NodeHandle();
+
+    /** Returns if the handle owns no node */
+    bool empty() const;
+
+    /** Returns if the handle owns a node */
+    explicit operator bool() const;
+
+    /** Returns the value of the node. It may be changed before the node is inserted. */
+    ElemType& value() const;
+
+    /** Returns the number of times the value was in the tree */
+    std::size_t count() const;
+
+private:
+    Node* node;
+
+    explicit NodeHandle(Node* const node);
+    NodeHandle(const NodeHandle&) = delete;
+    NodeHandle& operator= (const NodeHandle&) = delete;
+};
+
+/** Nodes never move when others are inserted or removed, so a position stays valid
+ * until the last copy of its value is removed, or the nodes are moved by compact(),
+ * compactStep(), merge(), clear() or assignment. */
+template <typename ElemType, typename Balance, bool Merkle>
+class RedBlackTree<ElemType, Balance, Merkle>::Position {
+friend class RedBlackTree<ElemType, Balance, Merkle>;
+public:
+    /** Constructs an empty position */
+    Position();
+
+    /** Returns if the position holds a value */
+    explicit operator bool() const;
+
+    /** Returns the value. The position must not be empty. */
+    const ElemType& value() const;
+
+    /** Returns the number of copies of the value */
+    std::size_t count() const;
+
+private:
+    Node* node;
+
+    explicit Position(Node* const node);
 };
 
 /** Implementation details */
 
 /** Constructor */
-template <typename ElemType>
-RedBlackTree<ElemType>::RedBlackTree():
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::RedBlackTree():
 	root(NULL),
-	numElems(0)
+	minNode(NULL),
+	maxNode(NULL),
+	numElems(0),
+	threadPool(NULL),
+	numRotations(0),
+	lazyRemove(false),
+	maxTombstoneFraction(0.25),
+	numTombstones(0),
+	numNodes(0),
+	purgeCursor(NULL),
+	maxFreesPerOp(0),
+	backgroundFree(false),
+	compactCursor(NULL),
+	recorder(NULL),
+	hashIndex(false),
+	merkleHashes(false)
 {}
 
 /** Copy Constructor */
-template <typename ElemType>
-RedBlackTree<ElemType>::RedBlackTree(const RedBlackTree<ElemType> &other):
-	numElems(other.numElems)
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::RedBlackTree(const RedBlackTree<ElemType, Balance, Merkle> &other):
+	root(NULL),
+	minNode(NULL),
+	maxNode(NULL),
+	numElems(other.numElems),
+	threadPool(other.threadPool),
+	numRotations(0),
+	lazyRemove(other.lazyRemove),
+	maxTombstoneFraction(other.maxTombstoneFraction),
+	numTombstones(other.numTombstones),
+	numNodes(other.numNodes),
+	purgeCursor(NULL),
+	maxFreesPerOp(other.maxFreesPerOp),
+	backgroundFree(other.backgroundFree),
+	compactCursor(NULL),
+	recorder(NULL),
+	hashIndex(other.hashIndex),
+	merkleHashes(other.merkleHashes)
 {
-	copyTree(other.root, root, NULL);
+	parallelCopy(other.root, other.numElems);
+	resetEnds();
+	reindex();
 }
 
 /** Assignment Operator */
-template <typename ElemType>
-RedBlackTree<ElemType>& RedBlackTree<ElemType>::operator= (const RedBlackTree &other) {
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>& RedBlackTree<ElemType, Balance, Merkle>::operator= (const RedBlackTree &other) {
 	if (this != &other) {
 		clear(); // Delete tree
 		numElems = other.numElems; // Re-initialize
-		copyTree(other.root, root, NULL);
+		numTombstones = other.numTombstones;
+		numNodes = other.numNodes;
+		parallelCopy(other.root, other.numElems);
+		resetEnds();
+		reindex();
+		if (merkleHashes) rehash(root); // other may not have kept hashes
+		if (!lazyRemove && numTombstones != 0) dropTombstones(); // Nothing else would ever drop them
+		publish(kChangeResync, ElemType(), 0);
 	}
 	return *this;
 }
 
-/** Destructor */
-template <typename ElemType>
-RedBlackTree<ElemType>::~RedBlackTree() {
-	recursiveDelete(root);
+/** Destructor. Queued nodes are freed here unless the reclaimer thread owns them. */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::~RedBlackTree() {
+	if (backgroundFree) deferFree(root);
+	else parallelDelete();
+	freeNodes(freeQueue, static_cast<std::size_t>(-1));
 }
 
 /** Recursive wrapper for insert */
-template <typename ElemType>
-void RedBlackTree<ElemType>::insert(const ElemType &value) {
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::insert(const ElemType &value) {
+	trace(kTraceInsert, value);
+	reclaimSlice();
 	numElems++;
-	recursiveInsert(value, root);
+	recursiveInsert(KeyProbe<ElemType>(value), root);
+	if (!feeds.empty()) publish(kChangeInsert, value, lookup(value)->count);
+}
+
+/** Hangs a new leaf right of the maximum, which has no right child
+ * @value The value to insert */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::append(const ElemType& value) {
+	if (maxNode == NULL || !(maxNode->value < value)) return false;
+	trace(kTraceInsert, value);
+	reclaimSlice();
+	numElems++;
+	Node* leaf = makeNode(value, maxNode);
+	maxNode->rChild = leaf;
+	linkedLeaf(leaf);
+	Balance::afterInsert(*this, leaf);
+	publish(kChangeInsert, value, 1);
+	return true;
+}
+
+/** Inserts a detached node
+ * @handle The handle owning the node. Empty handles are ignored */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::insert(NodeHandle&& handle) {
+	if (handle.node == NULL) return;
+	Node* node = handle.node;
+	handle.node = NULL;
+	numElems += node->count;
+	if (feeds.empty()) {
+		insertNode(node);
+		return;
+	}
+	ElemType value = node->value; // The node is freed if it joins an equal one
+	insertNode(node);
+	publish(kChangeInsert, value, lookup(value)->count);
+}
+
+/** Detaches a node from the tree
+ * @value The value of the node to detach */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::NodeHandle RedBlackTree<ElemType, Balance, Merkle>::extract(const ElemType& value) {
+	Node* node = lookup(value);
+	if (node == NULL || node->count == 0) return NodeHandle(); // Tombstones are not handed out
+	unlinkNode(node);
+	numElems -= node->count;
+	trimEnds();
+	publish(kChangeRemove, node->value, 0);
+	return NodeHandle(node);
+}
+
+/** Splices all nodes of another tree into this one. Nodes are detached from other
+ * as leaves in post-order, so no extra memory is needed.
+ * @other The tree to take nodes from */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::merge(RedBlackTree<ElemType, Balance, Merkle>& other) {
+	if (this == &other || other.root == NULL) return;
+	publish(kChangeResync, ElemType(), 0);
+	other.publish(kChangeResync, ElemType(), 0);
+	numElems += other.numElems;
+	Node* currNode = other.root;
+	other.root = NULL;
+	other.numElems = 0;
+	other.purgeCursor = NULL;
+	other.compactCursor = NULL;
+	other.minNode = NULL;
+	other.maxNode = NULL;
+	other.reindex();
+	if (root == NULL) { // Take the whole tree
+		root = currNode;
+		resetEnds();
+		reindex();
+		if (merkleHashes) rehash(root); // other may not have kept hashes
+		numTombstones = other.numTombstones;
+		numNodes = other.numNodes;
+		other.numTombstones = 0;
+		other.numNodes = 0;
+		trimEnds();
+		if (!lazyRemove && numTombstones != 0) dropTombstones(); // Nothing else would ever drop them
+		else limitTombstones();
+		return;
+	}
+	other.numTombstones = 0;
+	other.numNodes = 0;
+	while (currNode != NULL) {
+		if (currNode->lChild != NULL) currNode = currNode->lChild;
+		else if (currNode->rChild != NULL) currNode = currNode->rChild;
+		else { // Leaf: detach it and move it over
+			Node* parent = currNode->parent;
+			if (parent != NULL && parent->lChild == currNode) parent->lChild = NULL;
+			else if (parent != NULL) parent->rChild = NULL;
+			if (currNode->count == 0) freeNode(currNode); // Tombstones are dropped
+			else insertNode(currNode);
+			currNode = parent;
+		}
+	}
+}
+
+/** Returns the height of the tree */
+template <typename ElemType, typename Balance, bool Merkle>
+int RedBlackTree<ElemType, Balance, Merkle>::height() const {
+	return subtreeHeight(root);
+}
+
+/** Walks the tree once, summing node and allocator bytes */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::MemoryUsage RedBlackTree<ElemType, Balance, Merkle>::memoryUsage() const {
+	MemoryUsage usage = MemoryUsage();
+	forEachDepth([&usage](const Node* node, int) {
+		usage.nodes++;
+		if (node->pooled) usage.pooledNodes++;
+	});
+	usage.nodeBytes = usage.nodes * sizeof(Node);
+	usage.overheadBytes = (usage.nodes - usage.pooledNodes) * (mallocBytes(sizeof(Node)) - sizeof(Node));
+	usage.treeBytes = sizeof(*this) + freeQueue.capacity() * sizeof(Node*);
+	usage.indexBytes = index.bytes();
+	usage.totalBytes = usage.nodeBytes + usage.overheadBytes + usage.treeBytes + usage.indexBytes;
+	if (numElems != 0) usage.bytesPerKey = static_cast<double>(usage.totalBytes) / numElems;
+	return usage;
+}
+
+/** Walks the tree once, gathering depths, colors and counts */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::ShapeStats RedBlackTree<ElemType, Balance, Merkle>::shapeStats() const {
+	ShapeStats stats = ShapeStats();
+	stats.height = -1;
+	stats.maxDepth = -1;
+	stats.blackHeight = 1; // The NULL leaf
+	for (const Node* node = root; node != NULL; node = node->lChild)
+		if (!node->red) stats.blackHeight++;
+	std::size_t nodes = 0;
+	std::size_t reds = 0;
+	double depthSum = 0;
+	forEachDepth([&](const Node* node, int depth) {
+		nodes++;
+		if (node->red) reds++;
+		stats.maxDepth = std::max(stats.maxDepth, depth);
+		if (node->count == 0) {
+			stats.tombstones++;
+			return;
+		}
+		stats.distinct++;
+		depthSum += static_cast<double>(depth) * node->count;
+		stats.maxCount = std::max(stats.maxCount, node->count);
+		std::size_t bucket = 0;
+		for (std::size_t count = node->count; count > 1; count >>= 1) bucket++;
+		if (stats.duplicates.size() <= bucket) stats.duplicates.resize(bucket + 1);
+		stats.duplicates[bucket]++;
+	});
+	stats.height = stats.maxDepth;
+	if (nodes != 0) stats.redRatio = static_cast<double>(reds) / nodes;
+	if (numElems != 0) stats.averageDepth = depthSum / numElems;
+	return stats;
+}
+
+/** Visits all values in order without recursion
+ * @visit Called with each value and its count */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Visitor>
+void RedBlackTree<ElemType, Balance, Merkle>::forEach(Visitor visit) const {
+	if (root == NULL) return;
+	const Node* currNode = root;
+	while (currNode->lChild != NULL) currNode = currNode->lChild;
+	for (; currNode != NULL; currNode = nextNode(currNode))
+		if (currNode->count != 0) visit(currNode->value, currNode->count); // Skip tombstones
+}
+
+/** Visits all values across the pool
+ * @visit Called with each value and its count, possibly from several threads at once */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Visitor>
+void RedBlackTree<ElemType, Balance, Merkle>::parallelForEach(Visitor visit) const {
+	std::vector<Piece> pieces;
+	splitPieces(pieces);
+	pool().parallelFor(pieces.size(), [&](std::size_t i) {
+		auto visitNode = [&visit](const Node* node) {
+			if (node->count != 0) visit(node->value, node->count); // Skip tombstones
+		};
+		visitPiece(pieces[i], visitNode);
+	});
+}
+
+/** Folds each piece on its own task, then folds the partial results in order
+ * @init The identity of combine, and the result for an empty tree
+ * @map Called with each value and its count, possibly from several threads at once
+ * @combine Joins two results */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Result, typename Mapper, typename Combiner>
+Result RedBlackTree<ElemType, Balance, Merkle>::parallelReduce(const Result& init, Mapper map, Combiner combine) const {
+	std::vector<Piece> pieces;
+	splitPieces(pieces);
+	std::vector<Result> partials(pieces.size(), init);
+	pool().parallelFor(pieces.size(), [&](std::size_t i) {
+		Result partial = init; // Kept off the shared vector until done
+		auto foldNode = [&](const Node* node) {
+			if (node->count != 0) partial = combine(partial, map(node->value, node->count));
+		};
+		visitPiece(pieces[i], foldNode);
+		partials[i] = partial;
+	});
+	Result result = init;
+	for (std::size_t i = 0; i < partials.size(); i++) result = combine(result, partials[i]);
+	return result;
+}
+
+/** Copies the tree across the pool, then maps the values of the copy in place across
+ * the pool. Tombstones are mapped and kept, so the copy has the same shape.
+ * @map Called with each value, possibly from several threads at once */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Mapper>
+RedBlackTree<ElemType, Balance, Merkle> RedBlackTree<ElemType, Balance, Merkle>::parallelTransform(Mapper map) const {
+	RedBlackTree<ElemType, Balance, Merkle> result(*this);
+	std::vector<Piece> pieces;
+	result.splitPieces(pieces);
+	result.pool().parallelFor(pieces.size(), [&](std::size_t i) {
+		auto mapNode = [&map](Node* node) {
+			node->value = map(node->value);
+			node->setPrefix(node->value);
+		};
+		visitPiece(pieces[i], mapNode);
+	});
+	result.reindex(); // Values changed under the hash index
+	if (result.merkleHashes) rehash(result.root);
+	return result;
+}
+
+/** Returns the number of rotations done */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::rotations() const {
+	return numRotations;
 }
 
 /** Returns number of keys in tree */
-template <typename ElemType>
-int RedBlackTree<ElemType>::size() const {
+template <typename ElemType, typename Balance, bool Merkle>
+int RedBlackTree<ElemType, Balance, Merkle>::size() const {
 	return numElems;
 }
 
 /** Returns if tree is empty */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::empty() const {
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::empty() const {
 	return size() == 0;
 }
 
 /** Clears the tree */
-template <typename ElemType>
-void RedBlackTree<ElemType>::clear() {
-	recursiveDelete(root);
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::clear() {
+	reclaimSlice();
+	if (maxFreesPerOp == 0 && !backgroundFree) parallelDelete();
+	else deferFree(root); // O(1)
 	numElems = 0;
+	numTombstones = 0;
+	numNodes = 0;
+	purgeCursor = NULL;
+	compactCursor = NULL;
 	root = NULL;
+	minNode = NULL;
+	maxNode = NULL;
+	if (hashIndex) index.reset(0);
+	publish(kChangeClear, ElemType(), 0);
+}
+
+/** Turns the hash index on or off
+ * @enabled Whether point lookups go through the hash index */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::setHashIndex(const bool enabled) {
+	static_assert(Hashable<ElemType>::value, "The hash index needs std::hash of the value type.");
+	hashIndex = enabled;
+	if (enabled) reindex();
+	else index.reset(0);
+}
+
+/** Turns the Merkle hashes on or off
+ * @enabled Whether subtree hashes are kept */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::setMerkleHashes(const bool enabled) {
+	static_assert(Hashable<ElemType>::value, "Merkle hashes need std::hash of the value type.");
+	static_assert(Merkle, "Merkle hashes need a RedBlackTree<ElemType, Balance, true>.");
+	if (enabled && !merkleHashes) rehash(root);
+	merkleHashes = enabled;
+}
+
+/** Returns the root's subtree hash */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::contentHash() const {
+	if (!merkleHashes) throw std::logic_error("Merkle hashes are off.");
+	return hashOf(root);
+}
+
+/** Compares sizes and content hashes
+ * @other The tree to compare with */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::sameContents(const RedBlackTree<ElemType, Balance, Merkle>& other) const {
+	return contentHash() == other.contentHash() && numElems == other.numElems;
+}
+
+/** Walks this tree from the root, skipping every subtree whose hash matches the hash of
+ * the same value range in other
+ * @other The tree to compare with */
+template <typename ElemType, typename Balance, bool Merkle>
+std::vector<typename RedBlackTree<ElemType, Balance, Merkle>::DiffEntry>
+RedBlackTree<ElemType, Balance, Merkle>::diff(const RedBlackTree<ElemType, Balance, Merkle>& other) const {
+	std::vector<DiffEntry> out;
+	if (contentHash() != other.contentHash()) diffSubtree(root, NULL, NULL, other, out);
+	return out;
+}
+
+/** Sets the thread pool for copying and freeing large trees
+ * @pool The pool to use. NULL for the shared pool */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::setThreadPool(ThreadPool* const pool) {
+	threadPool = pool;
+}
+
+/** Sets the trace recorder. Copies of the tree do not inherit it.
+ * @recorder The recorder to log to. NULL to stop recording */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::setRecorder(TraceRecorder* const recorder) {
+	static_assert(std::is_integral<ElemType>::value, "Traces only hold integral values.");
+	this->recorder = recorder;
+}
+
+/** Logs an operation. Compiles to nothing for values a trace cannot hold.
+ * @op The operation
+ * @value The value it was made with */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::trace(const TraceOp op, const ElemType& value) const {
+	if constexpr (std::is_integral<ElemType>::value) {
+		if (recorder != NULL) recorder->record(op, static_cast<std::int64_t>(value));
+	}
+}
+
+/** Adds a subscriber. Subscribing a feed twice publishes each change to it once.
+ * @feed The feed to publish to */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::subscribe(ChangeFeed<ElemType>* const feed) {
+	if (std::find(feeds.begin(), feeds.end(), feed) == feeds.end()) feeds.push_back(feed);
+}
+
+/** Removes a subscriber
+ * @feed The feed to stop publishing to */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::unsubscribe(ChangeFeed<ElemType>* const feed) {
+	feeds.erase(std::remove(feeds.begin(), feeds.end(), feed), feeds.end());
+}
+
+/** Publishes a change. Feeds that are full drop it, and their followers resync.
+ * @op The change
+ * @value The value changed
+ * @count The copies of value left */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::publish(const ChangeOp op, const ElemType& value, const std::size_t count) const {
+	for (std::size_t i = 0; i < feeds.size(); i++) feeds[i]->publish(op, value, count);
+}
+
+/** Sets the remove mode
+ * @lazy Whether remove() leaves tombstones
+ * @maxTombstones The fraction of entries that may be tombstones before a rebuild */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::setLazyRemove(const bool lazy, const double maxTombstones) {
+	if (!(maxTombstones > 0 && maxTombstones <= 1))
+		throw std::invalid_argument("The tombstone fraction must be in (0, 1].");
+	lazyRemove = lazy;
+	maxTombstoneFraction = maxTombstones;
+	if (!lazyRemove && numTombstones != 0) dropTombstones();
+}
+
+/** Returns the number of tombstones */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::tombstones() const {
+	return numTombstones;
+}
+
+/** Sets the reclamation mode. Nodes already queued are freed now when turning
+ * deferral off, and handed to the reclaimer when switching to the background.
+ * @maxFrees The most queued nodes freed per operation. 0 => No deferral
+ * @background Whether a background thread frees the queued nodes */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::setDeferredFree(const std::size_t maxFrees, const bool background) {
+	maxFreesPerOp = maxFrees;
+	backgroundFree = background;
+	if (backgroundFree) {
+		for (std::size_t i = 0; i < freeQueue.size(); i++) deferFree(freeQueue[i]);
+		freeQueue.clear();
+	} else if (maxFreesPerOp == 0) freeNodes(freeQueue, static_cast<std::size_t>(-1));
+}
+
+/** Frees queued nodes on the calling thread
+ * @maxNodes The most nodes to free
+ * @return The number freed */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::reclaim(const std::size_t maxNodes) {
+	return freeNodes(freeQueue, maxNodes);
+}
+
+/** Returns if any nodes are queued */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::reclaimPending() const {
+	return !freeQueue.empty();
+}
+
+/** Relocates the whole tree. The nodes are laid out so that any subtree of height h
+ * is split into runs of about 2^(h/2) nodes that are each contiguous, so a search
+ * touches O(log_B n) cache lines whatever the line size B. */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::compact() {
+	if (root == NULL) return;
+	std::vector<Node*> order;
+	order.reserve(numNodes);
+	layoutVeb(root, subtreeHeight(root) + 1, order);
+	arena.seal(); // Start a fresh run of chunks
+	relocate(order);
+	compactCursor = NULL;
+}
+
+/** Relocates the tree a piece at a time, in order. Each piece is either the largest
+ * subtree of at most maxNodes nodes whose leftmost node is next, laid out in van Emde
+ * Boas order, or a single node above such subtrees. Old chunks are freed as their
+ * last nodes move out.
+ * @maxNodes The most nodes to move
+ * @return The number of nodes moved */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::compactStep(const std::size_t maxNodes) {
+	std::size_t moved = 0;
+	while (root != NULL && moved < maxNodes) {
+		Node* start = compactCursor;
+		if (start == NULL) { // Start a pass at the leftmost node
+			start = root;
+			while (start->lChild != NULL) start = start->lChild;
+		}
+		Node* top = start;
+		std::size_t size = countUpTo(top, maxNodes);
+		if (size > maxNodes) size = 1; // Move start on its own
+		else {
+			while (top->parent != NULL && top->parent->lChild == top) { // Climb while start stays leftmost
+				if (size == maxNodes) break;
+				std::size_t parentSize = size + 1 + countUpTo(top->parent->rChild, maxNodes - size - 1);
+				if (parentSize > maxNodes) break;
+				top = top->parent;
+				size = parentSize;
+			}
+		}
+		if (moved != 0 && moved + size > maxNodes) break; // Leave it for the next call
+		Node* last = top; // The last node of the piece in order
+		if (size != 1) while (last->rChild != NULL) last = last->rChild;
+		Node* next = nextNode(last);
+		std::vector<Node*> order;
+		if (size == 1) order.push_back(top);
+		else layoutVeb(top, subtreeHeight(top) + 1, order);
+		relocate(order);
+		moved += order.size();
+		compactCursor = next;
+		if (next == NULL) break; // Finished a pass
+	}
+	return moved;
+}
+
+/** Walks the tree in order from a saved position, unlinking tombstones as it goes,
+ * so compaction can be spread over many short calls. Unlinking only rotates nodes,
+ * so the node after a removed one is still the next to visit.
+ * @maxNodes The most nodes to visit
+ * @return The number of tombstones removed */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::purgeTombstones(const std::size_t maxNodes) {
+	Node* currNode = purgeCursor;
+	if (currNode == NULL && root != NULL) { // Start at the leftmost node
+		currNode = root;
+		while (currNode->lChild != NULL) currNode = currNode->lChild;
+	}
+	std::size_t removed = 0;
+	for (std::size_t visited = 0; currNode != NULL && visited < maxNodes && numTombstones != 0; visited++) {
+		Node* next = nextNode(currNode);
+		if (currNode->count == 0) {
+			rbDelete(currNode);
+			numTombstones--;
+			removed++;
+		}
+		currNode = next;
+	}
+	purgeCursor = currNode;
+	return removed;
 }
 
-/** Returns a debug string */
-template <typename ElemType>
-std::string RedBlackTree<ElemType>::debugString() const {
+/** Applies a batch of operations. The batch is sorted and the operations on each
+ * distinct value are folded into one count change, so every value is searched for
+ * once. Small batches walk the tree with a finger that starts at the previously
+ * touched node, so neighbouring values share most of their descent. Batches that
+ * touch a large part of the tree are merged with the in-order nodes instead and
+ * the tree is relinked and recoloured once, reusing every surviving node.
+ * @ops The operations to apply */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::applyBatch(std::vector<BatchOp> ops) {
+	reclaimSlice();
+	if (!ops.empty()) publish(kChangeResync, ElemType(), 0);
+	std::stable_sort(ops.begin(), ops.end(), batchLess);
+	std::size_t distinct = 0;
+	for (std::size_t i = 0; i < ops.size(); i++)
+		if (i == 0 || batchLess(ops[i-1], ops[i])) distinct++;
+	std::size_t misses = 0;
+	if (distinct * 8 >= static_cast<std::size_t>(numElems)) { // Merge and rebuild
+		std::vector<Node*> oldNodes;
+		std::vector<Node*> nodes;
+		oldNodes.reserve(numNodes);
+		collectNodes(root, oldNodes);
+		nodes.reserve(oldNodes.size() + distinct);
+		std::size_t next = 0;
+		for (std::size_t i = 0; i < ops.size(); ) {
+			const ElemType& value = ops[i].value;
+			while (next < oldNodes.size() && oldNodes[next]->value < value) keepLive(oldNodes[next++], nodes);
+			Node* existing = NULL;
+			if (next < oldNodes.size() && oldNodes[next]->value == value) existing = oldNodes[next++];
+			std::size_t count = (existing == NULL) ? 0 : existing->count;
+			for (; i < ops.size() && ops[i].value == value; i++) foldOp(ops[i], count, misses); // Fold ops on this value
+			numElems += static_cast<int>(count) - ((existing == NULL) ? 0 : static_cast<int>(existing->count));
+			if (count == 0) {
+				if (existing != NULL) freeNode(existing);
+				continue;
+			}
+			if (existing == NULL) existing = makeNode(value, NULL);
+			existing->count = count;
+			nodes.push_back(existing);
+		}
+		while (next < oldNodes.size()) keepLive(oldNodes[next++], nodes);
+		numTombstones = 0; // All were revived or freed
+		rebuild(nodes);
+		return misses;
+	}
+	Node* finger = NULL;
+	for (std::size_t i = 0; i < ops.size(); ) { // Search and fix up one value at a time
+		const ElemType value = ops[i].value;
+		Node* parent = NULL;
+		Node* existing = fingerSearch(finger, value, parent);
+		std::size_t count = (existing == NULL) ? 0 : existing->count;
+		for (; i < ops.size() && ops[i].value == value; i++) foldOp(ops[i], count, misses);
+		numElems += static_cast<int>(count) - ((existing == NULL) ? 0 : static_cast<int>(existing->count));
+		if (existing != NULL && existing->count == 0) numTombstones--; // Revived or freed below
+		if (existing != NULL && count == 0) {
+			rbDelete(existing);
+			finger = NULL; // The deleted node may have been the finger
+		} else if (existing != NULL) {
+			std::size_t oldCount = existing->count;
+			existing->count = count;
+			countChanged(existing, oldCount);
+			finger = existing;
+		} else if (count != 0) {
+			Node* newNode = makeNode(value, parent);
+			newNode->count = count;
+			if (parent == NULL) root = newNode;
+			else if (value < parent->value) parent->lChild = newNode;
+			else parent->rChild = newNode;
+			linkedLeaf(newNode);
+			Balance::afterInsert(*this, newNode);
+			finger = newNode;
+		}
+	}
+	trimEnds();
+	return misses;
+}
+
+/** Returns a debug string. Only real nodes enqueue their children, so memory is
+ * bounded by the widest level of the tree rather than doubling per level. */
+template <typename ElemType, typename Balance, bool Merkle>
+std::string RedBlackTree<ElemType, Balance, Merkle>::debugString() const {
 	std::stringstream converter;
-	std::queue<Node*> myQueue;
+	std::queue<const Node*> myQueue;
 	myQueue.push(root); // Start with root
-	std::queue<Node*> nextQueue;
+	std::queue<const Node*> nextQueue;
 	bool allNull = true;
 	while (true) { // Enqueue in order of depth
-		Node* nextNode = myQueue.front();
+		const Node* nextNode = myQueue.front();
 		myQueue.pop();
-		if (nextNode == NULL) { // Enqueue root node 
-			nextQueue.push(NULL); // Put in two NULL children
-			nextQueue.push(NULL);
-			converter << "NULL (b,0) ";
+		if (nextNode == NULL) {
+			converter << "NULL (b,0) "; // Leaves have no children to enqueue
 		} else {
-			Node* lChild = nextNode->lChild; //Enqueue both children nodes 
-			Node* rChild = nextNode->rChild;
-			if (lChild == NULL) nextQueue.push(NULL);
-			else nextQueue.push(nextNode->lChild);
-			if (rChild == NULL) nextQueue.push(NULL);
-			else nextQueue.push(nextNode->rChild);
+			nextQueue.push(nextNode->lChild); //Enqueue both children nodes
+			nextQueue.push(nextNode->rChild);
 			converter << nextNode->value; // Print currNode
 			converter << " (" << ((nextNode->red) ? "r," : "b,");
 			converter << nextNode->count << ") ";
@@ -261,66 +1367,426 @@ std::string RedBlackTree<ElemType>::debugString() const {
 
 /** Prints out the tree by enqueueing all of the elements in order by 
  * tree level */
-template <typename ElemType>
-void RedBlackTree<ElemType>::print() const {
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::print() const {
 	std::cout << debugString() << std::endl;
 }
 
+/** Streams the whole tree in DOT format
+ * @out The stream to write to
+ * @maxDepth The deepest level to export. Negative for no limit */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::exportDot(std::ostream& out, const int maxDepth) const {
+	out << "digraph RedBlackTree {\n";
+	out << "\tnode [style=filled, fontcolor=white];\n";
+	exportDotNode(out, root, NULL, 0, maxDepth, NULL, NULL);
+	out << "}\n";
+}
+
+/** Streams the nodes with values in [lo, hi] in DOT format. Out of range nodes are
+ * skipped and their in-range child is attached to the closest exported ancestor.
+ * @out The stream to write to
+ * @lo The smallest value to export
+ * @hi The largest value to export
+ * @maxDepth The deepest level to export. Negative for no limit */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::exportDot(std::ostream& out, const ElemType& lo, const ElemType& hi,
+				       const int maxDepth) const {
+	out << "digraph RedBlackTree {\n";
+	out << "\tnode [style=filled, fontcolor=white];\n";
+	exportDotNode(out, root, NULL, 0, maxDepth, &lo, &hi);
+	out << "}\n";
+}
+
+/** Streams the whole tree as JSON
+ * @out The stream to write to
+ * @maxDepth The deepest level to export. Negative for no limit */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::exportJson(std::ostream& out, const int maxDepth) const {
+	out << "{\"size\":" << numElems << ",\"root\":";
+	exportJsonNode(out, root, 0, maxDepth, NULL, NULL);
+	out << "}\n";
+}
+
+/** Streams the nodes with values in [lo, hi] as JSON
+ * @out The stream to write to
+ * @lo The smallest value to export
+ * @hi The largest value to export
+ * @maxDepth The deepest level to export. Negative for no limit */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::exportJson(std::ostream& out, const ElemType& lo, const ElemType& hi,
+					const int maxDepth) const {
+	out << "{\"size\":" << numElems << ",\"root\":";
+	exportJsonNode(out, root, 0, maxDepth, &lo, &hi);
+	out << "}\n";
+}
+
+/** Writes one node statement and the edge from its exported parent, then recurses.
+ * Recursion depth is bounded by the tree height, so memory use is O(height).
+ * @currNode The node being exported
+ * @parent The closest exported ancestor. NULL if there is none
+ * @depth The depth of currNode in the tree
+ * @lo Lower bound on exported values. NULL if unbounded
+ * @hi Upper bound on exported values. NULL if unbounded */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::exportDotNode(std::ostream& out, const Node* const currNode, const Node* const parent,
+					   const int depth, const int maxDepth,
+					   const ElemType* const lo, const ElemType* const hi) const {
+	if (currNode == NULL || (maxDepth >= 0 && depth > maxDepth)) return; // Stop at leaves
+	if (lo != NULL && currNode->value < *lo) { // Only the right subtree can be in range
+		exportDotNode(out, currNode->rChild, parent, depth + 1, maxDepth, lo, hi);
+		return;
+	}
+	if (hi != NULL && *hi < currNode->value) { // Only the left subtree can be in range
+		exportDotNode(out, currNode->lChild, parent, depth + 1, maxDepth, lo, hi);
+		return;
+	}
+	out << "\tn" << static_cast<const void*>(currNode) << " [label=";
+	writeValue(out, currNode->value, false);
+	out << ", xlabel=" << currNode->count;
+	out << ", fillcolor=" << ((currNode->red) ? "red" : "black") << "];\n";
+	if (parent != NULL) {
+		out << "\tn" << static_cast<const void*>(parent)
+		    << " -> n" << static_cast<const void*>(currNode) << ";\n";
+	}
+	exportDotNode(out, currNode->lChild, currNode, depth + 1, maxDepth, lo, hi);
+	exportDotNode(out, currNode->rChild, currNode, depth + 1, maxDepth, lo, hi);
+}
+
+/** Writes a node as a JSON object with nested children. Subtrees cut off by maxDepth
+ * are written as null and their parent is flagged as truncated.
+ * @currNode The node being exported
+ * @depth The depth of currNode in the tree
+ * @lo Lower bound on exported values. NULL if unbounded
+ * @hi Upper bound on exported values. NULL if unbounded */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::exportJsonNode(std::ostream& out, const Node* const currNode, const int depth,
+					    const int maxDepth, const ElemType* const lo, const ElemType* const hi) const {
+	if (currNode == NULL || (maxDepth >= 0 && depth > maxDepth)) { // Stop at leaves
+		out << "null";
+		return;
+	}
+	if (lo != NULL && currNode->value < *lo) { // Splice out of range nodes
+		exportJsonNode(out, currNode->rChild, depth + 1, maxDepth, lo, hi);
+		return;
+	}
+	if (hi != NULL && *hi < currNode->value) {
+		exportJsonNode(out, currNode->lChild, depth + 1, maxDepth, lo, hi);
+		return;
+	}
+	out << "{\"value\":";
+	writeValue(out, currNode->value, true);
+	out << ",\"color\":\"" << ((currNode->red) ? "red" : "black") << "\"";
+	out << ",\"count\":" << currNode->count;
+	if (depth == maxDepth && (currNode->lChild != NULL || currNode->rChild != NULL))
+		out << ",\"truncated\":true";
+	out << ",\"left\":";
+	exportJsonNode(out, currNode->lChild, depth + 1, maxDepth, lo, hi);
+	out << ",\"right\":";
+	exportJsonNode(out, currNode->rChild, depth + 1, maxDepth, lo, hi);
+	out << "}";
+}
+
+/** Writes a value for the exporters. Values are streamed with operator<< and then quoted,
+ * escaping quotes and backslashes, and in JSON every control character. JSON leaves
+ * integers and finite floating values bare and writes bools as true or false; chars,
+ * NaN and infinities are quoted.
+ * @value The value to write
+ * @json Whether the value is written into JSON output */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::writeValue(std::ostream& out, const ElemType& value, const bool json) {
+	if constexpr (std::is_same<ElemType, bool>::value) {
+		if (json) {
+			out << (value ? "true" : "false");
+			return;
+		}
+	} else if constexpr (std::is_integral<ElemType>::value && !std::is_same<ElemType, char>::value &&
+			     !std::is_same<ElemType, signed char>::value && !std::is_same<ElemType, unsigned char>::value) {
+		if (json) {
+			out << value;
+			return;
+		}
+	} else if constexpr (std::is_floating_point<ElemType>::value) {
+		if (json && std::isfinite(value)) {
+			out << value;
+			return;
+		}
+	}
+	std::ostringstream converter;
+	converter << value;
+	const std::string text = converter.str();
+	static const char hexDigits[] = "0123456789abcdef";
+	out << '"';
+	for (std::string::size_type i = 0; i < text.size(); i++) {
+		const unsigned char c = static_cast<unsigned char>(text[i]);
+		if (c == '"' || c == '\\') out << '\\' << text[i];
+		else if (c == '\n' && !json) out << "\\n";
+		else if (c < 0x20 && json) out << "\\u00" << hexDigits[c >> 4] << hexDigits[c & 0xf];
+		else out << text[i];
+	}
+	out << '"';
+}
+
 /** Recursively inserts an element into tree and then restores the tree properties
- * @value The value to insert
+ * @probe The value to insert
  * @currNode The current node
  */
-template <typename ElemType>
-void RedBlackTree<ElemType>::recursiveInsert(const ElemType& value, Node* currNode) {
-	if (root == NULL)  // Insert root node
-		root = makeNode(value, NULL, false);
-	else if (value == currNode->value)
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::recursiveInsert(const KeyProbe<ElemType>& probe, Node* currNode) {
+	if (root == NULL) { // Insert root node
+		root = makeNode(probe.value, NULL);
+		linkedLeaf(root);
+		Balance::afterInsert(*this, root);
+		return;
+	}
+	const int order = probe.compare(currNode);
+	if (order == 0) {
+		if (currNode->count == 0) numTombstones--; // Revive a tombstone
 		currNode->count++; // Duplicate insert
+		countChanged(currNode, currNode->count - 1);
+	}
 	else {
 		Node** child;
-		if (value < currNode->value) child = &currNode->lChild; //Traverse l/r
+		if (order < 0) child = &currNode->lChild; //Traverse l/r
 		else child = &currNode->rChild;
 		if (*child == NULL) { // If insertable, place node.
-			*child = makeNode(value, currNode);
-			restoreTree(*child);
-		} else recursiveInsert(value, *child); // Otherwise, continue traversing
+			*child = makeNode(probe.value, currNode);
+			linkedLeaf(*child);
+			Balance::afterInsert(*this, *child);
+		} else recursiveInsert(probe, *child); // Otherwise, continue traversing
 	}
 }
 
+/** Links a detached node in as a leaf and restores the tree properties. If the
+ * value is already in the tree, the counts are combined and the node is freed.
+ * @node The detached node */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::insertNode(Node* const node) {
+	node->lChild = NULL;
+	node->rChild = NULL;
+	node->setPrefix(node->value); // The value may have been changed through a handle
+	KeyProbe<ElemType> probe(node->value);
+	Node* parent = NULL;
+	Node* currNode = root;
+	int order = 0;
+	while (currNode != NULL) {
+		order = probe.compare(currNode);
+		if (order == 0) { // Duplicate insert
+			if (currNode->count == 0) numTombstones--; // Revive a tombstone
+			currNode->count += node->count;
+			countChanged(currNode, currNode->count - node->count);
+			freeNode(node);
+			return;
+		}
+		parent = currNode;
+		if (order < 0) currNode = currNode->lChild;
+		else currNode = currNode->rChild;
+	}
+	node->parent = parent;
+	Balance::initLeaf(node);
+	if (parent == NULL) root = node;
+	else if (order < 0) parent->lChild = node;
+	else parent->rChild = node;
+	linkedLeaf(node);
+	Balance::afterInsert(*this, node);
+}
+
 /** Makes an initial node with the given params
  * @value The value of the node
  * @parent The parent of the node
- * @red The color of the node
  */
-template <typename ElemType>
-typename RedBlackTree<ElemType>::Node*
-RedBlackTree<ElemType>::makeNode(const ElemType& value, Node* const parent, const bool red) const {
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::makeNode(const ElemType& value, Node* const parent) const {
 	Node* newNode = new Node;
 	newNode->parent = parent;
-	newNode->red = red;
+	newNode->pooled = false;
+	Balance::initLeaf(newNode);
 	newNode->lChild = NULL;
 	newNode->rChild = NULL;
 	newNode->value = value;
+	newNode->setPrefix(value);
 	newNode->count = 1;
 	return newNode;
 }
 
 /** Frees memory of current node and all of its children recursively
  * @currNode The current node being deleted */
-template <typename ElemType>
-void RedBlackTree<ElemType>::recursiveDelete(Node*& currNode) {
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::recursiveDelete(Node*& currNode) {
 	if (currNode == NULL) return; // Stop at leaves
 	recursiveDelete(currNode->lChild);
 	recursiveDelete(currNode->rChild);
-	delete currNode;
+	freeNode(currNode);
+}
+
+/** Queues a subtree to be freed, or posts it to the reclaimer thread
+ * @subtree The root of a detached subtree. NULL is ignored */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::deferFree(Node* const subtree) {
+	if (subtree == NULL) return;
+	if (!backgroundFree) {
+		freeQueue.push_back(subtree);
+		return;
+	}
+	Reclaimer::shared().post([subtree]() {
+		std::vector<Node*> queue(1, subtree);
+		freeNodes(queue, static_cast<std::size_t>(-1));
+	});
+}
+
+/** Frees a slice of the queued nodes. Removals call this, so running out of memory
+ * for the queue leaves the rest for a later slice instead of throwing. */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::reclaimSlice() {
+	if (freeQueue.empty()) return;
+	try {
+		freeNodes(freeQueue, maxFreesPerOp);
+	} catch (const std::bad_alloc&) {} // The queue is still whole
+}
+
+/** Frees nodes from the back of a queue of subtrees, replacing each freed node with
+ * its children. The queue grows by at most one entry per level of a subtree, and
+ * grows before the node is freed, so a failed allocation loses nothing.
+ * @queue The roots of the subtrees to free
+ * @maxNodes The most nodes to free
+ * @return The number freed */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::freeNodes(std::vector<Node*>& queue, const std::size_t maxNodes) {
+	std::size_t freed = 0;
+	while (!queue.empty() && freed < maxNodes) {
+		Node* currNode = queue.back();
+		const bool both = currNode->lChild != NULL && currNode->rChild != NULL;
+		if (both) queue.push_back(currNode->rChild); // The only step that may throw
+		Node*& slot = queue[queue.size() - (both ? 2 : 1)]; // Where currNode was
+		if (currNode->lChild != NULL) slot = currNode->lChild;
+		else if (currNode->rChild != NULL) slot = currNode->rChild;
+		else queue.pop_back();
+		freeNode(currNode);
+		freed++;
+	}
+	return freed;
+}
+
+/** Frees a node. Arena nodes are destroyed in place and returned to their chunk.
+ * @node The node */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::freeNode(Node* const node) {
+	if (!node->pooled) {
+		delete node;
+		return;
+	}
+	node->~Node();
+	NodeArena::release(node);
+}
+
+/** Lays out the top levels of a subtree: the top half of the levels first, then
+ * each of the subtrees hanging below them, all recursively.
+ * @currNode The root of the subtree
+ * @levels The number of levels to lay out
+ * @order Where the nodes are appended */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::layoutVeb(Node* const currNode, const int levels,
+				       std::vector<Node*>& order) const {
+	if (currNode == NULL) return; // Stop at leaves
+	if (levels == 1) {
+		order.push_back(currNode);
+		return;
+	}
+	const int topLevels = levels / 2;
+	layoutVeb(currNode, topLevels, order);
+	layoutBottoms(currNode, topLevels, levels - topLevels, order);
+}
+
+/** Finds the subtrees rooted depth levels below currNode, left to right, and lays
+ * out levels levels of each
+ * @currNode The node to search below
+ * @depth How far below currNode the subtrees are
+ * @levels The number of levels to lay out in each
+ * @order Where the nodes are appended */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::layoutBottoms(Node* const currNode, const int depth, const int levels,
+					   std::vector<Node*>& order) const {
+	if (currNode == NULL) return; // Stop at leaves
+	if (depth == 0) {
+		layoutVeb(currNode, levels, order);
+		return;
+	}
+	layoutBottoms(currNode->lChild, depth - 1, levels, order);
+	layoutBottoms(currNode->rChild, depth - 1, levels, order);
+}
+
+/** Moves nodes into consecutive arena slots. Each old node's parent pointer is
+ * pointed at its copy, so the links between the copies can be fixed up in one pass.
+ * Children left out of order still point at the old node and are pointed at the copy.
+ * Values whose move may throw are copied, and the new layout is only linked in
+ * once all copies are made, so a throw leaves the tree as it was.
+ * @order The nodes in their new order, starting with the topmost */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::relocate(const std::vector<Node*>& order) {
+	std::vector<Node*> copies(order.size(), NULL);
+	std::vector<void*> slots;
+	slots.reserve(order.size());
+	std::size_t made = 0;
+	try { // Nothing in the tree changes until every copy exists
+		for (std::size_t i = 0; i < order.size(); i++) {
+			void* slot = arena.allocate(sizeof(Node), alignof(Node));
+			if (slot == NULL) break; // Nodes too large for a chunk stay where they are
+			slots.push_back(slot);
+		}
+		if (slots.size() == order.size()) {
+			for (; made < order.size(); made++) { // Copies unless moving cannot throw
+				copies[made] = new (slots[made]) Node(std::move_if_noexcept(*order[made]));
+				copies[made]->pooled = true;
+			}
+		}
+	} catch (...) {
+		for (std::size_t i = 0; i < made; i++) copies[i]->~Node();
+		for (std::size_t i = 0; i < slots.size(); i++) NodeArena::release(slots[i]);
+		throw;
+	}
+	if (made != order.size()) {
+		for (std::size_t i = 0; i < slots.size(); i++) NodeArena::release(slots[i]);
+		return;
+	}
+	for (std::size_t i = 0; i < order.size(); i++) order[i]->parent = copies[i]; // Forward
+	for (std::size_t i = 0; i < order.size(); i++) {
+		Node* copy = copies[i];
+		if (i != 0) copy->parent = copy->parent->parent;
+		if (copy->lChild != NULL && copy->lChild->parent == order[i]) copy->lChild->parent = copy;
+		else if (copy->lChild != NULL) copy->lChild = copy->lChild->parent;
+		if (copy->rChild != NULL && copy->rChild->parent == order[i]) copy->rChild->parent = copy;
+		else if (copy->rChild != NULL) copy->rChild = copy->rChild->parent;
+		if (order[i] == purgeCursor) purgeCursor = copy;
+		if (order[i] == compactCursor) compactCursor = copy;
+		if (order[i] == minNode) minNode = copy;
+		if (order[i] == maxNode) maxNode = copy;
+		if (hashIndex) index.replace(order[i], copy);
+	}
+	Node* parent = copies[0]->parent; // Reattach the subtree
+	if (parent == NULL) root = copies[0];
+	else if (parent->lChild == order[0]) parent->lChild = copies[0];
+	else parent->rChild = copies[0];
+	for (std::size_t i = 0; i < order.size(); i++) freeNode(order[i]);
+}
+
+/** Counts a subtree, stopping early once it is past a limit
+ * @currNode The root of the subtree
+ * @limit The size above which the exact count is not needed */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::countUpTo(const Node* const currNode, const std::size_t limit) const {
+	if (currNode == NULL) return 0;
+	std::size_t size = 1 + countUpTo(currNode->lChild, limit);
+	if (size > limit) return size;
+	return size + countUpTo(currNode->rChild, limit);
 }
 
 /** Does a tree rotation at given node
  * @child The child node to be rotated up left or right
  * @left The direction of the rotation
  */
-template <typename ElemType>
-void RedBlackTree<ElemType>::rotate(Node* child, const bool left) {
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::rotate(Node* child, const bool left) {
 	Node* origParent = child->parent; // Store original pointers
 	Node* origGrandparent = origParent->parent;
 	child->parent = origGrandparent;
@@ -339,149 +1805,51 @@ void RedBlackTree<ElemType>::rotate(Node* child, const bool left) {
 	if (origGrandparent == NULL) root = child; // If no grandparent, then at root.
 	else if (origGrandparent->lChild == origParent) origGrandparent->lChild = child; // Connect nodes back to grandparent
 	else origGrandparent->rChild = child;
-}
-
-/** Returns grandparent node 
- * @child The child node */
-template <typename ElemType>
-typename RedBlackTree<ElemType>::Node*
-RedBlackTree<ElemType>::grandparent(const Node* const child) const {
-	if (child == NULL || child->parent == NULL) return NULL;
-	return child->parent->parent;
-}
-
-/** Returns uncle node
- * @child The child node */
-template <typename ElemType>
-typename RedBlackTree<ElemType>::Node*
-RedBlackTree<ElemType>::uncle(const Node* const child) const {
-	if (grandparent(child) == NULL) return NULL;
-	if (grandparent(child)->rChild == child->parent) return grandparent(child)->lChild;
-	return grandparent(child)->rChild;
-}
-
-/** Returns sibling node */
-template <typename ElemType>
-typename RedBlackTree<ElemType>::Node*
-RedBlackTree<ElemType>::sibling(const Node* const child) const {
-	if (child == NULL || child->parent == NULL) return NULL;
-	if (child->parent->lChild == child) return child->parent->rChild;
-	return child->parent->lChild;
-}
-
-/** Gets called to restore red black properties
- * @child The current node being looked at. Viewed as child */
-template <typename ElemType>
-void RedBlackTree<ElemType>::restoreTree(Node* const child) {
-	// NOTE: This should not get called on a NULL node, so child should never be NULL.
-	if (root->red) { // Root is wrong color.
-		root->red = false;
-		return;
-	} 
-	if (!child->parent->red) return; // Case I. Regular insertion. 
-	if (child->red && child->parent->red) {
-		if (uncle(child) != NULL && uncle(child)->red) { // Case II. Parent && Uncle are red.
-			grandparent(child)->red = true; // Solution: Swap colors from grand gen to par gen
-			uncle(child)->red = false;
-			child->parent->red = false;
-			restoreTree(grandparent(child)); // Fix any issues that this might have caused.
-		} else {
-			/** Case III. Child is opposite child that parent is and parent/uncle diff colors */
-			/** Solution: Rotate so that parent and child are both lChild or rChild.
-			 * Finish by doing Case IV */
-			// NOTE: Grandparent should never be NULL if there's a red red discrepancy!
-			if (grandparent(child)->lChild == child->parent && child == child->parent->rChild) {
-				Node* origParent = child->parent;
-				rotate(child, true); // Left rotate
-				restoreTree(origParent); // Proceed to Case IV with new child.
-			} else if (grandparent(child)->rChild == child->parent && child == child->parent->lChild) {
-				Node* origParent = child->parent;
-				rotate(child, false); // Right rotate
-				restoreTree(origParent); // Case IV
-			} else { // Case IV: Parent and Child are on same side.
-				/** Solution: Rotate parent and grandparent and then swap colors */
-				Node* origParent = child->parent;
-				Node* origGrandparent = grandparent(child);
-				origParent->red = origGrandparent->red;
-				origGrandparent->red = !origGrandparent->red;
-				if (origParent == origGrandparent->lChild) rotate(origParent, false);
-				else rotate(origParent, true);
-			}
-		}
+	if (Merkle && merkleHashes) { // child now holds the pairs its old parent held
+		const std::uint64_t topHash = origParent->hash();
+		origParent->setHash(origParent->hash() + hashOf(origGrandchild) - child->hash());
+		child->setHash(topHash);
 	}
+	numRotations++;
 }
 
 /** Recursive wrapper for verifying red nodes have only black children */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::verifyRedChild() const {
-	return verifyRedChild(root);
-}
-
-/** Verifies the property that red nodes have black children recursively starting from currNode
- * @currNode The current node being verified */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::verifyRedChild(const Node* const currNode) const {
-	if (currNode == NULL) return true; // Stop at leaves
-	if (currNode->lChild == NULL && currNode->rChild == NULL) return true; // Check cases of red-red parent/child
-	if (((currNode->lChild != NULL && currNode->lChild->red) ||
-	     (currNode->rChild != NULL && currNode->rChild->red)) && currNode->red) return false;
-	if (!verifyRedChild(currNode->lChild) || !verifyRedChild(currNode->rChild)) return false;
-	return true;
-}
-
-/** Returns black height for a given node in a given direction
- * @currNode The given node
- * @left The direction */
-template <typename ElemType>
-int RedBlackTree<ElemType>::blackHeight(const Node* const currNode, const bool left) const {
-	Node* child;
-	if (left) child = currNode->lChild;
-	else child = currNode->rChild;
-	if (child == NULL) return 1; // 1 for leaves
-	if (child->red) return blackHeight(child, left); // If not black, return child's blackheight
-	return blackHeight(child, left)+1; // Otherwise, add one to child's blackheight
-}
-
-/** Recursively verifies that node has equal left and right black heights
- * @currNode The current node being verified */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::verifyBlackHeight(const Node* const currNode) const {
-	if (currNode == NULL) return true; // Stop at leaves
-	if (blackHeight(currNode, true) != blackHeight(currNode, false)) return false; // Check currNode
-	if (!verifyBlackHeight(currNode->lChild) || !verifyBlackHeight(currNode->rChild)) return false; // Check children
-	return true;
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyRedChild() const {
+	return RedBlackBalance::verifyRedChild(root);
 }
 
 /** Recursive wrapper for verifying black height */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::verifyBlackHeight() const {
-	return verifyBlackHeight(root);
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyBlackHeight() const {
+	return RedBlackBalance::blackHeight(root) != -1;
 }
 
 /** Recursive wrapper for determining if an element is contained in the tree
  * @value The value to be checked */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::contains(const ElemType& value) const {
-	return count(value) != 0;
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::contains(const ElemType& value) const {
+	trace(kTraceContains, value);
+	const Node* node = lookup(value);
+	return node != NULL && node->count != 0;
 }
 
 /** Returns whether or not the root is black. Returns true if NULL root */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::blackRoot() const {
-	if (root == NULL) return true; // Handle NULL root
-	return !root->red;	
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::blackRoot() const {
+	return RedBlackBalance::blackRoot(root);
 }
 
 /** Recursive wrapper for verifying that parent's children are children's parents */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::parentChildMatch() const {
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::parentChildMatch() const {
 	return parentChildMatch(root);
 }
 
 /** Recursively checks for match between parent and child pointers
  * @currNode Node being checked */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::parentChildMatch(const Node* const currNode) const {
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::parentChildMatch(const Node* const currNode) const {
 	if (currNode == NULL) return true; // Stop at leaves
 	if (currNode->lChild != NULL && currNode->lChild->parent != currNode) return false; // Check all false cases
 	if (currNode->rChild != NULL && currNode->rChild->parent != currNode) return false;
@@ -490,230 +1858,1110 @@ bool RedBlackTree<ElemType>::parentChildMatch(const Node* const currNode) const
 }
 
 /** Finds a given node if it exists. Returns NULL otherwise.
- * @currNode Current node being looked at
+ * @currNode Node to start searching from
  * @value Value being searched for */
-template <typename ElemType>
-typename RedBlackTree<ElemType>::Node* const
-RedBlackTree<ElemType>::findNode(Node* const currNode, const ElemType &value) const {
-	if (currNode == NULL) return NULL; // If leaf, not found
-	if (currNode->value == value) return currNode; //Binary search
-	if (value < currNode->value) return findNode(currNode->lChild, value);
-	else return findNode(currNode->rChild, value);
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node* const
+RedBlackTree<ElemType, Balance, Merkle>::findNode(Node* const currNode, const ElemType &value) const {
+	KeyProbe<ElemType> probe(value);
+	Node* node = currNode;
+	while (node != NULL) { //Binary search
+		const int order = probe.compare(node);
+		if (order == 0) return node;
+		if (order < 0) node = node->lChild;
+		else node = node->rChild;
+	}
+	return NULL; // If leaf, not found
 }
 
 /** Returns the number of times a key is in the tree.
  * @value Value being searched for */
-template <typename ElemType>
-std::size_t RedBlackTree<ElemType>::count(const ElemType &value) const {
-	if (findNode(root, value) == NULL) return 0;
-	return findNode(root, value)->count;
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::count(const ElemType &value) const {
+	trace(kTraceCount, value);
+	const Node* node = lookup(value);
+	if (node == NULL) return 0;
+	return node->count;
 }
 
 /** Deletes an element from the tree if it exists. Otherwise, it throws an error.
  * @value Value being removed */
-template <typename ElemType>
-void RedBlackTree<ElemType>::remove(const ElemType &value) {
-	Node* toDelete = findNode(root, value); // Check if in tree
-	if (toDelete == NULL) throw std::invalid_argument("That value is not in the tree."); // Error handle
-	if (toDelete->count != 1) --toDelete->count; // If count is greater than 1, no deletion necessary
-	else rbDelete(toDelete); // Remove node if necessary
-	--numElems; // Decrement size
-}
-
-/** Swaps the values and counts of two nodes
- * @left The first node
- * @right The second node */
-template <typename ElemType>
-void RedBlackTree<ElemType>::swap(Node* const left, Node* const right) {
-	ElemType temp = left->value;
-	left->value = right->value;
-	right->value = temp;
-	std::size_t temp2 = left->count;
-	left->count = right->count;
-	right->count = temp2;
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::remove(const ElemType &value) {
+	trace(kTraceRemove, value);
+	reclaimSlice();
+	Node* toDelete = lookup(value); // Check if in tree
+	if (toDelete == NULL || toDelete->count == 0) // Error handle
+		throw std::invalid_argument("That value is not in the tree.");
+	removeCopies(toDelete, 1);
+}
+
+/** Deletes one copy of a value if it is in the tree
+ * @value Value being removed */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::tryRemove(const ElemType& value) noexcept(kNothrowRemove) {
+	return removeN(value, 1) != 0;
+}
+
+/** Deletes copies of a value. Traced as one remove per copy deleted, or one for a miss,
+ * so a replay deletes the same copies. Deleting zero copies is not traced at all.
+ * @value Value being removed
+ * @n The most copies to delete */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::removeN(const ElemType& value, const std::size_t n) noexcept(kNothrowRemove) {
+	if (n == 0) return 0;
+	reclaimSlice();
+	Node* toDelete = lookup(value);
+	if (toDelete == NULL || toDelete->count == 0) {
+		trace(kTraceRemove, value);
+		return 0;
+	}
+	const std::size_t removed = removeCopies(toDelete, n);
+	for (std::size_t i = 0; i < removed; i++) trace(kTraceRemove, value);
+	return removed;
+}
+
+/** Deletes all copies of a value
+ * @value Value being removed */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::eraseAll(const ElemType& value) noexcept(kNothrowRemove) {
+	return removeN(value, static_cast<std::size_t>(-1));
+}
+
+/** Looks up the node holding a value. Tombstones give an empty position.
+ * @value Value being searched for */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Position RedBlackTree<ElemType, Balance, Merkle>::find(const ElemType& value) const {
+	Node* node = lookup(value);
+	return Position((node == NULL || node->count == 0) ? NULL : node);
+}
+
+/** Deletes copies of the value at a position
+ * @position A position from find() on this tree
+ * @n The most copies to delete */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::erase(const Position& position, const std::size_t n) noexcept(kNothrowRemove) {
+	if (position.node == NULL || position.node->count == 0 || n == 0) return 0;
+	reclaimSlice();
+	const std::size_t removed = (n < position.node->count) ? n : position.node->count;
+	for (std::size_t i = 0; i < removed; i++) trace(kTraceRemove, position.node->value); // The node may be freed below
+	return removeCopies(position.node, n);
+}
+
+/** Returns the smallest value, which is never a tombstone */
+template <typename ElemType, typename Balance, bool Merkle>
+const ElemType& RedBlackTree<ElemType, Balance, Merkle>::min() const {
+	if (numElems == 0) throw std::out_of_range("The tree is empty.");
+	return minNode->value;
+}
+
+/** Returns the largest value, which is never a tombstone */
+template <typename ElemType, typename Balance, bool Merkle>
+const ElemType& RedBlackTree<ElemType, Balance, Merkle>::max() const {
+	if (numElems == 0) throw std::out_of_range("The tree is empty.");
+	return maxNode->value;
+}
+
+/** Removes one copy of the smallest value. The node is unlinked once its count
+ * reaches zero, even in lazy mode, and so are any tombstones that become the new
+ * minimum. The share of tombstones grows, so it is checked as remove() does. */
+template <typename ElemType, typename Balance, bool Merkle>
+ElemType RedBlackTree<ElemType, Balance, Merkle>::popMin() {
+	if (numElems == 0) throw std::out_of_range("The tree is empty.");
+	reclaimSlice();
+	Node* node = minNode;
+	ElemType value = node->value;
+	--numElems;
+	publish(kChangeRemove, value, node->count - 1);
+	--node->count;
+	countChanged(node, node->count + 1);
+	if (node->count == 0) rbDelete(node);
+	trimEnds();
+	limitTombstones();
+	return value;
+}
+
+/** Removes one copy of the largest value, as popMin() does for the smallest */
+template <typename ElemType, typename Balance, bool Merkle>
+ElemType RedBlackTree<ElemType, Balance, Merkle>::popMax() {
+	if (numElems == 0) throw std::out_of_range("The tree is empty.");
+	reclaimSlice();
+	Node* node = maxNode;
+	ElemType value = node->value;
+	--numElems;
+	publish(kChangeRemove, value, node->count - 1);
+	--node->count;
+	countChanged(node, node->count + 1);
+	if (node->count == 0) rbDelete(node);
+	trimEnds();
+	limitTombstones();
+	return value;
+}
+
+/** Sums the counts of the nodes in a range by walking from the first one in order.
+ * Costs O(log n + k) for k distinct values in the range.
+ * @lo The smallest value counted
+ * @hi The largest value counted */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::countRange(const ElemType& lo, const ElemType& hi) const {
+	std::size_t total = 0;
+	for (const Node* currNode = lowerBound(lo); currNode != NULL && !(hi < currNode->value);
+	     currNode = nextNode(currNode))
+		total += currNode->count;
+	return total;
+}
+
+/** Removes all nodes in a range. Ranges holding up to half of the nodes are unlinked
+ * node by node in O(k log n); larger ones are dropped while the surviving nodes are
+ * relinked in O(n), as in applyBatch(). Unlinking in order mostly rotates near the
+ * range, so it beats relinking well past the point its bound suggests. The removed nodes are chained through their
+ * left children and freed as one subtree, so deferred freeing applies to them too.
+ * @lo The smallest value removed
+ * @hi The largest value removed
+ * @return The number of elements removed, counting duplicates */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::removeRange(const ElemType& lo, const ElemType& hi) {
+	reclaimSlice();
+	Node* first = lowerBound(lo);
+	std::size_t removed = 0;
+	std::size_t inRange = 0; // Distinct nodes
+	for (const Node* currNode = first; currNode != NULL && !(hi < currNode->value); currNode = nextNode(currNode)) {
+		removed += currNode->count;
+		if (currNode->count == 0) numTombstones--;
+		inRange++;
+	}
+	if (inRange == 0) return 0;
+	publish(kChangeResync, ElemType(), 0);
+	Node* chain = NULL; // Removed nodes, linked through lChild
+	if (inRange * 2 >= numNodes) { // Relink the survivors
+		std::vector<Node*> oldNodes;
+		std::vector<Node*> nodes;
+		oldNodes.reserve(numNodes);
+		collectNodes(root, oldNodes);
+		nodes.reserve(oldNodes.size() - inRange);
+		for (std::size_t i = 0; i < oldNodes.size(); i++) {
+			if (oldNodes[i]->value < lo || hi < oldNodes[i]->value) nodes.push_back(oldNodes[i]);
+			else {
+				oldNodes[i]->lChild = chain;
+				oldNodes[i]->rChild = NULL;
+				chain = oldNodes[i];
+			}
+		}
+		numElems -= static_cast<int>(removed);
+		rebuild(nodes);
+	} else {
+		Node* currNode = first;
+		for (std::size_t i = 0; i < inRange; i++) {
+			Node* next = nextNode(currNode); // Unlinking only rotates, so next stays next
+			unlinkNode(currNode);
+			currNode->lChild = chain;
+			chain = currNode;
+			currNode = next;
+		}
+		numElems -= static_cast<int>(removed);
+	}
+	trimEnds();
+	if (maxFreesPerOp == 0 && !backgroundFree) {
+		std::vector<Node*> queue(1, chain);
+		freeNodes(queue, static_cast<std::size_t>(-1));
+	} else deferFree(chain);
+	return removed;
+}
+
+/** Unlinks nodes from the front of the tree, following minNode. The minimum has no
+ * left child, so it is never swapped with a predecessor, and the fix ups after
+ * deleting it amortize to O(1). The nodes are chained and freed as in removeRange().
+ * @cutoff The smallest value kept
+ * @maxNodes The most nodes to unlink, counting tombstones
+ * @return The number of elements removed, counting duplicates */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::removeBelow(const ElemType& cutoff, const std::size_t maxNodes) {
+	reclaimSlice();
+	std::size_t removed = 0;
+	Node* chain = NULL; // Removed nodes, linked through lChild
+	for (std::size_t unlinked = 0; minNode != NULL && minNode->value < cutoff && unlinked < maxNodes; unlinked++) {
+		Node* currNode = minNode;
+		if (currNode->count == 0) numTombstones--;
+		else publish(kChangeRemove, currNode->value, 0);
+		removed += currNode->count;
+		numElems -= static_cast<int>(currNode->count);
+		unlinkNode(currNode);
+		currNode->lChild = chain;
+		chain = currNode;
+	}
+	if (chain == NULL) return 0;
+	trimEnds();
+	if (maxFreesPerOp == 0 && !backgroundFree) {
+		std::vector<Node*> queue(1, chain);
+		freeNodes(queue, static_cast<std::size_t>(-1));
+	} else deferFree(chain);
+	return removed;
+}
+
+/** Swaps the positions, colors and ranks of a node and its in-order predecessor. Values
+ * stay in their nodes, so no value is copied and pointers to nodes stay valid.
+ * @node A node with two children
+ * @pred The in-order predecessor of node */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::swapNodes(Node* const node, Node* const pred) {
+	Node* origParent = node->parent; // Store original pointers
+	Node* origLeft = node->lChild;
+	Node* origPredParent = pred->parent;
+	Node* origPredLeft = pred->lChild; // pred has no right child
+	bool temp = node->red;
+	node->red = pred->red;
+	pred->red = temp; // Swap colors
+	signed char tempRank = node->rank;
+	node->rank = pred->rank;
+	pred->rank = tempRank;
+	pred->parent = origParent; // Move pred up into node's position
+	if (origParent == NULL) root = pred;
+	else if (origParent->lChild == node) origParent->lChild = pred;
+	else origParent->rChild = pred;
+	pred->rChild = node->rChild;
+	pred->rChild->parent = pred;
+	if (origPredParent == node) { // pred was node's left child
+		pred->lChild = node;
+		node->parent = pred;
+	} else {
+		pred->lChild = origLeft;
+		origLeft->parent = pred;
+		origPredParent->rChild = node;
+		node->parent = origPredParent;
+	}
+	node->lChild = origPredLeft; // Move node down into pred's position
+	if (origPredLeft != NULL) origPredLeft->parent = node;
+	node->rChild = NULL;
 }
 
 /** Returns the in-order predecessor of the current node.
  * @node The given node
  * @return The in-order pred. NULL if node is NULL or has no left child */
-template <typename ElemType>
-typename RedBlackTree<ElemType>::Node*
-RedBlackTree<ElemType>::inOrderPredecessor(const Node* const node) const {
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::inOrderPredecessor(const Node* const node) const {
 	if (node == NULL || node->lChild == NULL) return NULL;
 	Node* inOrderPred = node->lChild;
 	while (inOrderPred->rChild != NULL) inOrderPred = inOrderPred->rChild; // Go as far right as possible
 	return inOrderPred;
 }
 
-/** Returns the number of NULL children of the given node. 0 if given node is NULL.
+/** Returns the in-order predecessor of a node, climbing through parent pointers
+ * when it has no left child.
  * @node The given node */
-template <typename ElemType>
-int RedBlackTree<ElemType>::numNullChildren(const Node* const node) const {
-	int num = 0;
-	if (node == NULL) return num;
-	if (node->lChild == NULL) num++;
-	if (node->rChild == NULL) num++;
-	return num;
-}
-
-/** Restores tree properties after delete.
- * @parent The parent of the node that's messing up rb properties
- * @notSibling The node that's messing up rb properties */
-template <typename ElemType>
-void RedBlackTree<ElemType>::deleteRestoreTree(Node* const parent, const Node* const notSibling) {
-	/** Case 0: */
-	if (parent == NULL) return; // At the root. Do nothing.
-	
-	/** Find the sibling node */
-	Node* sibling;
-	bool left = false;
-	if (parent->lChild != notSibling) {
-		sibling = parent->lChild;
-		left = true;
-	}
-	if (parent->rChild != notSibling) sibling = parent->rChild;
-
-	/** Case I: Sibling is red => Parent is black */
-	if (sibling->red) {
-		sibling->red = parent->red; // Swap colors and rotate
-		parent->red = !parent->red;
-		rotate(sibling, !left);
-		deleteRestoreTree(parent, notSibling); // Recurse in new position
-	} else if (!parent->red && !sibling->red &&
-	     	   (sibling->lChild == NULL || !sibling->lChild->red) &&
-		   (sibling->rChild == NULL || !sibling->rChild->red)) {
-	/** Case II: Parent is black. Sibling is black. Both sibling children are black or NULL. */
-		sibling->red = true; // Just recolor.
-		deleteRestoreTree(parent->parent, parent);
-	} else if (parent->red && (sibling->lChild == NULL || !sibling->lChild->red)
-			       && (sibling->rChild == NULL || !sibling->rChild->red)) { 
-	/** Case III: Parent is red => Sibling must be black. And both sibling children must
-	 * be black or NULL. */
-		sibling->red = parent->red;
-		parent->red = !parent->red; // Just swap colors
-	} else if ((!left && (sibling->rChild == NULL || !sibling->rChild->red) && sibling->lChild->red) || ((left && (sibling->lChild == NULL || !sibling->lChild->red)) && sibling->rChild->red)) {
-	/** Case IV: Inside sibling child is red. Outside sibling child is black. */
-		Node* child;
-		if (left) child = sibling->rChild;
-		else child = sibling->lChild;
-		sibling->red = child->red;
-		child->red = !child->red; // Swap colors and rotate into case V.
-		rotate(child, left);
-		deleteRestoreTree(parent, notSibling);
-	} else if ((!left && sibling->rChild != NULL && sibling->rChild->red) ||
-	           (left && sibling->lChild != NULL && sibling->lChild->red)) {
-	/** Case V: If the outer sibling child is red */
-		bool temp;
-		temp = sibling->red;
-		sibling->red = parent->red;
-		parent->red = temp; //Swap colors
-		if (!left) sibling->rChild->red = false;
-		else sibling->lChild->red = false; // Turn outer sibling child black
-		rotate(sibling, !left); // Rotate
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::prevNode(const Node* node) const {
+	if (node->lChild != NULL) return inOrderPredecessor(node);
+	while (node->parent != NULL && node->parent->lChild == node) node = node->parent;
+	return node->parent;
+}
+
+/** A new leaf is the new minimum exactly when it hangs left of the old minimum,
+ * and likewise for the maximum.
+ * @leaf The leaf, already linked to its parent */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::linkedLeaf(Node* const leaf) {
+	Node* parent = leaf->parent;
+	numNodes++;
+	if (Merkle && merkleHashes) {
+		leaf->setHash(0);
+		addHash(leaf, pairHash(leaf->value, leaf->count));
+	}
+	if (parent == NULL) {
+		minNode = leaf;
+		maxNode = leaf;
+		if (hashIndex) index.insert(leaf);
+		return;
 	}
+	if (parent == minNode && parent->lChild == leaf) minNode = leaf;
+	if (parent == maxNode && parent->rChild == leaf) maxNode = leaf;
+	if (hashIndex) index.insert(leaf);
 }
+
+/** Finds a node through the hash index, or by descending from the root
+ * @value Value being searched for */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node* RedBlackTree<ElemType, Balance, Merkle>::lookup(const ElemType& value) const {
+	if (hashIndex) return index.find(value);
+	return findNode(root, value);
+}
+
+/** Rebuilds the hash index, walking the tree in order. The first walk only counts,
+ * so the table is sized for the distinct values rather than for every duplicate. */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::reindex() {
+	if (!hashIndex) return;
+	std::size_t nodes = 0;
+	for (const Node* node = minNode; node != NULL; node = nextNode(node)) nodes++;
+	index.reset(nodes);
+	for (Node* node = minNode; node != NULL; node = nextNode(node)) index.insert(node);
+}
+
+/** Recomputes minNode and maxNode in O(log n) */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::resetEnds() {
+	minNode = root;
+	maxNode = root;
+	if (root == NULL) return;
+	while (minNode->lChild != NULL) minNode = minNode->lChild;
+	while (maxNode->rChild != NULL) maxNode = maxNode->rChild;
+}
+
+/** Returns the in-order successor of a node, climbing through parent pointers
+ * when it has no right child.
+ * @node The given node */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::nextNode(const Node* node) const {
+	if (node->rChild != NULL) {
+		Node* next = node->rChild;
+		while (next->lChild != NULL) next = next->lChild;
+		return next;
+	}
+	while (node->parent != NULL && node->parent->rChild == node) node = node->parent;
+	return node->parent;
+}
+
 	
 
-/** Deals with all of the deletion cases recursively.
+/** Finds the first node in order whose value is not less than value
+ * @value The bound */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::lowerBound(const ElemType& value) const {
+	KeyProbe<ElemType> probe(value);
+	Node* bound = NULL;
+	Node* currNode = root;
+	while (currNode != NULL) {
+		if (probe.compare(currNode) > 0) currNode = currNode->rChild;
+		else {
+			bound = currNode;
+			currNode = currNode->lChild;
+		}
+	}
+	return bound;
+}
+
+/** Unlinks a node from the tree and frees it.
  * @currNode The node to be deleted */
-template <typename ElemType>
-void RedBlackTree<ElemType>::rbDelete(Node* currNode) {
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::rbDelete(Node* currNode) {
+	unlinkNode(currNode);
+	freeNode(currNode);
+}
+
+/** Lowers the count of a node, unlinking it or leaving a tombstone once it reaches zero
+ * @node A node with a nonzero count
+ * @n The most copies to delete */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::removeCopies(Node* const node, const std::size_t n) noexcept(kNothrowRemove) {
+	const std::size_t oldCount = node->count;
+	const std::size_t removed = (n < oldCount) ? n : oldCount;
+	numElems -= static_cast<int>(removed);
+	publish(kChangeRemove, node->value, oldCount - removed);
+	if (removed != oldCount) { // Copies are left, so no deletion necessary
+		node->count -= removed;
+		countChanged(node, oldCount);
+	} else if (lazyRemove) { // Leave a tombstone; no rebalancing
+		node->count = 0;
+		countChanged(node, oldCount);
+		numTombstones++;
+		trimEnds(); // Tombstones at the ends are unlinked right away
+		limitTombstones();
+	} else {
+		rbDelete(node); // Remove node if necessary
+		trimEnds();
+	}
+	return removed;
+}
+
+/** Detaches a node from the tree without freeing it, so the caller can reuse it.
+ * @currNode The node to be unlinked */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::unlinkNode(Node* currNode) {
 	/** NOTE: Should only get called when currNode is non-NULL */
-	int nullChildren = numNullChildren(currNode);
-	switch (nullChildren) {
-		/** Case 0: Node has two non-NULL children.
-		 * Find io pred, swap values, and delete that */
-		case 0: {
-			Node* inOrderPred = inOrderPredecessor(currNode);
-			swap(currNode, inOrderPred);
-			rbDelete(inOrderPred);
-		}
-			break;
-		case 1: {
-			Node* child;
-			if (currNode->lChild != NULL) child = currNode->lChild;
-			if (currNode->rChild != NULL) child = currNode->rChild;
-		/** NOTE: Parent must be black, child must be red.
-		 * If parent is red, then it must have one black child, which violates
-		 * black height.
-		 * If parent is black and child is black, then it again violates black height.
-		 */
-			if (!currNode->red && child->red) {
-				child->red = false;
-				if (currNode->parent != NULL) {
-					child->parent = currNode->parent;
-					if (currNode->parent->lChild == currNode)
-						currNode->parent->lChild = child;
-					else currNode->parent->rChild = child;
-				} else {
-					root = child;
-					child->parent = NULL;
-				}
-				delete currNode;
-			}
-		}
-			break;
-		/** Case II: Node has two NULL children.
-		 * If red, remove it. If root, remove it. */	
-		case 2: {
-		/** Subcase II: If node is the root. */
-			if (currNode == root) {
-				delete root;
-				root = NULL;
-			} else {
-		/** Subcase II: If node is red. Just replace it with NULL */
-				if (currNode->parent->lChild == currNode)
-					currNode->parent->lChild = NULL;
-				else currNode->parent->rChild = NULL;
-				//Node* sib = sibling(currNode);
-				Node* parent = currNode->parent;
-				bool origColor = currNode->red;
-				delete currNode;
-		/** Subcase III: If node is black. Delete it and restore tree props. */
-				if (!origColor) deleteRestoreTree(parent, NULL);
-			}
-			break;	
+	numNodes--;
+	if (currNode == purgeCursor) purgeCursor = NULL;
+	if (currNode == compactCursor) compactCursor = NULL;
+	if (currNode == minNode) minNode = nextNode(currNode); // Unlinking keeps the order of the rest
+	if (currNode == maxNode) maxNode = prevNode(currNode);
+	if (hashIndex) index.erase(currNode);
+	if (Merkle && merkleHashes) addHash(currNode, 0 - pairHash(currNode->value, currNode->count)); // Hash it as empty
+	if (currNode->lChild != NULL && currNode->rChild != NULL) {
+		/** Node has two non-NULL children.
+		 * Find io pred, swap positions, and unlink the node from there */
+		Node* pred = inOrderPredecessor(currNode);
+		if (Merkle && merkleHashes) { // Only the subtrees between the two positions lose pred's pair
+			const std::uint64_t predHash = pred->hash() - hashOf(pred->lChild); // pred has no right child
+			for (Node* node = pred->parent; node != currNode; node = node->parent) node->setHash(node->hash() - predHash);
+			const std::uint64_t topHash = currNode->hash();
+			currNode->setHash(pred->hash() - predHash);
+			pred->setHash(topHash);
 		}
+		swapNodes(currNode, pred);
 	}
+	Balance::unlink(*this, currNode); // At most one child now
+	currNode->parent = NULL;
+	currNode->lChild = NULL;
+	currNode->rChild = NULL;
 }
 
 /** Wrapper for verifying all RB Properties */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::verifyProperties() const {
-	return verifyRedChild() && parentChildMatch() && verifyBlackHeight()
-	       	&& blackRoot() && verifyCount();
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyProperties() const {
+	return Balance::verify(*this) && parentChildMatch() && verifyCount() && verifyEnds() && verifyIndex() && verifyHashes();
+}
+
+/** Verifies the hash index against an in-order walk */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyIndex() const {
+	if (!hashIndex) return index.size() == 0;
+	std::size_t nodes = 0;
+	for (const Node* node = minNode; node != NULL; node = nextNode(node), nodes++)
+		if (index.find(node->value) != node) return false;
+	return nodes == index.size();
+}
+
+/** Verifies the cached leftmost and rightmost nodes */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyEnds() const {
+	if (root == NULL) return minNode == NULL && maxNode == NULL;
+	const Node* leftmost = root;
+	while (leftmost->lChild != NULL) leftmost = leftmost->lChild;
+	const Node* rightmost = root;
+	while (rightmost->rChild != NULL) rightmost = rightmost->rChild;
+	return minNode == leftmost && maxNode == rightmost && minNode->count != 0 && maxNode->count != 0;
 }
 
 /** Helper function that copies a tree recursively
  * @from The current node to be copied from
  * @into The current node to be copied into
  * @parent The parent of the into node */
-template <typename ElemType>
-void RedBlackTree<ElemType>::copyTree(const Node* const from, Node* &into, Node* const parent) const {
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::copyTree(const Node* const from, Node* &into, Node* const parent) const {
 	if (from == NULL) into = NULL; // Stop at leaves
 	else {
 		into = new Node; // Make a new node to copy into
 		into->parent = parent; // Copy values
+		into->pooled = false;
 		into->value = from->value;
+		into->setPrefix(into->value);
 		into->count = from->count;
+		into->setHash(from->hash());
 		into->red = from->red;
+		into->rank = from->rank;
 		copyTree(from->lChild, into->lChild, into); // Copy children
 		copyTree(from->rChild, into->rChild, into);
 	}
 }
 
+/** Visits nodes in order, tracking depth as it steps down to children and up to parents
+ * @visit Called with each node and its depth. The root is depth 0 */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Visitor>
+void RedBlackTree<ElemType, Balance, Merkle>::forEachDepth(Visitor visit) const {
+	const Node* currNode = root;
+	int depth = 0;
+	if (currNode == NULL) return;
+	while (currNode->lChild != NULL) {
+		currNode = currNode->lChild;
+		depth++;
+	}
+	while (currNode != NULL) {
+		visit(currNode, depth);
+		if (currNode->rChild != NULL) { // Leftmost node of the right subtree
+			currNode = currNode->rChild;
+			depth++;
+			while (currNode->lChild != NULL) {
+				currNode = currNode->lChild;
+				depth++;
+			}
+			continue;
+		}
+		while (currNode->parent != NULL && currNode->parent->rChild == currNode) {
+			currNode = currNode->parent;
+			depth--;
+		}
+		currNode = currNode->parent; // NULL after the last node
+		depth--;
+	}
+}
+
+/** Follows glibc: a chunk holds the request plus an 8 byte header, rounded up to 16
+ * bytes with a 32 byte minimum
+ * @size The requested size */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::mallocBytes(const std::size_t size) {
+	std::size_t chunk = (size + sizeof(std::size_t) + 15) / 16 * 16;
+	return std::max(chunk, static_cast<std::size_t>(32));
+}
+
+/** Returns the height of a subtree. -1 for NULL
+ * @currNode The root of the subtree */
+template <typename ElemType, typename Balance, bool Merkle>
+int RedBlackTree<ElemType, Balance, Merkle>::subtreeHeight(const Node* const currNode) const {
+	if (currNode == NULL) return -1;
+	return 1 + std::max(subtreeHeight(currNode->lChild), subtreeHeight(currNode->rChild));
+}
+
+/** Appends all nodes of a subtree in order
+ * @currNode The root of the subtree
+ * @nodes Where the nodes are appended */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::collectNodes(Node* const currNode, std::vector<Node*>& nodes) const {
+	if (currNode == NULL) return; // Stop at leaves
+	collectNodes(currNode->lChild, nodes);
+	nodes.push_back(currNode);
+	collectNodes(currNode->rChild, nodes);
+}
+
+/** Links sorted nodes into a balanced subtree. The left half gets the extra node on
+ * uneven splits, so all NULL leaves are at depth redDepth or redDepth+1. Coloring
+ * the nodes at redDepth red then gives every path the same black height, and the
+ * heights of siblings differ by at most one.
+ * @nodes The sorted nodes
+ * @lo The first node of the subtree
+ * @hi One past the last node of the subtree
+ * @parent The parent of the subtree
+ * @depth The depth of the subtree root
+ * @redDepth The depth of the only red level */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::linkBalanced(std::vector<Node*>& nodes, const std::size_t lo, const std::size_t hi,
+				     Node* const parent, const int depth, const int redDepth) {
+	if (lo == hi) return NULL; // Stop at leaves
+	const std::size_t mid = lo + (hi - lo) / 2;
+	Node* currNode = nodes[mid];
+	int height = 0; // A left leaning split of m nodes is floor(log2(m)) high
+	while ((static_cast<std::size_t>(2) << height) <= hi - lo) height++;
+	currNode->parent = parent;
+	Balance::initBalanced(currNode, depth, redDepth, height);
+	currNode->lChild = linkBalanced(nodes, lo, mid, currNode, depth + 1, redDepth);
+	currNode->rChild = linkBalanced(nodes, mid + 1, hi, currNode, depth + 1, redDepth);
+	return currNode;
+}
+
+/** Replaces the tree with a balanced tree made of the given nodes. The nodes must
+ * be sorted and numElems must already match their counts.
+ * @nodes The sorted nodes */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::rebuild(std::vector<Node*>& nodes) {
+	int redDepth = 0; // Number of full levels: floor(log2(n+1))
+	while ((static_cast<std::size_t>(2) << redDepth) <= nodes.size() + 1) redDepth++;
+	root = linkBalanced(nodes, 0, nodes.size(), NULL, 0, redDepth);
+	numNodes = nodes.size();
+	purgeCursor = NULL;
+	compactCursor = NULL;
+	minNode = nodes.empty() ? NULL : nodes.front();
+	maxNode = nodes.empty() ? NULL : nodes.back();
+	if (merkleHashes) rehash(root);
+	if (!hashIndex) return;
+	index.reset(nodes.size());
+	for (std::size_t i = 0; i < nodes.size(); i++) index.insert(nodes[i]);
+}
+
+/** Keeps a node for a rebuild unless it is a tombstone
+ * @node The node
+ * @nodes The nodes being kept */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::keepLive(Node* const node, std::vector<Node*>& nodes) {
+	if (node->count == 0) freeNode(node);
+	else nodes.push_back(node);
+}
+
+/** Frees every tombstone and relinks the remaining nodes in O(n) */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::dropTombstones() {
+	std::vector<Node*> oldNodes;
+	std::vector<Node*> nodes;
+	try { // Allocate before touching the tree, so removals need not throw
+		oldNodes.reserve(numNodes);
+		nodes.reserve(numNodes - numTombstones);
+		if (hashIndex) index.reserve(numNodes - numTombstones);
+	} catch (const std::bad_alloc&) { // Keep the tombstones until a later remove
+		return;
+	}
+	collectNodes(root, oldNodes);
+	for (std::size_t i = 0; i < oldNodes.size(); i++) keepLive(oldNodes[i], nodes);
+	numTombstones = 0;
+	rebuild(nodes);
+}
+
+/** Unlinks tombstones from the ends. Each was counted when it was made, so this is
+ * amortized O(1) per removal. */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::trimEnds() {
+	if (numTombstones == 0) return;
+	while (minNode != NULL && minNode->count == 0) {
+		rbDelete(minNode);
+		numTombstones--;
+	}
+	while (maxNode != NULL && maxNode->count == 0) {
+		rbDelete(maxNode);
+		numTombstones--;
+	}
+}
+
+/** Checks the share of tombstones */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::limitTombstones() {
+	if (numTombstones > maxTombstoneFraction * (numElems + numTombstones)) dropTombstones();
+}
+
+/** Finds value by first climbing from finger to the lowest ancestor whose subtree
+ * can hold it, then descending. Costs O(log d) for a value d positions away.
+ * @finger A node with a smaller value to start from. NULL to start at the root
+ * @value Value being searched for
+ * @parent Set to the node a missing value would be attached to
+ * @return The node with the value. NULL if not found */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::Node*
+RedBlackTree<ElemType, Balance, Merkle>::fingerSearch(Node* const finger, const ElemType& value, Node*& parent) const {
+	KeyProbe<ElemType> probe(value);
+	Node* currNode = root;
+	if (finger != NULL) {
+		currNode = finger; // Climb while value is past the right edge of this subtree
+		while (currNode->parent != NULL &&
+		       (currNode == currNode->parent->rChild || probe.compare(currNode->parent) >= 0))
+			currNode = currNode->parent;
+	}
+	parent = NULL;
+	while (currNode != NULL) {
+		const int order = probe.compare(currNode);
+		if (order == 0) return currNode;
+		parent = currNode;
+		if (order < 0) currNode = currNode->lChild;
+		else currNode = currNode->rChild;
+	}
+	return NULL;
+}
+
+/** Orders batch operations by value only, so stable sorting keeps same-value order */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::batchLess(const BatchOp& left, const BatchOp& right) {
+	return left.value < right.value;
+}
+
+/** Folds an operation into a count
+ * @op The operation
+ * @count The copies of its value so far
+ * @misses Incremented by the copies removed that were not there */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::foldOp(const BatchOp& op, std::size_t& count, std::size_t& misses) {
+	if (op.insert) count += op.copies;
+	else if (count < op.copies) {
+		misses += op.copies - count;
+		count = 0;
+	} else count -= op.copies;
+}
+
+/** Copies a tree into root. Large trees have their top levels copied here and the
+ * subtrees below them copied as independent tasks on the thread pool.
+ * @from The root of the tree to copy
+ * @numFrom The number of elements in that tree */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::parallelCopy(const Node* const from, const int numFrom) {
+	if (numFrom < kParallelThreshold || pool().size() == 1) {
+		copyTree(from, root, NULL);
+		return;
+	}
+	std::vector<const Node*> sources;
+	std::vector<Node**> slots;
+	std::vector<Node*> parents;
+	copyTop(from, root, NULL, 0, splitDepth(), sources, slots, parents);
+	pool().parallelFor(sources.size(), [&](std::size_t i) {
+		copyTree(sources[i], *slots[i], parents[i]);
+	});
+}
+
+/** Frees the tree at root. Large trees have their top levels freed here and the
+ * subtrees below them freed as independent tasks on the thread pool. */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::parallelDelete() {
+	if (numElems < kParallelThreshold || pool().size() == 1) {
+		recursiveDelete(root);
+		return;
+	}
+	std::vector<Node*> subtrees;
+	deleteTop(root, 0, splitDepth(), subtrees);
+	pool().parallelFor(subtrees.size(), [&](std::size_t i) {
+		recursiveDelete(subtrees[i]);
+	});
+}
+
+/** Copies the nodes above splitDepth, leaving the subtrees at splitDepth to be copied later
+ * @from The current node to be copied from
+ * @into The current node to be copied into
+ * @parent The parent of the into node
+ * @depth The depth of from
+ * @splitDepth The depth of the subtrees left for tasks
+ * @sources The roots of the subtrees left for tasks
+ * @slots Where each of those subtrees should be copied into
+ * @parents The parent of each of those subtrees */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::copyTop(const Node* const from, Node* &into, Node* const parent, const int depth,
+				     const int splitDepth, std::vector<const Node*>& sources,
+				     std::vector<Node**>& slots, std::vector<Node*>& parents) const {
+	if (from == NULL) into = NULL; // Stop at leaves
+	else if (depth == splitDepth) { // Leave for a task
+		sources.push_back(from);
+		slots.push_back(&into);
+		parents.push_back(parent);
+	} else {
+		into = new Node; // Make a new node to copy into
+		into->parent = parent; // Copy values
+		into->pooled = false;
+		into->value = from->value;
+		into->setPrefix(into->value);
+		into->count = from->count;
+		into->setHash(from->hash());
+		into->red = from->red;
+		into->rank = from->rank;
+		copyTop(from->lChild, into->lChild, into, depth + 1, splitDepth, sources, slots, parents);
+		copyTop(from->rChild, into->rChild, into, depth + 1, splitDepth, sources, slots, parents);
+	}
+}
+
+/** Frees the nodes above splitDepth, keeping the subtrees at splitDepth to be freed later
+ * @currNode The current node being deleted
+ * @depth The depth of currNode
+ * @splitDepth The depth of the subtrees left for tasks
+ * @subtrees The roots of the subtrees left for tasks */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::deleteTop(Node* const currNode, const int depth, const int splitDepth,
+				       std::vector<Node*>& subtrees) {
+	if (currNode == NULL) return; // Stop at leaves
+	if (depth == splitDepth) { // Leave for a task
+		subtrees.push_back(currNode);
+		return;
+	}
+	deleteTop(currNode->lChild, depth + 1, splitDepth, subtrees);
+	deleteTop(currNode->rChild, depth + 1, splitDepth, subtrees);
+	freeNode(currNode);
+}
+
+/** Returns the pool used for parallel work */
+template <typename ElemType, typename Balance, bool Merkle>
+ThreadPool& RedBlackTree<ElemType, Balance, Merkle>::pool() const {
+	if (threadPool == NULL) return ThreadPool::shared();
+	return *threadPool;
+}
+
+/** Returns the split depth. Cutting the tree at this depth leaves about four subtrees
+ * per thread, so uneven subtree sizes still balance out. */
+template <typename ElemType, typename Balance, bool Merkle>
+int RedBlackTree<ElemType, Balance, Merkle>::splitDepth() const {
+	int depth = 0;
+	while ((1u << depth) < 4 * pool().size()) depth++;
+	return depth;
+}
+
+/** Splits the largest whole piece into its left subtree, its root alone and its right
+ * subtree, until there are enough whole pieces or only single nodes are left to split.
+ * Small trees and single thread pools get one piece for the whole tree.
+ * @pieces Filled with the pieces in value order */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::splitPieces(std::vector<Piece>& pieces) const {
+	pieces.clear();
+	if (root == NULL) return;
+	Piece all = {root, true, estimateSize(root)};
+	pieces.push_back(all);
+	if (numElems < kParallelThreshold || pool().size() == 1) return;
+	std::size_t numWhole = 1;
+	while (numWhole < 4 * pool().size()) {
+		std::size_t largest = pieces.size();
+		for (std::size_t i = 0; i < pieces.size(); i++)
+			if (pieces[i].whole && (largest == pieces.size() || pieces[i].estimate > pieces[largest].estimate))
+				largest = i;
+		Node* const top = pieces[largest].node;
+		if (top->lChild == NULL && top->rChild == NULL) break; // Nothing left to split
+		pieces[largest].whole = false;
+		numWhole--;
+		if (top->rChild != NULL) {
+			Piece right = {top->rChild, true, estimateSize(top->rChild)};
+			pieces.insert(pieces.begin() + largest + 1, right);
+			numWhole++;
+		}
+		if (top->lChild != NULL) {
+			Piece left = {top->lChild, true, estimateSize(top->lChild)};
+			pieces.insert(pieces.begin() + largest, left);
+			numWhole++;
+		}
+	}
+}
+
+/** A balanced subtree has both outer paths near log2 of its size, so two to the power
+ * of their average length is within a small factor of the size
+ * @currNode The root of the subtree */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::estimateSize(const Node* const currNode) {
+	int length = 0;
+	for (const Node* node = currNode; node != NULL; node = node->lChild) length++;
+	for (const Node* node = currNode; node != NULL; node = node->rChild) length++;
+	return static_cast<std::size_t>(1) << std::min(length / 2, 62);
+}
+
+/** Visits a piece
+ * @piece The piece
+ * @visit Called with each node */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Visitor>
+void RedBlackTree<ElemType, Balance, Merkle>::visitPiece(const Piece& piece, Visitor& visit) {
+	if (piece.whole) visitSubtree(piece.node, visit);
+	else visit(piece.node);
+}
+
+/** Visits a subtree
+ * @currNode The current node
+ * @visit Called with each node */
+template <typename ElemType, typename Balance, bool Merkle>
+template <typename Visitor>
+void RedBlackTree<ElemType, Balance, Merkle>::visitSubtree(Node* const currNode, Visitor& visit) {
+	if (currNode == NULL) return;
+	visitSubtree(currNode->lChild, visit);
+	visit(currNode);
+	visitSubtree(currNode->rChild, visit);
+}
+
+/** Constructs an empty handle */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::NodeHandle():
+	node(NULL)
+{}
+
+/** Constructs a handle owning a detached node */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::NodeHandle(Node* const node):
+	node(node)
+{}
+
+/** Move Constructor */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::NodeHandle(NodeHandle&& other):
+	node(other.node)
+{
+	other.node = NULL;
+}
+
+/** Move Assignment Operator */
+template <typename ElemType, typename Balance, bool Merkle>
+typename RedBlackTree<ElemType, Balance, Merkle>::NodeHandle&
+RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::operator= (NodeHandle&& other) {
+	if (this != &other) {
+		if (node != NULL) freeNode(node);
+		node = other.node;
+		other.node = NULL;
+	}
+	return *this;
+}
+
+/** Destructor */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::~NodeHandle() {
+	if (node != NULL) freeNode(node);
+}
+
+/** Returns if the handle is empty */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::empty() const {
+	return node == NULL;
+}
+
+/** Returns if the handle owns a node */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::operator bool() const {
+	return node != NULL;
+}
+
+/** Returns the value of the owned node. The handle must not be empty. */
+template <typename ElemType, typename Balance, bool Merkle>
+ElemType& RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::value() const {
+	return node->value;
+}
+
+/** Returns the count of the owned node. The handle must not be empty. */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::NodeHandle::count() const {
+	return node->count;
+}
+
+/** Constructs an empty position */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::Position::Position():
+	node(NULL)
+{}
+
+/** Constructs a position at a node */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::Position::Position(Node* const node):
+	node(node)
+{}
+
+/** Returns if the position holds a value */
+template <typename ElemType, typename Balance, bool Merkle>
+RedBlackTree<ElemType, Balance, Merkle>::Position::operator bool() const {
+	return node != NULL;
+}
+
+/** Returns the value at the position */
+template <typename ElemType, typename Balance, bool Merkle>
+const ElemType& RedBlackTree<ElemType, Balance, Merkle>::Position::value() const {
+	return node->value;
+}
+
+/** Returns the count at the position. 0 if empty */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::Position::count() const {
+	return (node == NULL) ? 0 : node->count;
+}
+
 /** Verifies that the sum of the counts is equal to the size of the tree */
-template <typename ElemType>
-bool RedBlackTree<ElemType>::verifyCount() const {
-	return countSum(root) == size();
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyCount() const {
+	return countSum(root) == static_cast<std::size_t>(size()) && tombstoneSum(root) == numTombstones &&
+	       countUpTo(root, numNodes) == numNodes;
 }
 
 /** Returns the sum of the counts of all nodes
  * @currNode The current node being summed */
-template <typename ElemType>
-std::size_t RedBlackTree<ElemType>::countSum(const Node* const currNode) const {
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::countSum(const Node* const currNode) const {
 	if (currNode == NULL) return 0;
 	return currNode->count + countSum(currNode->lChild) + countSum(currNode->rChild);
 }
 
+/** Returns the number of tombstones in a subtree
+ * @currNode The root of the subtree */
+template <typename ElemType, typename Balance, bool Merkle>
+std::size_t RedBlackTree<ElemType, Balance, Merkle>::tombstoneSum(const Node* const currNode) const {
+	if (currNode == NULL) return 0;
+	return ((currNode->count == 0) ? 1 : 0) + tombstoneSum(currNode->lChild) + tombstoneSum(currNode->rChild);
+}
+
+/** Mixes std::hash of the value with the count through two rounds of splitmix64, so
+ * the sums of different sets of pairs are unlikely to collide
+ * @value The value
+ * @count Its count */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::pairHash(const ElemType& value, const std::size_t count) {
+	if constexpr (Hashable<ElemType>::value) {
+		if (count == 0) return 0; // Tombstones hash as absent
+		std::uint64_t hash = static_cast<std::uint64_t>(std::hash<ElemType>()(value));
+		for (int round = 0; round < 2; round++) {
+			hash += (round == 0) ? 0x9e3779b97f4a7c15ULL : count;
+			hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+			hash ^= hash >> 31;
+		}
+		return hash;
+	} else return 0;
+}
+
+/** Returns a subtree hash
+ * @node The root of the subtree. May be NULL */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::hashOf(const Node* const node) {
+	return (node == NULL) ? 0 : node->hash();
+}
+
+/** Walks up to the root. Hashes add modulo 2^64, so a change anywhere below is
+ * applied to each ancestor as a difference.
+ * @node The lowest node to update
+ * @delta The change in the hash */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::addHash(Node* node, const std::uint64_t delta) {
+	for (; node != NULL; node = node->parent) node->setHash(node->hash() + delta);
+}
+
+/** Replaces the node's old pair with its new one up the tree
+ * @node The node
+ * @oldCount Its count before the change */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::countChanged(Node* const node, const std::size_t oldCount) {
+	if (Merkle && merkleHashes) addHash(node, pairHash(node->value, node->count) - pairHash(node->value, oldCount));
+}
+
+/** Recomputes hashes bottom up
+ * @currNode The root of the subtree */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::rehash(Node* const currNode) {
+	if (currNode == NULL) return 0;
+	currNode->setHash(pairHash(currNode->value, currNode->count) + rehash(currNode->lChild) + rehash(currNode->rChild));
+	return currNode->hash();
+}
+
+/** Subtracts the pairs up to lo from the pairs below hi
+ * @lo The exclusive lower bound. NULL => None
+ * @hi The exclusive upper bound. NULL => None */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::rangeHash(const ElemType* const lo, const ElemType* const hi) const {
+	std::uint64_t below = (hi == NULL) ? hashOf(root) : hashBelow(*hi, false);
+	return below - ((lo == NULL) ? 0 : hashBelow(*lo, true));
+}
+
+/** Descends toward bound, adding each node passed on the left with its left subtree
+ * @bound The bound
+ * @inclusive Whether pairs with value equal to bound are included */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::hashBelow(const ElemType& bound, const bool inclusive) const {
+	std::uint64_t hash = 0;
+	const Node* currNode = root;
+	while (currNode != NULL) {
+		if (currNode->value < bound || (inclusive && !(bound < currNode->value))) {
+			hash += currNode->hash() - hashOf(currNode->rChild);
+			currNode = currNode->rChild;
+		} else currNode = currNode->lChild;
+	}
+	return hash;
+}
+
+/** Compares a subtree with other's pairs in the same range, then the node itself and
+ * its children. Past the leaves of this tree, whatever other holds in range differs.
+ * @currNode The subtree. May be NULL
+ * @lo The value of the closest ancestor the subtree is right of. NULL => None
+ * @hi The value of the closest ancestor the subtree is left of. NULL => None
+ * @other The tree to compare with
+ * @out Receives the differences in order */
+template <typename ElemType, typename Balance, bool Merkle>
+void RedBlackTree<ElemType, Balance, Merkle>::diffSubtree(const Node* const currNode, const ElemType* const lo,
+					 const ElemType* const hi, const RedBlackTree<ElemType, Balance, Merkle>& other,
+					 std::vector<DiffEntry>& out) const {
+	if (hashOf(currNode) == other.rangeHash(lo, hi)) return;
+	if (currNode == NULL) {
+		const Node* node = (lo == NULL) ? other.minNode : other.lowerBound(*lo);
+		if (node != NULL && lo != NULL && !(*lo < node->value)) node = other.nextNode(node);
+		for (; node != NULL && (hi == NULL || node->value < *hi); node = other.nextNode(node)) {
+			DiffEntry entry = {node->value, 0, node->count};
+			if (node->count != 0) out.push_back(entry);
+		}
+		return;
+	}
+	diffSubtree(currNode->lChild, lo, &currNode->value, other, out);
+	const Node* match = other.lookup(currNode->value);
+	DiffEntry entry = {currNode->value, currNode->count, (match == NULL) ? 0 : match->count};
+	if (entry.count != entry.otherCount) out.push_back(entry);
+	diffSubtree(currNode->rChild, &currNode->value, hi, other, out);
+}
+
+/** Verifies the subtree hashes, if they are kept */
+template <typename ElemType, typename Balance, bool Merkle>
+bool RedBlackTree<ElemType, Balance, Merkle>::verifyHashes() const {
+	bool ok = true;
+	if (merkleHashes) hashSum(root, ok);
+	return ok;
+}
+
+/** Returns the recomputed hash of a subtree
+ * @currNode The root of the subtree
+ * @ok Set to false on a mismatch */
+template <typename ElemType, typename Balance, bool Merkle>
+std::uint64_t RedBlackTree<ElemType, Balance, Merkle>::hashSum(const Node* const currNode, bool& ok) const {
+	if (currNode == NULL) return 0;
+	std::uint64_t hash = pairHash(currNode->value, currNode->count) + hashSum(currNode->lChild, ok) +
+			     hashSum(currNode->rChild, ok);
+	if (hash != currNode->hash()) ok = false;
+	return hash;
+}
+
 #endif // REDBLACKTREE_H
@@ -0,0 +1,171 @@
+#ifndef SLIDINGWINDOW_H
+#define SLIDINGWINDOW_H
+
+#include <cstddef>
+#include <stdexcept>
+#include "RedBlackTree.h"
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * RedBlackTree holding the most recent part of a stream of keys, such as event
+ * timestamps, that arrive in order or nearly so. Keys older than the window are
+ * dropped in batches with expireBefore().
+ *
+ * Keys larger than every key in the window are appended next to the maximum
+ * without a search. Expiry unlinks keys from the minimum forwards, so no search
+ * is needed there either, and the cost of each step can be capped at maxNodes
+ * distinct keys. A step that hits the cap leaves expirePending() true, and the
+ * caller finishes the expiry over later calls. The expired nodes are freed a few
+ * at a time by later operations, so freeing does not add to the step either.
+ *
+ * A key older than the last cutoff arrives too late for the window and is
+ * dropped on insert.
+ *
+ */
+
+template <typename ElemType, typename Balance = RedBlackBalance>
+class SlidingWindow {
+friend class RedBlackTreeTest;
+public:
+    /** Constructor. Expired nodes are freed at most maxFrees per later operation;
+     * 0 frees them during the expiry step itself. */
+    explicit SlidingWindow(const std::size_t maxFrees = 64);
+
+    /** Adds a key. Returns false and drops it if it is older than the last cutoff */
+    bool insert(const ElemType& value);
+
+    /** Removes keys older than cutoff, at most maxNodes distinct keys, and returns how
+     * many were removed. Later keys older than cutoff are dropped on insert. */
+    std::size_t expireBefore(const ElemType& cutoff, const std::size_t maxNodes = static_cast<std::size_t>(-1));
+
+    /** Returns true while keys older than the last cutoff are still in the window */
+    bool expirePending() const;
+
+    /** Returns the oldest key. Throws std::out_of_range if the window is empty */
+    const ElemType& oldest() const;
+
+    /** Returns the newest key. Throws std::out_of_range if the window is empty */
+    const ElemType& newest() const;
+
+    /** Returns the number of times a key is in the window */
+    std::size_t count(const ElemType& value) const;
+
+    /** Checks if a key is in the window */
+    bool contains(const ElemType& value) const;
+
+    /** Returns the number of keys in the window */
+    int size() const;
+
+    /** Returns if the window is empty or not */
+    bool empty() const;
+
+    /** Returns the number of keys dropped for arriving after their cutoff */
+    std::size_t late() const;
+
+    /** Returns the tree holding the window, for ordered queries over it */
+    const RedBlackTree<ElemType, Balance>& tree() const;
+
+private:
+    RedBlackTree<ElemType, Balance> window;
+    ElemType watermark; // The last cutoff
+    bool hasWatermark; // False => No cutoff yet
+    std::size_t numLate;
+};
+
+/** Implementation details */
+
+/** Constructor
+ * @maxFrees The most expired nodes freed per operation */
+template <typename ElemType, typename Balance>
+SlidingWindow<ElemType, Balance>::SlidingWindow(const std::size_t maxFrees):
+	watermark(),
+	hasWatermark(false),
+	numLate(0)
+{
+	window.setDeferredFree(maxFrees);
+}
+
+/** Inserts a key unless it is behind the watermark, appending it when it is the newest
+ * @value The key to insert */
+template <typename ElemType, typename Balance>
+bool SlidingWindow<ElemType, Balance>::insert(const ElemType& value) {
+	if (hasWatermark && value < watermark) { // Too late
+		numLate++;
+		return false;
+	}
+	if (!window.append(value)) window.insert(value);
+	return true;
+}
+
+/** Moves the watermark up to cutoff, then unlinks the keys behind it from the front
+ * of the tree. A lower cutoff than the last one leaves the watermark in place.
+ * @cutoff The oldest key kept
+ * @maxNodes The most distinct keys removed by this call */
+template <typename ElemType, typename Balance>
+std::size_t SlidingWindow<ElemType, Balance>::expireBefore(const ElemType& cutoff, const std::size_t maxNodes) {
+	if (!hasWatermark || watermark < cutoff) {
+		watermark = cutoff;
+		hasWatermark = true;
+	}
+	return window.removeBelow(watermark, maxNodes);
+}
+
+/** Checks the oldest key against the watermark */
+template <typename ElemType, typename Balance>
+bool SlidingWindow<ElemType, Balance>::expirePending() const {
+	return hasWatermark && !window.empty() && window.min() < watermark;
+}
+
+/** Returns the smallest key */
+template <typename ElemType, typename Balance>
+const ElemType& SlidingWindow<ElemType, Balance>::oldest() const {
+	if (window.empty()) throw std::out_of_range("The window is empty.");
+	return window.min();
+}
+
+/** Returns the largest key */
+template <typename ElemType, typename Balance>
+const ElemType& SlidingWindow<ElemType, Balance>::newest() const {
+	if (window.empty()) throw std::out_of_range("The window is empty.");
+	return window.max();
+}
+
+/** Returns the number of times a key is in the window
+ * @value Key being searched for */
+template <typename ElemType, typename Balance>
+std::size_t SlidingWindow<ElemType, Balance>::count(const ElemType& value) const {
+	return window.count(value);
+}
+
+/** Checks if a key is in the window
+ * @value The key to be checked */
+template <typename ElemType, typename Balance>
+bool SlidingWindow<ElemType, Balance>::contains(const ElemType& value) const {
+	return window.contains(value);
+}
+
+/** Returns number of keys in the window */
+template <typename ElemType, typename Balance>
+int SlidingWindow<ElemType, Balance>::size() const {
+	return window.size();
+}
+
+/** Returns if the window is empty */
+template <typename ElemType, typename Balance>
+bool SlidingWindow<ElemType, Balance>::empty() const {
+	return window.empty();
+}
+
+/** Returns the late count */
+template <typename ElemType, typename Balance>
+std::size_t SlidingWindow<ElemType, Balance>::late() const {
+	return numLate;
+}
+
+/** Returns the tree */
+template <typename ElemType, typename Balance>
+const RedBlackTree<ElemType, Balance>& SlidingWindow<ElemType, Balance>::tree() const {
+	return window;
+}
+
+#endif // SLIDINGWINDOW_H
@@ -0,0 +1,349 @@
+#ifndef SMALLREDBLACKTREE_H
+#define SMALLREDBLACKTREE_H
+
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include "RedBlackTree.h"
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * RedBlackTree for the common case of a handful of values. Up to Inline distinct
+ * values are kept in a sorted array inside the object with their counts, so a
+ * small tree costs no allocations at all.
+ *
+ * Inserting a new distinct value into a full array promotes the tree: the values
+ * move into a RedBlackTree allocated on the heap, and every operation forwards to
+ * it from then on. Once removes bring the size down to Inline / 2 elements, the
+ * values move back into the array. The gap between the two thresholds keeps a tree
+ * hovering around Inline values from moving back and forth on every operation.
+ *
+ * The array is searched by counting the values smaller than the one looked for,
+ * a loop without branches that the compiler can vectorize for arithmetic types.
+ *
+ */
+
+template <typename ElemType, std::size_t Inline = 16, typename Balance = RedBlackBalance>
+class SmallRedBlackTree {
+friend class RedBlackTreeTest;
+public:
+    /** Constructor */
+    SmallRedBlackTree();
+
+    /** Copy Constructor */
+    SmallRedBlackTree(const SmallRedBlackTree &other);
+
+    /** Assignment Operator. Leaves the tree as it was if copying throws. */
+    SmallRedBlackTree& operator= (const SmallRedBlackTree &other);
+
+    /** Destructor */
+    ~SmallRedBlackTree();
+
+    /** Inserts an element */
+    void insert(const ElemType& value);
+
+    /** Deletes one copy of value. Throws std::invalid_argument if it is not in the tree */
+    void remove(const ElemType& value);
+
+    /** Checks if an element is in the tree */
+    bool contains(const ElemType& value) const;
+
+    /** Returns the number of times an element is in the tree. */
+    std::size_t count(const ElemType& value) const;
+
+    /** Returns the smallest value. Throws std::out_of_range if the tree is empty */
+    const ElemType& min() const;
+
+    /** Returns the largest value. Throws std::out_of_range if the tree is empty */
+    const ElemType& max() const;
+
+    /** Returns the number of elements in the tree */
+    int size() const;
+
+    /** Returns if the tree is empty or not */
+    bool empty() const;
+
+    /** Clears the tree, going back to the inline array */
+    void clear();
+
+    /** Returns true while the values live in a heap allocated RedBlackTree */
+    bool promoted() const;
+
+    /** Returns the bytes held, including the promoted tree as RedBlackTree::memoryUsage()
+     * counts it */
+    std::size_t memoryBytes() const;
+
+    /** Calls visit(value, count) for every distinct value in order */
+    template <typename Visitor>
+    void forEach(Visitor visit) const;
+
+private:
+    typedef RedBlackTree<ElemType, Balance> Tree;
+
+    static_assert(Inline >= 2 && Inline < 256, "Inline must be in [2, 255]");
+
+    ElemType values[Inline]; // Sorted. Unused while promoted
+    std::size_t counts[Inline]; // For any duplicates
+    unsigned char used; // Number of values in the array
+    int numElems; // Array elements, counting duplicates
+    Tree* tree; // NULL => Values are in the array
+
+    /** Returns the position of the first value in the array that is not less than value */
+    std::size_t lowerBound(const ElemType& value) const;
+
+    /** Moves the array and a new value into a new RedBlackTree. Leaves the array as it
+     * was if that throws. */
+    void promote(const ElemType& value, const std::size_t pos);
+
+    /** Moves the values of the RedBlackTree back into the array and frees it */
+    void demote();
+
+    /** Exchanges the contents of two trees */
+    void swap(SmallRedBlackTree& other);
+
+    /** Checks that the array is sorted and that its counts sum to its size */
+    bool verifyArray() const;
+};
+
+/** Implementation details */
+
+/** Constructor */
+template <typename ElemType, std::size_t Inline, typename Balance>
+SmallRedBlackTree<ElemType, Inline, Balance>::SmallRedBlackTree():
+	used(0),
+	numElems(0),
+	tree(NULL)
+{}
+
+/** Copy Constructor */
+template <typename ElemType, std::size_t Inline, typename Balance>
+SmallRedBlackTree<ElemType, Inline, Balance>::SmallRedBlackTree(const SmallRedBlackTree &other):
+	used(other.used),
+	numElems(other.numElems),
+	tree(NULL)
+{
+	for (std::size_t i = 0; i < used; i++) {
+		values[i] = other.values[i];
+		counts[i] = other.counts[i];
+	}
+	if (other.tree != NULL) tree = new Tree(*other.tree); // Last, so nothing can throw after it
+}
+
+/** Assignment Operator */
+template <typename ElemType, std::size_t Inline, typename Balance>
+SmallRedBlackTree<ElemType, Inline, Balance>&
+SmallRedBlackTree<ElemType, Inline, Balance>::operator= (const SmallRedBlackTree &other) {
+	if (this != &other) {
+		SmallRedBlackTree copy(other);
+		swap(copy);
+	}
+	return *this;
+}
+
+/** Destructor */
+template <typename ElemType, std::size_t Inline, typename Balance>
+SmallRedBlackTree<ElemType, Inline, Balance>::~SmallRedBlackTree() {
+	delete tree;
+}
+
+/** Inserts a value into the array, promoting first if it is full
+ * @value The value to insert */
+template <typename ElemType, std::size_t Inline, typename Balance>
+void SmallRedBlackTree<ElemType, Inline, Balance>::insert(const ElemType& value) {
+	if (tree != NULL) {
+		tree->insert(value);
+		return;
+	}
+	std::size_t pos = lowerBound(value);
+	if (pos < used && values[pos] == value) { // Duplicate insert
+		counts[pos]++;
+		numElems++;
+		return;
+	}
+	if (used == Inline) {
+		promote(value, pos);
+		return;
+	}
+	for (std::size_t i = used; i > pos; i--) { // Shift up to make room
+		values[i] = values[i-1];
+		counts[i] = counts[i-1];
+	}
+	values[pos] = value;
+	counts[pos] = 1;
+	used++;
+	numElems++;
+}
+
+/** Removes one copy of a value, demoting once the tree is down to Inline / 2 elements
+ * @value Value being removed */
+template <typename ElemType, std::size_t Inline, typename Balance>
+void SmallRedBlackTree<ElemType, Inline, Balance>::remove(const ElemType& value) {
+	if (tree != NULL) {
+		tree->remove(value);
+		if (tree->size() <= static_cast<int>(Inline / 2)) demote();
+		return;
+	}
+	std::size_t pos = lowerBound(value);
+	if (pos == used || !(values[pos] == value)) // Error handle
+		throw std::invalid_argument("That value is not in the tree.");
+	numElems--;
+	if (--counts[pos] != 0) return;
+	used--;
+	for (std::size_t i = pos; i < used; i++) { // Shift down to close the gap
+		values[i] = values[i+1];
+		counts[i] = counts[i+1];
+	}
+}
+
+/** Checks if a value is in the tree
+ * @value The value to be checked */
+template <typename ElemType, std::size_t Inline, typename Balance>
+bool SmallRedBlackTree<ElemType, Inline, Balance>::contains(const ElemType& value) const {
+	return count(value) != 0;
+}
+
+/** Returns the number of times a value is in the tree
+ * @value Value being searched for */
+template <typename ElemType, std::size_t Inline, typename Balance>
+std::size_t SmallRedBlackTree<ElemType, Inline, Balance>::count(const ElemType& value) const {
+	if (tree != NULL) return tree->count(value);
+	std::size_t pos = lowerBound(value);
+	if (pos == used || !(values[pos] == value)) return 0;
+	return counts[pos];
+}
+
+/** Returns the smallest value */
+template <typename ElemType, std::size_t Inline, typename Balance>
+const ElemType& SmallRedBlackTree<ElemType, Inline, Balance>::min() const {
+	if (tree != NULL) return tree->min();
+	if (used == 0) throw std::out_of_range("The tree is empty.");
+	return values[0];
+}
+
+/** Returns the largest value */
+template <typename ElemType, std::size_t Inline, typename Balance>
+const ElemType& SmallRedBlackTree<ElemType, Inline, Balance>::max() const {
+	if (tree != NULL) return tree->max();
+	if (used == 0) throw std::out_of_range("The tree is empty.");
+	return values[used-1];
+}
+
+/** Returns number of elements in tree */
+template <typename ElemType, std::size_t Inline, typename Balance>
+int SmallRedBlackTree<ElemType, Inline, Balance>::size() const {
+	return (tree != NULL) ? tree->size() : numElems;
+}
+
+/** Returns if tree is empty */
+template <typename ElemType, std::size_t Inline, typename Balance>
+bool SmallRedBlackTree<ElemType, Inline, Balance>::empty() const {
+	return size() == 0;
+}
+
+/** Clears the tree */
+template <typename ElemType, std::size_t Inline, typename Balance>
+void SmallRedBlackTree<ElemType, Inline, Balance>::clear() {
+	delete tree;
+	tree = NULL;
+	used = 0;
+	numElems = 0;
+}
+
+/** Returns whether the tree is promoted */
+template <typename ElemType, std::size_t Inline, typename Balance>
+bool SmallRedBlackTree<ElemType, Inline, Balance>::promoted() const {
+	return tree != NULL;
+}
+
+/** Returns the object size, plus the promoted tree if any */
+template <typename ElemType, std::size_t Inline, typename Balance>
+std::size_t SmallRedBlackTree<ElemType, Inline, Balance>::memoryBytes() const {
+	if (tree == NULL) return sizeof(*this);
+	return sizeof(*this) + tree->memoryUsage().totalBytes;
+}
+
+/** Visits all values in order
+ * @visit Called with each value and its count */
+template <typename ElemType, std::size_t Inline, typename Balance>
+template <typename Visitor>
+void SmallRedBlackTree<ElemType, Inline, Balance>::forEach(Visitor visit) const {
+	if (tree != NULL) tree->forEach(visit);
+	else for (std::size_t i = 0; i < used; i++) visit(values[i], counts[i]);
+}
+
+/** Counts the smaller values. Always scans the whole array, which costs less than
+ * the mispredicted branch of an early exit at these sizes.
+ * @value Value being searched for */
+template <typename ElemType, std::size_t Inline, typename Balance>
+std::size_t SmallRedBlackTree<ElemType, Inline, Balance>::lowerBound(const ElemType& value) const {
+	std::size_t pos = 0;
+	for (std::size_t i = 0; i < used; i++) pos += (values[i] < value);
+	return pos;
+}
+
+/** Promotes the tree. The sorted array is linked in as a balanced tree in one pass,
+ * with one batch operation per distinct value carrying its count.
+ * @value The value being inserted, which is not in the array
+ * @pos Where value would go in the array */
+template <typename ElemType, std::size_t Inline, typename Balance>
+void SmallRedBlackTree<ElemType, Inline, Balance>::promote(const ElemType& value, const std::size_t pos) {
+	std::vector<typename Tree::BatchOp> ops;
+	ops.reserve(used + 1);
+	const typename Tree::BatchOp added = {value, true, 1};
+	for (std::size_t i = 0; i < used; i++) {
+		if (i == pos) ops.push_back(added);
+		typename Tree::BatchOp op = {values[i], true, counts[i]};
+		ops.push_back(op);
+	}
+	if (pos == used) ops.push_back(added);
+	std::unique_ptr<Tree> built(new Tree); // Owned here until the batch is in
+	built->applyBatch(ops);
+	tree = built.release();
+	used = 0;
+	numElems = 0;
+}
+
+/** Demotes the tree. At most Inline / 2 elements are left, so the values fit. */
+template <typename ElemType, std::size_t Inline, typename Balance>
+void SmallRedBlackTree<ElemType, Inline, Balance>::demote() {
+	used = 0;
+	numElems = tree->size();
+	tree->forEach([this](const ElemType& value, std::size_t count) {
+		values[used] = value;
+		counts[used] = count;
+		used++;
+	});
+	delete tree;
+	tree = NULL;
+}
+
+/** Swaps the arrays element by element and the tree pointers
+ * @other The tree to swap with */
+template <typename ElemType, std::size_t Inline, typename Balance>
+void SmallRedBlackTree<ElemType, Inline, Balance>::swap(SmallRedBlackTree& other) {
+	using std::swap;
+	const std::size_t longer = (used > other.used) ? used : other.used;
+	for (std::size_t i = 0; i < longer; i++) {
+		swap(values[i], other.values[i]);
+		swap(counts[i], other.counts[i]);
+	}
+	swap(used, other.used);
+	swap(numElems, other.numElems);
+	swap(tree, other.tree);
+}
+
+/** Verifies the array */
+template <typename ElemType, std::size_t Inline, typename Balance>
+bool SmallRedBlackTree<ElemType, Inline, Balance>::verifyArray() const {
+	if (tree != NULL) return used == 0 && numElems == 0 && tree->size() > static_cast<int>(Inline / 2);
+	std::size_t sum = 0;
+	for (std::size_t i = 0; i < used; i++) {
+		if (counts[i] == 0 || (i > 0 && !(values[i-1] < values[i]))) return false;
+		sum += counts[i];
+	}
+	return sum == static_cast<std::size_t>(numElems);
+}
+
+#endif // SMALLREDBLACKTREE_H
@@ -0,0 +1,165 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Fixed-size pool of worker threads used by RedBlackTree to split work by subtree.
+ *
+ * Work is submitted as a loop over task indices with parallelFor(). The calling
+ * thread takes part in the loop as well, so a parallelFor() issued from inside a
+ * task cannot deadlock waiting for workers that are all busy.
+ *
+ */
+
+class ThreadPool {
+public:
+    /** Starts numThreads workers. 0 => one per hardware thread */
+    explicit ThreadPool(unsigned numThreads = 0);
+
+    /** Finishes queued work and joins the workers */
+    ~ThreadPool();
+
+    /** Returns the number of threads that run tasks, counting the caller */
+    unsigned size() const;
+
+    /** Runs task(0) ... task(numTasks-1) across the pool and returns when all have
+     * finished. The first exception thrown by a task is rethrown here. */
+    void parallelFor(const std::size_t numTasks, const std::function<void(std::size_t)>& task);
+
+    /** Returns a pool shared by all trees, with one thread per hardware thread. It is
+     * never destroyed, so it stays usable while static objects are torn down. */
+    static ThreadPool& shared();
+
+private:
+    /** One parallelFor() call. Threads claim indices until none are left. */
+    struct Batch {
+	    const std::function<void(std::size_t)>* task;
+	    std::size_t numTasks;
+	    std::atomic<std::size_t> next;
+	    std::size_t finished; // Guarded by lock
+	    std::exception_ptr error; // Guarded by lock
+	    std::mutex lock;
+	    std::condition_variable done;
+    };
+
+    std::vector<std::thread> workers;
+    std::deque<std::shared_ptr<Batch> > queue;
+    std::mutex queueLock;
+    std::condition_variable queueReady;
+    bool stopping;
+
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator= (const ThreadPool&);
+
+    /** Loop run by every worker thread */
+    void workerLoop();
+
+    /** Claims and runs tasks of a batch until it has none left */
+    static void runBatch(Batch& batch);
+};
+
+/** Implementation details */
+
+/** Constructor
+ * @numThreads Total threads, counting callers of parallelFor(). 0 => hardware threads */
+inline ThreadPool::ThreadPool(unsigned numThreads):
+	stopping(false)
+{
+	if (numThreads == 0) numThreads = std::thread::hardware_concurrency();
+	if (numThreads == 0) numThreads = 1; // Unknown hardware
+	for (unsigned i = 1; i < numThreads; i++) // The caller is the remaining thread
+		workers.push_back(std::thread(&ThreadPool::workerLoop, this));
+}
+
+/** Destructor */
+inline ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(queueLock);
+		stopping = true;
+	}
+	queueReady.notify_all();
+	for (std::size_t i = 0; i < workers.size(); i++) workers[i].join();
+}
+
+/** Returns number of threads running tasks */
+inline unsigned ThreadPool::size() const {
+	return static_cast<unsigned>(workers.size()) + 1;
+}
+
+/** Runs numTasks tasks and waits for them
+ * @numTasks The number of task indices
+ * @task Called once with every index */
+inline void ThreadPool::parallelFor(const std::size_t numTasks, const std::function<void(std::size_t)>& task) {
+	if (numTasks == 0) return;
+	std::shared_ptr<Batch> batch(new Batch);
+	batch->task = &task;
+	batch->numTasks = numTasks;
+	batch->next = 0;
+	batch->finished = 0;
+	if (!workers.empty() && numTasks > 1) {
+		std::lock_guard<std::mutex> guard(queueLock);
+		queue.push_back(batch);
+	}
+	queueReady.notify_all();
+	runBatch(*batch); // Help out instead of idling
+	std::unique_lock<std::mutex> guard(batch->lock);
+	while (batch->finished != numTasks) batch->done.wait(guard);
+	if (batch->error) std::rethrow_exception(batch->error);
+}
+
+/** Returns the shared pool. Created on first use and never destroyed, so trees
+ * destroyed during static destruction can still use it and exit does not wait
+ * on joining its workers. */
+inline ThreadPool& ThreadPool::shared() {
+	static ThreadPool* const pool = new ThreadPool();
+	return *pool;
+}
+
+/** Waits for batches and helps run them until the pool stops */
+inline void ThreadPool::workerLoop() {
+	while (true) {
+		std::shared_ptr<Batch> batch;
+		{
+			std::unique_lock<std::mutex> guard(queueLock);
+			while (!stopping && queue.empty()) queueReady.wait(guard);
+			if (queue.empty()) return; // Stopping with nothing left to do
+			batch = queue.front();
+			if (batch->next.load() >= batch->numTasks) { // Fully claimed, drop it
+				queue.pop_front();
+				continue;
+			}
+		}
+		runBatch(*batch);
+	}
+}
+
+/** Runs unclaimed tasks of a batch
+ * @batch The batch to work on */
+inline void ThreadPool::runBatch(Batch& batch) {
+	while (true) {
+		const std::size_t index = batch.next.fetch_add(1);
+		if (index >= batch.numTasks) return;
+		std::exception_ptr error;
+		try {
+			(*batch.task)(index);
+		} catch (...) {
+			error = std::current_exception();
+		}
+		std::lock_guard<std::mutex> guard(batch.lock);
+		if (error && !batch.error) batch.error = error;
+		if (++batch.finished == batch.numTasks) batch.done.notify_all();
+	}
+}
+
+#endif // THREADPOOL_H
@@ -0,0 +1,187 @@
+#ifndef TRACERECORDER_H
+#define TRACERECORDER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+
+/** Copyright (c) 2014 Evan Liu
+ *
+ * Compact binary log of the operations made on a RedBlackTree, so an access
+ * pattern can be captured where it happens and replayed elsewhere (see replay.cpp).
+ *
+ * A trace is the magic bytes "RBTRACE1" followed by one record per operation:
+ * the operation as one byte, then the change in key and the nanoseconds since
+ * the previous record, both as varints. Keys are zigzag encoded so nearby keys
+ * of either sign take one or two bytes.
+ *
+ */
+
+/** Operations a trace can hold */
+enum TraceOp {
+    kTraceInsert = 0,
+    kTraceRemove = 1,
+    kTraceContains = 2,
+    kTraceCount = 3
+};
+
+/** One decoded record */
+struct TraceEvent {
+    TraceOp op;
+    std::int64_t key;
+    std::uint64_t nanos; // Since the recorder was made
+};
+
+class TraceRecorder {
+public:
+    /** Writes the trace header to out. out must outlive the recorder. */
+    explicit TraceRecorder(std::ostream& out);
+
+    /** Appends one record. Never throws, since removals that must not throw record
+     * too. A stream that throws on errors is left in its failed state instead. */
+    void record(const TraceOp op, const std::int64_t key) noexcept;
+
+    /** Returns the number of records written */
+    std::size_t records() const;
+
+    /** Flushes the underlying stream */
+    void flush();
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::ostream& out;
+    Clock::time_point start;
+    std::uint64_t lastNanos;
+    std::int64_t lastKey;
+    std::size_t numRecords;
+
+    TraceRecorder(const TraceRecorder&);
+    TraceRecorder& operator= (const TraceRecorder&);
+
+    /** Writes an unsigned integer 7 bits at a time, low bits first */
+    void writeVarint(std::uint64_t value);
+};
+
+class TraceReader {
+public:
+    /** Reads the trace header from in. Throws std::runtime_error if it is missing. */
+    explicit TraceReader(std::istream& in);
+
+    /** Decodes the next record into event. Returns false at the end of the trace.
+     * Throws std::runtime_error on a truncated or corrupt record. */
+    bool next(TraceEvent& event);
+
+private:
+    std::istream& in;
+    std::uint64_t lastNanos;
+    std::int64_t lastKey;
+
+    TraceReader(const TraceReader&);
+    TraceReader& operator= (const TraceReader&);
+
+    /** Reads a varint written by TraceRecorder */
+    std::uint64_t readVarint();
+};
+
+/** Implementation details */
+
+static const char kTraceMagic[8] = {'R', 'B', 'T', 'R', 'A', 'C', 'E', '1'};
+
+/** Constructor
+ * @out Stream the trace is written to */
+inline TraceRecorder::TraceRecorder(std::ostream& out):
+	out(out),
+	start(Clock::now()),
+	lastNanos(0),
+	lastKey(0),
+	numRecords(0)
+{
+	out.write(kTraceMagic, sizeof(kTraceMagic));
+}
+
+/** Appends a record
+ * @op The operation
+ * @key The value it was made with */
+inline void TraceRecorder::record(const TraceOp op, const std::int64_t key) noexcept {
+	std::uint64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	std::uint64_t delta = static_cast<std::uint64_t>(key) - static_cast<std::uint64_t>(lastKey);
+	try {
+		out.put(static_cast<char>(op));
+		writeVarint((delta << 1) ^ (0 - (delta >> 63))); // Zigzag
+		writeVarint(nanos - lastNanos);
+	} catch (...) { // The stream keeps its failed state for the owner to see
+		return;
+	}
+	lastKey = key;
+	lastNanos = nanos;
+	numRecords++;
+}
+
+/** Returns the record count */
+inline std::size_t TraceRecorder::records() const {
+	return numRecords;
+}
+
+/** Flushes the stream */
+inline void TraceRecorder::flush() {
+	out.flush();
+}
+
+/** Writes a varint
+ * @value The integer */
+inline void TraceRecorder::writeVarint(std::uint64_t value) {
+	while (value >= 0x80) {
+		out.put(static_cast<char>(value | 0x80));
+		value >>= 7;
+	}
+	out.put(static_cast<char>(value));
+}
+
+/** Constructor
+ * @in Stream the trace is read from */
+inline TraceReader::TraceReader(std::istream& in):
+	in(in),
+	lastNanos(0),
+	lastKey(0)
+{
+	char magic[sizeof(kTraceMagic)];
+	in.read(magic, sizeof(magic));
+	if (!in || !std::equal(magic, magic + sizeof(magic), kTraceMagic))
+		throw std::runtime_error("Not a trace file.");
+}
+
+/** Decodes a record
+ * @event Filled in with the record */
+inline bool TraceReader::next(TraceEvent& event) {
+	int op = in.get();
+	if (op == std::char_traits<char>::eof()) return false;
+	if (op > kTraceCount) throw std::runtime_error("Corrupt trace record.");
+	std::uint64_t zigzag = readVarint();
+	std::uint64_t delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+	lastKey = static_cast<std::int64_t>(static_cast<std::uint64_t>(lastKey) + delta);
+	lastNanos += readVarint();
+	event.op = static_cast<TraceOp>(op);
+	event.key = lastKey;
+	event.nanos = lastNanos;
+	return true;
+}
+
+/** Reads a varint. Throws if the trace ends inside it or it runs past 64 bits. */
+inline std::uint64_t TraceReader::readVarint() {
+	std::uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = in.get();
+		if (byte == std::char_traits<char>::eof()) throw std::runtime_error("Truncated trace record.");
+		value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0) return value;
+	}
+	throw std::runtime_error("Corrupt trace record.");
+}
+
+#endif // TRACERECORDER_H
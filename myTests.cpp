@@ -1,13 +1,47 @@
 #include "RedBlackTree.h"
+#include "BlockedRedBlackTree.h"
+#include "TraceRecorder.h"
+#include "ChangeFeed.h"
+#include "FixedRedBlackTree.h"
+#include "SmallRedBlackTree.h"
+#include "SlidingWindow.h"
 #include "gtest/gtest.h"
 #include <iostream>
 #include <cstdlib>
 #include <set>
 #include <map>
 #include <algorithm>
+#include <sstream>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <limits>
+#include <new>
+#include <vector>
 
 using namespace std;
 
+static thread_local int allocationsLeft = -1; // Allocations on this thread before one fails. -1 => Never
+static thread_local size_t bytesAllocated = 0; // Total asked for on this thread
+
+void* operator new(size_t size) {
+	if (allocationsLeft == 0) throw bad_alloc();
+	if (allocationsLeft > 0) allocationsLeft--;
+	bytesAllocated += size;
+	void* memory = malloc(size == 0 ? 1 : size);
+	if (memory == NULL) throw bad_alloc();
+	return memory;
+}
+
+void operator delete(void* memory) noexcept {
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+	free(memory);
+}
+
 class RedBlackTreeTest: public ::testing::Test {
 	protected:
 		RedBlackTree<int> myTree;
@@ -21,6 +55,28 @@ class RedBlackTreeTest: public ::testing::Test {
 		void ComprehensiveDeleteTest();
 		void ComprehensiveTest();
 		void HighDensityDeleteTest();
+		void BatchTest(int num_initial, int batch_size, int modulo);
+		void EmptyBatchTest();
+		void ParallelCopyTest();
+		void ParallelTraversalTest();
+		void NodeHandleTest();
+		void MergeTest();
+		void LazyRemoveTest();
+		void DeferredFreeTest();
+		void RangeTest(int lo, int hi);
+		void RangeTombstoneTest();
+		void CompactTest();
+		void StringKeyTest();
+		void PriorityTest(bool lazy);
+		void ShapeTest();
+		template <size_t N> void FixedTreeTest();
+		void SmallTreeTest();
+		void HashIndexTest();
+		void TryRemoveTest(bool lazy);
+		template <typename Balance> void SlidingWindowTest(size_t maxFrees);
+		template <typename Balance> void BalancePolicyTest();
+		template <typename Balance> void MerkleTest();
+		template <size_t BlockSize, typename Balance> void BlockedTreeTest();
 
 };
 
@@ -358,6 +414,1811 @@ TEST_F(RedBlackTreeTest, ComprehensiveTest) {
 	ComprehensiveTest();
 }
 
+static bool batchOpLess(const RedBlackTree<int>::BatchOp& left, const RedBlackTree<int>::BatchOp& right) {
+	return left.value < right.value;
+}
+
+void RedBlackTreeTest::BatchTest(int num_initial, int batch_size, int modulo) {
+	cout << "Inserting " << num_initial << " random integers [0, " << modulo-1 << "] into tree.\n";
+	map<int, int> in_tree;
+	for (int i = 0; i < num_initial; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+	}
+
+	cout << "Applying batches of " << batch_size << " mixed inserts and removes.\n";
+	for (int j = 0; j < 5; j++) {
+		vector<RedBlackTree<int>::BatchOp> ops;
+		for (int i = 0; i < batch_size; i++) {
+			RedBlackTree<int>::BatchOp op = {rand()%modulo, rand()%2 == 0};
+			ops.push_back(op);
+		}
+		size_t misses = 0;
+		vector<RedBlackTree<int>::BatchOp> sorted = ops;
+		stable_sort(sorted.begin(), sorted.end(), batchOpLess); // Reference, in stable key order
+		for (size_t i = 0; i < sorted.size(); i++) {
+			if (sorted[i].insert) in_tree[sorted[i].value]++;
+			else if (in_tree[sorted[i].value] == 0) misses++;
+			else in_tree[sorted[i].value]--;
+		}
+		int expected_size = 0;
+		for (map<int, int>::iterator it = in_tree.begin(); it != in_tree.end(); ++it) expected_size += it->second;
+
+		EXPECT_EQ(misses, myTree.applyBatch(ops));
+		EXPECT_TRUE(myTree.verifyProperties());
+		EXPECT_EQ(expected_size, myTree.size());
+		for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], myTree.count(i));
+	}
+}
+
+TEST_F(RedBlackTreeTest, SmallBatchTest) {
+	BatchTest(10000, 100, 30000);
+}
+
+TEST_F(RedBlackTreeTest, LargeBatchTest) {
+	BatchTest(1000, 5000, 3000);
+}
+
+void RedBlackTreeTest::EmptyBatchTest() {
+	cout << "Applying a batch to an empty tree and a batch that removes everything.\n";
+	vector<RedBlackTree<int>::BatchOp> ops;
+	for (int i = 0; i < 100; i++) {
+		RedBlackTree<int>::BatchOp op = {i%10, true};
+		ops.push_back(op);
+	}
+	EXPECT_EQ(0u, myTree.applyBatch(ops));
+	EXPECT_EQ(100, myTree.size());
+	EXPECT_TRUE(myTree.verifyProperties());
+	for (size_t i = 0; i < ops.size(); i++) ops[i].insert = false;
+	RedBlackTree<int>::BatchOp extra = {3, false};
+	ops.push_back(extra);
+	EXPECT_EQ(1u, myTree.applyBatch(ops));
+	EXPECT_TRUE(myTree.empty());
+	EXPECT_TRUE(myTree.verifyProperties());
+
+	cout << "Applying operations that carry many copies each.\n";
+	vector<RedBlackTree<int>::BatchOp> counted;
+	counted.push_back(RedBlackTree<int>::BatchOp{7, true, 1000000});
+	counted.push_back(RedBlackTree<int>::BatchOp{7, false, 10});
+	counted.push_back(RedBlackTree<int>::BatchOp{2, false, 4});
+	counted.push_back(RedBlackTree<int>::BatchOp{2, true, 3});
+	EXPECT_EQ(4u, myTree.applyBatch(counted));
+	EXPECT_EQ(999990u, myTree.count(7));
+	EXPECT_EQ(3u, myTree.count(2));
+	EXPECT_TRUE(myTree.verifyProperties());
+	counted.clear();
+	counted.push_back(RedBlackTree<int>::BatchOp{2, false, 5});
+	EXPECT_EQ(2u, myTree.applyBatch(counted)); // Searched for instead of rebuilt
+	EXPECT_EQ(0u, myTree.count(2));
+	EXPECT_EQ(999990, myTree.size());
+	EXPECT_TRUE(myTree.verifyProperties());
+
+	cout << "Rebuilding and compacting a few nodes holding many copies, which allocates per node.\n";
+	myTree.setLazyRemove(true);
+	for (int i = 5; i < 10; i++) myTree.insert(i);
+	myTree.remove(6);
+	myTree.remove(8);
+	EXPECT_EQ(2u, myTree.tombstones());
+	size_t before = bytesAllocated;
+	myTree.dropTombstones();
+	myTree.compact();
+	EXPECT_LT(bytesAllocated - before, 4096u);
+	EXPECT_EQ(0u, myTree.tombstones());
+	EXPECT_EQ(999993, myTree.size());
+	EXPECT_TRUE(myTree.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, EmptyBatchTest) {
+	EmptyBatchTest();
+}
+
+void RedBlackTreeTest::ParallelCopyTest() {
+	int num_insert = 200000;
+	int modulo = 150000;
+	ThreadPool pool(4);
+	myTree.setThreadPool(&pool);
+
+	cout << "Inserting " << num_insert << " random integers [0, " << modulo-1 << "] into tree.\n";
+	map<int, int> in_tree;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+	}
+
+	cout << "Copying the tree across 4 threads and verifying the copy.\n";
+	RedBlackTree<int>* copy = new RedBlackTree<int>(myTree);
+	EXPECT_TRUE(copy->verifyProperties());
+	EXPECT_EQ(num_insert, copy->size());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], copy->count(i));
+
+	cout << "Assigning over a non-empty tree and verifying the result.\n";
+	RedBlackTree<int> assigned;
+	assigned.setThreadPool(&pool);
+	for (int i = 0; i < num_insert; i++) assigned.insert(rand()%modulo);
+	assigned = *copy;
+	EXPECT_TRUE(assigned.verifyProperties());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], assigned.count(i));
+
+	cout << "Destroying and clearing the copies in parallel.\n";
+	delete copy;
+	assigned.clear();
+	EXPECT_TRUE(assigned.empty());
+	EXPECT_TRUE(assigned.verifyProperties());
+	EXPECT_EQ(num_insert, myTree.size());
+	myTree.clear();
+	myTree.setThreadPool(NULL);
+}
+
+TEST_F(RedBlackTreeTest, ParallelCopyTest) {
+	ParallelCopyTest();
+}
+
+void RedBlackTreeTest::ParallelTraversalTest() {
+	int num_insert = 200000;
+	int modulo = 150000;
+	ThreadPool pool(4);
+	myTree.setThreadPool(&pool);
+	myTree.setLazyRemove(true, 0.5);
+
+	cout << "Inserting " << num_insert << " random integers [0, " << modulo-1
+	     << "] into tree and lazily removing a tenth of them.\n";
+	map<int, int> in_tree;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+	}
+	for (int i = 0; i < num_insert / 10; i++) {
+		int next = rand()%modulo;
+		if (in_tree[next] == 0) continue;
+		in_tree[next]--;
+		myTree.remove(next);
+	}
+	long long sum = 0;
+	size_t distinct = 0;
+	for (map<int, int>::iterator it = in_tree.begin(); it != in_tree.end(); ++it) {
+		sum += (long long)it->first * it->second;
+		if (it->second != 0) distinct++;
+	}
+	EXPECT_LT(0u, myTree.tombstones());
+
+	cout << "Verifying the pieces cover every node once, in order, with 16 whole subtrees.\n";
+	vector<RedBlackTree<int>::Piece> pieces;
+	myTree.splitPieces(pieces);
+	vector<int> inOrder;
+	size_t numWhole = 0;
+	for (size_t i = 0; i < pieces.size(); i++) {
+		auto collect = [&inOrder](RedBlackTree<int>::Node* node) { inOrder.push_back(node->value); };
+		RedBlackTree<int>::visitPiece(pieces[i], collect);
+		if (pieces[i].whole) numWhole++;
+	}
+	EXPECT_EQ(16u, numWhole);
+	EXPECT_EQ(distinct + myTree.tombstones(), inOrder.size());
+	EXPECT_TRUE(is_sorted(inOrder.begin(), inOrder.end()));
+	EXPECT_TRUE(adjacent_find(inOrder.begin(), inOrder.end()) == inOrder.end());
+
+	cout << "Visiting every value across 4 threads.\n";
+	mutex lock;
+	map<int, int> visited;
+	myTree.parallelForEach([&](int value, size_t count) {
+		lock_guard<mutex> guard(lock);
+		visited[value] += count;
+	});
+	for (map<int, int>::iterator it = in_tree.begin(); it != in_tree.end(); ++it)
+		if (it->second == 0) EXPECT_EQ(0u, visited.count(it->first));
+		else EXPECT_EQ(it->second, visited[it->first]);
+
+	cout << "Reducing to a sum, and to an order check that only holds if partial results keep their order.\n";
+	EXPECT_EQ(sum, myTree.parallelReduce(0LL, [](int value, size_t count) { return (long long)value * count; },
+					   [](long long left, long long right) { return left + right; }));
+	typedef pair<int, int> Span; // First and last value seen. (1, 0) => None
+	Span span = myTree.parallelReduce(Span(1, 0), [](int value, size_t) { return Span(value, value); },
+					  [](const Span& left, const Span& right) {
+		if (left.first > left.second) return right;
+		if (right.first > right.second) return left;
+		return (left.second < right.first) ? Span(left.first, right.second) : Span(1, -1);
+	});
+	EXPECT_EQ(myTree.min(), span.first);
+	EXPECT_EQ(myTree.max(), span.second);
+
+	cout << "Transforming with value * 2 + 1 and verifying the shape and contents.\n";
+	myTree.setHashIndex(true);
+	RedBlackTree<int> mapped = myTree.parallelTransform([](int value) { return value * 2 + 1; });
+	EXPECT_TRUE(mapped.verifyProperties());
+	EXPECT_EQ(myTree.size(), mapped.size());
+	EXPECT_EQ(myTree.height(), mapped.height());
+	EXPECT_EQ(myTree.tombstones(), mapped.tombstones());
+	for (int i = 0; i < modulo; i++) {
+		EXPECT_EQ(in_tree[i], mapped.count(i * 2 + 1));
+		EXPECT_EQ(0u, mapped.count(i * 2));
+	}
+
+	cout << "Reducing a small tree on the calling thread.\n";
+	RedBlackTree<int> small;
+	EXPECT_EQ(0, small.parallelReduce(0, [](int value, size_t) { return value; }, plus<int>()));
+	for (int i = 1; i <= 100; i++) small.insert(i);
+	EXPECT_EQ(5050, small.parallelReduce(0, [](int value, size_t) { return value; }, plus<int>()));
+	myTree.clear();
+	myTree.setThreadPool(NULL);
+}
+
+TEST_F(RedBlackTreeTest, ParallelTraversalTest) {
+	ParallelTraversalTest();
+}
+
+void RedBlackTreeTest::NodeHandleTest() {
+	int num_insert = 2000;
+	int modulo = 1000;
+	cout << "Inserting " << num_insert << " random integers [0, " << modulo-1 << "] into tree.\n";
+	map<int, int> in_tree;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+	}
+
+	cout << "Extracting every value into a second tree and checking nodes are reused.\n";
+	RedBlackTree<int> other;
+	for (int i = 0; i < modulo; i++) {
+		auto node = myTree.findNode(myTree.root, i);
+		RedBlackTree<int>::node_type handle = myTree.extract(i);
+		EXPECT_EQ(node == NULL, handle.empty());
+		if (handle.empty()) continue;
+		EXPECT_EQ(i, handle.value());
+		EXPECT_EQ(in_tree[i], handle.count());
+		other.insert(move(handle));
+		EXPECT_TRUE(handle.empty());
+		EXPECT_EQ(node, other.findNode(other.root, i));
+		EXPECT_TRUE(myTree.verifyProperties());
+		EXPECT_TRUE(other.verifyProperties());
+	}
+	EXPECT_TRUE(myTree.empty());
+	EXPECT_EQ(num_insert, other.size());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], other.count(i));
+
+	cout << "Changing the value of an extracted node and reinserting onto a duplicate.\n";
+	RedBlackTree<int>::node_type handle = other.extract(other.root->value);
+	int old_value = handle.value();
+	int count = handle.count();
+	handle.value() = modulo;
+	other.insert(modulo);
+	other.insert(move(handle));
+	EXPECT_EQ(0u, other.count(old_value));
+	EXPECT_EQ(count + 1, other.count(modulo));
+	EXPECT_EQ(num_insert + 1, other.size());
+	EXPECT_TRUE(other.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, NodeHandleTest) {
+	NodeHandleTest();
+}
+
+void RedBlackTreeTest::MergeTest() {
+	int num_insert = 5000;
+	int modulo = 3000;
+	cout << "Merging two trees of " << num_insert << " random integers [0, " << modulo-1 << "].\n";
+	map<int, int> in_tree;
+	RedBlackTree<int> other;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+		next = rand()%modulo;
+		in_tree[next]++;
+		other.insert(next);
+	}
+	myTree.merge(other);
+	EXPECT_TRUE(other.empty());
+	EXPECT_TRUE(other.verifyProperties());
+	EXPECT_TRUE(myTree.verifyProperties());
+	EXPECT_EQ(2*num_insert, myTree.size());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], myTree.count(i));
+
+	cout << "Merging into an empty tree and merging a tree with itself.\n";
+	other.merge(myTree);
+	other.merge(other);
+	EXPECT_TRUE(myTree.empty());
+	EXPECT_EQ(2*num_insert, other.size());
+	EXPECT_TRUE(other.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, MergeTest) {
+	MergeTest();
+}
+
+void RedBlackTreeTest::LazyRemoveTest() {
+	int num_insert = 5000;
+	int modulo = 3000;
+	cout << "Inserting " << num_insert << " random integers [0, " << modulo-1
+	     << "] and removing them lazily, checking sizes and counts.\n";
+	myTree.setLazyRemove(true, 0.5);
+	map<int, int> in_tree;
+	vector<int> order;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		order.push_back(next);
+		in_tree[next]++;
+		myTree.insert(next);
+	}
+	random_shuffle(order.begin(), order.end());
+	size_t max_tombstones = 0;
+	for (int i = 0; i < num_insert / 2; i++) {
+		myTree.remove(order.back());
+		in_tree[order.back()]--;
+		order.pop_back();
+		max_tombstones = max(max_tombstones, myTree.tombstones());
+		ASSERT_TRUE(myTree.verifyProperties()) << "Removed " << i << " elements.\n";
+	}
+	EXPECT_GT(max_tombstones, 0u);
+	EXPECT_EQ(num_insert - num_insert / 2, myTree.size());
+	for (int i = 0; i < modulo; i++) {
+		EXPECT_EQ(in_tree[i], myTree.count(i));
+		EXPECT_EQ(in_tree[i] != 0, myTree.contains(i));
+		if (in_tree[i] == 0) {
+			EXPECT_THROW(myTree.remove(i), invalid_argument);
+		}
+	}
+	int visited = 0;
+	myTree.forEach([&](int value, size_t count) {
+		EXPECT_EQ(in_tree[value], count);
+		visited++;
+	});
+	int live = 0;
+	for (int i = 0; i < modulo; i++) live += (in_tree[i] != 0);
+	EXPECT_EQ(live, visited);
+
+	cout << "Reviving tombstones, copying, then purging in bounded steps.\n";
+	for (int i = 0; i < modulo; i += 7) {
+		myTree.insert(i);
+		in_tree[i]++;
+	}
+	RedBlackTree<int> copy(myTree);
+	EXPECT_TRUE(copy.verifyProperties());
+	EXPECT_EQ(myTree.tombstones(), copy.tombstones());
+	while (myTree.tombstones() != 0) {
+		size_t before = myTree.tombstones();
+		size_t removed = myTree.purgeTombstones(64);
+		EXPECT_LE(removed, 64u);
+		EXPECT_EQ(before - removed, myTree.tombstones());
+		ASSERT_TRUE(myTree.verifyProperties());
+	}
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], myTree.count(i));
+
+	cout << "Applying batches and merging with tombstones in the tree, then turning lazy removal off.\n";
+	map<int, int> in_copy;
+	vector<RedBlackTree<int>::BatchOp> ops;
+	for (int i = 0; i < modulo; i += 5) {
+		RedBlackTree<int>::BatchOp op = {i, true};
+		ops.push_back(op);
+	}
+	for (int i = 0; i < modulo; i++) in_copy[i] = copy.count(i) + ((i%5 == 0) ? 1 : 0);
+	copy.applyBatch(ops);
+	EXPECT_TRUE(copy.verifyProperties());
+	EXPECT_EQ(0u, copy.tombstones()); // Large batches rebuild without tombstones
+	for (int i = 0; i < modulo; i += 3) {
+		while (copy.contains(i)) {
+			copy.remove(i);
+			in_copy[i]--;
+		}
+	}
+	EXPECT_GT(copy.tombstones(), 0u);
+	RedBlackTree<int> other;
+	other.merge(copy);
+	EXPECT_EQ(0u, copy.tombstones());
+	EXPECT_EQ(0u, other.tombstones()); // other is not lazy, so it never keeps them
+	EXPECT_TRUE(other.verifyProperties());
+	RedBlackTree<int> lazyCopy;
+	lazyCopy.setLazyRemove(true);
+	for (int i = 0; i < 100; i++) lazyCopy.insert(i);
+	for (int i = 10; i < 20; i++) lazyCopy.remove(i);
+	EXPECT_EQ(10u, lazyCopy.tombstones());
+	RedBlackTree<int> assigned;
+	assigned = lazyCopy;
+	EXPECT_EQ(0u, assigned.tombstones()); // Not lazy either
+	EXPECT_TRUE(assigned.verifyProperties());
+	EXPECT_EQ(90, assigned.size());
+	myTree.merge(other);
+	EXPECT_TRUE(myTree.verifyProperties());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i] + in_copy[i], myTree.count(i));
+	myTree.setLazyRemove(false);
+	EXPECT_EQ(0u, myTree.tombstones());
+	EXPECT_TRUE(myTree.verifyProperties());
+
+	cout << "Checking that tombstones past the limit trigger a rebuild.\n";
+	RedBlackTree<int> limited;
+	limited.setLazyRemove(true, 0.1);
+	for (int i = 0; i < 1000; i++) limited.insert(i);
+	for (int i = 0; i < 500; i++) {
+		limited.remove(250 + i); // Away from the ends, which never keep tombstones
+		ASSERT_LE(limited.tombstones(), 0.1 * (limited.size() + limited.tombstones()));
+	}
+	EXPECT_TRUE(limited.verifyProperties());
+	EXPECT_THROW(limited.setLazyRemove(true, 0), invalid_argument);
+
+	cout << "Lazily removing the smallest value over and over, which unlinks the tombstones it reaches.\n";
+	RedBlackTree<int> queue;
+	queue.setLazyRemove(true, 0.9);
+	for (int i = 0; i < 1000; i++) queue.insert(i);
+	for (int i = 1; i < 500; i += 2) queue.remove(i);
+	EXPECT_EQ(250u, queue.tombstones());
+	for (int i = 0; i < 500; i += 2) {
+		ASSERT_EQ(i, queue.min());
+		queue.remove(queue.min());
+		ASSERT_TRUE(queue.verifyEnds());
+	}
+	EXPECT_EQ(0u, queue.tombstones());
+	EXPECT_EQ(500, queue.min());
+	queue.remove(999);
+	EXPECT_EQ(998, queue.max());
+	EXPECT_TRUE(queue.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, LazyRemoveTest) {
+	LazyRemoveTest();
+}
+
+void RedBlackTreeTest::DeferredFreeTest() {
+	int num_insert = 10000;
+	int max_frees = 100;
+	cout << "Clearing a tree of " << num_insert << " integers with at most " << max_frees
+	     << " nodes freed per operation.\n";
+	myTree.setDeferredFree(max_frees);
+	for (int i = 0; i < num_insert; i++) myTree.insert(i);
+	myTree.clear();
+	EXPECT_TRUE(myTree.empty());
+	EXPECT_TRUE(myTree.reclaimPending());
+	EXPECT_EQ(50u, myTree.reclaim(50));
+	int ops = 0;
+	while (myTree.reclaimPending()) {
+		myTree.insert(ops++);
+		ASSERT_TRUE(myTree.verifyProperties());
+	}
+	EXPECT_GE(ops, (num_insert - 50) / max_frees);
+	EXPECT_EQ(ops, myTree.size());
+
+	cout << "Assigning over a tree with deferred freeing, then turning it off.\n";
+	RedBlackTree<int> other;
+	for (int i = 0; i < num_insert; i++) other.insert(-i);
+	myTree = other;
+	EXPECT_TRUE(myTree.reclaimPending());
+	EXPECT_EQ(num_insert, myTree.size());
+	EXPECT_TRUE(myTree.verifyProperties());
+	myTree.setDeferredFree(0);
+	EXPECT_FALSE(myTree.reclaimPending());
+
+	cout << "Freeing cleared trees on the reclaimer thread.\n";
+	myTree.setDeferredFree(0, true);
+	myTree.clear();
+	EXPECT_FALSE(myTree.reclaimPending());
+	for (int i = 0; i < num_insert; i++) myTree.insert(i);
+	RedBlackTree<int> copy(myTree);
+	copy.clear();
+	Reclaimer::shared().drain();
+	EXPECT_TRUE(copy.empty());
+	EXPECT_EQ(num_insert, myTree.size());
+	EXPECT_TRUE(myTree.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, DeferredFreeTest) {
+	DeferredFreeTest();
+}
+
+void RedBlackTreeTest::RangeTest(int lo, int hi) {
+	int num_insert = 20000;
+	int modulo = 5000;
+	cout << "Inserting " << num_insert << " random integers [0, " << modulo-1
+	     << "], then counting and removing [" << lo << ", " << hi << "].\n";
+	map<int, int> in_tree;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+	}
+	size_t expected = 0;
+	for (int i = lo; i <= hi; i++) expected += in_tree[i];
+	EXPECT_EQ(expected, myTree.countRange(lo, hi));
+	EXPECT_EQ(expected, myTree.removeRange(lo, hi));
+	EXPECT_TRUE(myTree.verifyProperties());
+	EXPECT_EQ(num_insert - static_cast<int>(expected), myTree.size());
+	EXPECT_EQ(0u, myTree.countRange(lo, hi));
+	for (int i = 0; i < modulo; i++) EXPECT_EQ((i < lo || i > hi) ? in_tree[i] : 0, myTree.count(i));
+	EXPECT_EQ(0u, myTree.removeRange(hi, lo));
+}
+
+TEST_F(RedBlackTreeTest, SmallRangeTest) {
+	RangeTest(100, 200);
+}
+
+TEST_F(RedBlackTreeTest, LargeRangeTest) {
+	RangeTest(-10, 3000);
+}
+
+void RedBlackTreeTest::RangeTombstoneTest() {
+	cout << "Removing ranges over tombstones and with deferred freeing.\n";
+	myTree.setLazyRemove(true, 0.9);
+	myTree.setDeferredFree(16);
+	for (int i = 0; i < 2000; i++) myTree.insert(i);
+	for (int i = 0; i < 2000; i += 3) myTree.remove(i);
+	EXPECT_EQ(1333u, myTree.countRange(0, 1999));
+	EXPECT_EQ(27u, myTree.removeRange(100, 139)); // Unlinked one by one
+	EXPECT_TRUE(myTree.verifyProperties());
+	EXPECT_EQ(800u, myTree.removeRange(800, 10000)); // Relinked
+	EXPECT_TRUE(myTree.verifyProperties());
+	EXPECT_EQ(506, myTree.size());
+	EXPECT_TRUE(myTree.reclaimPending());
+	myTree.clear();
+	EXPECT_EQ(0u, myTree.countRange(0, 1999));
+}
+
+TEST_F(RedBlackTreeTest, RangeTombstoneTest) {
+	RangeTombstoneTest();
+}
+
+/** A value whose copies throw once a budget runs out and whose move may throw, so
+ * compaction has to copy it */
+struct FragileValue {
+	int key;
+	static int copiesLeft;
+	FragileValue(int key = 0): key(key) {}
+	FragileValue(const FragileValue& other): key(other.key) {
+		if (copiesLeft-- == 0) throw runtime_error("Out of copies.");
+	}
+	FragileValue(FragileValue&& other): key(other.key) { other.key = -1; }
+	FragileValue& operator=(const FragileValue& other) = default;
+	bool operator<(const FragileValue& other) const { return key < other.key; }
+	bool operator==(const FragileValue& other) const { return key == other.key; }
+};
+
+int FragileValue::copiesLeft = -1;
+
+void RedBlackTreeTest::CompactTest() {
+	int num_insert = 20000;
+	int modulo = 10000;
+	cout << "Inserting and removing " << num_insert << " random integers [0, " << modulo-1
+	     << "], then compacting and checking that the tree is unchanged.\n";
+	map<int, int> in_tree;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		in_tree[next]++;
+		myTree.insert(next);
+		if (i%3 == 0) {
+			next = rand()%modulo;
+			if (myTree.contains(next)) {
+				myTree.remove(next);
+				in_tree[next]--;
+			}
+		}
+	}
+	string before = myTree.debugString();
+	myTree.compact();
+	EXPECT_EQ(before, myTree.debugString());
+	EXPECT_TRUE(myTree.verifyProperties());
+
+	cout << "Changing the compacted tree, then compacting it in steps of 100 nodes.\n";
+	myTree.setLazyRemove(true);
+	for (int i = 0; i < modulo; i += 2) {
+		while (myTree.contains(i)) {
+			myTree.remove(i);
+			in_tree[i]--;
+		}
+	}
+	myTree.insert(1);
+	RedBlackTree<int>::node_type handle = myTree.extract(1);
+	size_t handle_count = handle.count();
+	for (int i = 0; i < 50; i++) {
+		EXPECT_LE(myTree.compactStep(100), 100u);
+		ASSERT_TRUE(myTree.verifyProperties());
+		myTree.insert(rand()%modulo * 2 + 1);
+		myTree.purgeTombstones(10);
+	}
+	in_tree.clear();
+	myTree.forEach([&](int value, size_t count) { in_tree[value] = count; });
+	before = myTree.debugString();
+	while (myTree.compactStep(100) != 0 && myTree.compactCursor != NULL) {}
+	EXPECT_EQ(before, myTree.debugString());
+
+	cout << "Copying, merging and freeing compacted nodes in other trees.\n";
+	RedBlackTree<int> copy(myTree);
+	RedBlackTree<int> other;
+	other.insert(move(handle));
+	other.merge(myTree);
+	EXPECT_TRUE(other.verifyProperties());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(copy.count(i) + (i == 1 ? handle_count : 0), other.count(i));
+	copy.compact();
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], copy.count(i));
+	other.setDeferredFree(0, true);
+	other.clear();
+	Reclaimer::shared().drain();
+
+	cout << "Compacting values whose copy throws partway, which leaves the tree as it was.\n";
+	RedBlackTree<FragileValue> fragile;
+	for (int i = 0; i < 1000; i++) fragile.insert(FragileValue(i));
+	FragileValue::copiesLeft = 500;
+	EXPECT_THROW(fragile.compact(), runtime_error);
+	FragileValue::copiesLeft = 50;
+	EXPECT_THROW(while (fragile.compactStep(100) != 0 && fragile.compactCursor != NULL) {}, runtime_error);
+	FragileValue::copiesLeft = -1;
+	EXPECT_TRUE(fragile.verifyProperties());
+	int next = 0;
+	fragile.forEach([&](const FragileValue& value, size_t count) {
+		EXPECT_EQ(next++, value.key);
+		EXPECT_EQ(1u, count);
+	});
+	EXPECT_EQ(1000, next);
+	fragile.compact();
+	EXPECT_TRUE(fragile.verifyProperties());
+	EXPECT_EQ(1000, fragile.size());
+}
+
+TEST_F(RedBlackTreeTest, CompactTest) {
+	CompactTest();
+}
+
+static string randomKey(int modulo) {
+	const string stems[] = {"", "a", "ab", "abcdefg", "abcdefgh", "abcdefghij", "https://", "\xff\x80", string("\0\0", 2)};
+	string key = stems[rand()%9];
+	if (rand()%4 == 0) key += string(1, '\0');
+	int suffix = rand()%modulo;
+	for (int i = 0; i < 3 && suffix != 0; i++, suffix /= 7) key += static_cast<char>(suffix%7 * 40);
+	return key;
+}
+
+void RedBlackTreeTest::StringKeyTest() {
+	int num_insert = 5000;
+	int modulo = 500;
+	cout << "Inserting and removing " << num_insert << " strings that share prefixes or hold "
+	     << "bytes over 127, and comparing against std::multiset.\n";
+	RedBlackTree<string> tree;
+	multiset<string> expected;
+	vector<string> order;
+	for (int i = 0; i < num_insert; i++) {
+		string next = randomKey(modulo);
+		order.push_back(next);
+		expected.insert(next);
+		tree.insert(next);
+	}
+	EXPECT_TRUE(tree.verifyProperties());
+	random_shuffle(order.begin(), order.end());
+	for (int i = 0; i < num_insert / 2; i++) {
+		tree.remove(order.back());
+		expected.erase(expected.find(order.back()));
+		order.pop_back();
+	}
+	EXPECT_TRUE(tree.verifyProperties());
+	multiset<string>::const_iterator next = expected.begin();
+	tree.forEach([&](const string& value, size_t count) {
+		ASSERT_TRUE(next != expected.end());
+		EXPECT_EQ(*next, value);
+		EXPECT_EQ(expected.count(value), count);
+		for (size_t i = 0; i < count; i++) ++next;
+	});
+	EXPECT_TRUE(next == expected.end());
+	for (int i = 0; i < 1000; i++) {
+		string key = randomKey(modulo);
+		EXPECT_EQ(expected.count(key), tree.count(key));
+	}
+
+	cout << "Changing a value through a node handle before inserting it again.\n";
+	RedBlackTree<string>::node_type handle = tree.extract(order.back());
+	ASSERT_FALSE(handle.empty());
+	size_t moved = handle.count();
+	handle.value() = "zzzzzzzz-moved";
+	tree.insert(move(handle));
+	EXPECT_EQ(moved, tree.count("zzzzzzzz-moved"));
+	EXPECT_EQ(0u, tree.count(order.back()));
+	EXPECT_TRUE(tree.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, StringKeyTest) {
+	StringKeyTest();
+}
+
+void RedBlackTreeTest::PriorityTest(bool lazy) {
+	int num_ops = 20000;
+	int modulo = 500;
+	cout << "Mixing inserts, removes and pops from both ends of a " << (lazy ? "lazy " : "")
+	     << "tree, checking min and max against a multiset.\n";
+	RedBlackTree<int> tree;
+	if (lazy) tree.setLazyRemove(true);
+	multiset<int> expected;
+	EXPECT_THROW(tree.min(), out_of_range);
+	EXPECT_THROW(tree.popMax(), out_of_range);
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		int op = rand()%6;
+		if (op < 3) {
+			tree.insert(next);
+			expected.insert(next);
+		} else if (op == 3 && expected.count(next) > 0) {
+			tree.remove(next);
+			expected.erase(expected.find(next));
+		} else if (!expected.empty() && op == 4) {
+			ASSERT_EQ(*expected.begin(), tree.popMin());
+			expected.erase(expected.begin());
+		} else if (!expected.empty()) {
+			ASSERT_EQ(*expected.rbegin(), tree.popMax());
+			expected.erase(prev(expected.end()));
+		}
+		ASSERT_TRUE(tree.verifyEnds());
+		if (expected.empty()) continue;
+		ASSERT_EQ(*expected.begin(), tree.min());
+		ASSERT_EQ(*expected.rbegin(), tree.max());
+	}
+	EXPECT_TRUE(tree.verifyProperties());
+
+	cout << "Draining the tree from alternating ends.\n";
+	for (int i = 0; !expected.empty(); i++) {
+		if (i%2 == 0) {
+			ASSERT_EQ(*expected.begin(), tree.popMin());
+			expected.erase(expected.begin());
+		} else {
+			ASSERT_EQ(*expected.rbegin(), tree.popMax());
+			expected.erase(prev(expected.end()));
+		}
+	}
+	EXPECT_EQ(0, tree.size());
+	EXPECT_EQ(0u, tree.tombstones());
+	EXPECT_TRUE(tree.verifyProperties());
+	EXPECT_THROW(tree.max(), out_of_range);
+}
+
+TEST_F(RedBlackTreeTest, PriorityTest) {
+	PriorityTest(false);
+	PriorityTest(true);
+}
+
+void RedBlackTreeTest::ShapeTest() {
+	int num_insert = 20000;
+	int modulo = 5000;
+	cout << "Checking shapeStats() and memoryUsage() against a recursive walk of a tree with "
+	     << num_insert << " random integers [0, " << modulo-1 << "]\n";
+	RedBlackTree<int> tree;
+	RedBlackTree<int>::ShapeStats stats = tree.shapeStats();
+	EXPECT_EQ(-1, stats.height);
+	EXPECT_EQ(0u, tree.memoryUsage().nodes);
+	for (int i = 0; i < num_insert; i++) tree.insert(rand()%modulo);
+	tree.setLazyRemove(true);
+	for (int i = 0; i < modulo; i += 7)
+		while (tree.contains(i)) tree.remove(i);
+
+	size_t nodes = 0, reds = 0, tombstones = 0, maxCount = 0;
+	double depthSum = 0;
+	map<size_t, size_t> counts;
+	vector<pair<RedBlackTree<int>::Node*, int> > stack(1, make_pair(tree.root, 0));
+	while (!stack.empty()) {
+		RedBlackTree<int>::Node* node = stack.back().first;
+		int depth = stack.back().second;
+		stack.pop_back();
+		if (node == NULL) continue;
+		nodes++;
+		if (node->red) reds++;
+		if (node->count == 0) tombstones++;
+		else counts[node->count]++;
+		depthSum += (double)depth * node->count;
+		maxCount = max(maxCount, node->count);
+		stack.push_back(make_pair(node->lChild, depth + 1));
+		stack.push_back(make_pair(node->rChild, depth + 1));
+	}
+	stats = tree.shapeStats();
+	EXPECT_EQ(tree.height(), stats.height);
+	EXPECT_EQ(tree.height(), stats.maxDepth);
+	EXPECT_EQ(RedBlackBalance::blackHeight(tree.root), stats.blackHeight);
+	EXPECT_DOUBLE_EQ(depthSum / tree.size(), stats.averageDepth);
+	EXPECT_DOUBLE_EQ((double)reds / nodes, stats.redRatio);
+	EXPECT_EQ(nodes - tombstones, stats.distinct);
+	EXPECT_EQ(tree.tombstones(), stats.tombstones);
+	EXPECT_EQ(maxCount, stats.maxCount);
+	size_t bucketed = 0;
+	for (size_t i = 0; i < stats.duplicates.size(); i++) {
+		size_t expected = 0;
+		for (map<size_t, size_t>::iterator it = counts.begin(); it != counts.end(); ++it)
+			if (it->first >= ((size_t)1 << i) && it->first < ((size_t)2 << i)) expected += it->second;
+		EXPECT_EQ(expected, stats.duplicates[i]) << "Bucket " << i;
+		bucketed += stats.duplicates[i];
+	}
+	EXPECT_EQ(stats.distinct, bucketed);
+
+	RedBlackTree<int>::MemoryUsage usage = tree.memoryUsage();
+	EXPECT_EQ(nodes, usage.nodes);
+	EXPECT_EQ(0u, usage.pooledNodes);
+	EXPECT_EQ(nodes * sizeof(RedBlackTree<int>::Node), usage.nodeBytes);
+	EXPECT_EQ(usage.nodeBytes + usage.overheadBytes + usage.treeBytes, usage.totalBytes);
+	EXPECT_DOUBLE_EQ((double)usage.totalBytes / tree.size(), usage.bytesPerKey);
+	tree.compact();
+	usage = tree.memoryUsage();
+	EXPECT_EQ(nodes, usage.pooledNodes);
+	EXPECT_EQ(0u, usage.overheadBytes);
+}
+
+TEST_F(RedBlackTreeTest, ShapeTest) {
+	ShapeTest();
+}
+
+template <size_t N>
+void RedBlackTreeTest::FixedTreeTest() {
+	int num_ops = 20000;
+	int modulo = N + N / 2;
+	cout << "Churning " << num_ops << " random integers [0, " << modulo-1 << "] through a fixed tree of "
+	     << N << " nodes and comparing it to a multiset.\n";
+	FixedRedBlackTree<int, N> tree;
+	multiset<int> expected;
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		if (rand()%2 == 0) {
+			bool fits = expected.count(next) > 0 || tree.numNodes < N;
+			ASSERT_EQ(fits, tree.tryInsert(next));
+			if (fits) expected.insert(next);
+		} else if (expected.count(next) > 0) {
+			tree.remove(next);
+			expected.erase(expected.find(next));
+		} else EXPECT_THROW(tree.remove(next), invalid_argument);
+		if (N < 5000 || i%1000 == 0) {
+			ASSERT_TRUE(tree.verifyProperties()) << "Operation " << i;
+		}
+		ASSERT_EQ((int)expected.size(), tree.size());
+	}
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(expected.count(i), tree.count(i));
+
+	cout << "Filling the tree, then checking that only duplicates still fit.\n";
+	for (int i = 0; !tree.full(); i++) tree.insert(modulo + i);
+	EXPECT_TRUE(tree.verifyProperties());
+	EXPECT_FALSE(tree.tryInsert(-1));
+	EXPECT_THROW(tree.insert(-1), length_error);
+	int levels = 0;
+	for (size_t n = N + 1; n > 1; n /= 2) levels++;
+	EXPECT_LE(tree.height(), 2 * levels);
+	EXPECT_EQ((N < 0xffff) ? 2u : 4u, sizeof(typename FixedRedBlackTree<int, N>::Index));
+	FixedRedBlackTree<int, N> copy(tree);
+	copy.clear();
+	EXPECT_TRUE(copy.empty());
+	copy.insert(5);
+	EXPECT_TRUE(copy.verifyProperties());
+	EXPECT_TRUE(tree.verifyProperties());
+	vector<int> order;
+	tree.forEach([&order](int value, size_t) { order.push_back(value); });
+	EXPECT_TRUE(is_sorted(order.begin(), order.end()));
+	EXPECT_EQ(N, order.size());
+	size_t held = tree.count(order[0]);
+	EXPECT_TRUE(tree.tryInsert(order[0]));
+	EXPECT_EQ(held + 1, tree.count(order[0]));
+}
+
+/** Builds a tree at compile time, refilling it from the free list and finding values */
+static constexpr int fixedTreeSum() {
+	FixedRedBlackTree<int, 16> tree;
+	for (int i = 0; i < 16; i++) tree.insert((i * 7) % 16);
+	tree.insert(3);
+	tree.remove(0);
+	tree.remove(15);
+	if (tree.full() || tree.contains(15) || tree.count(3) != 2) return -1;
+	if (!tree.tryInsert(20) || !tree.tryInsert(21) || tree.tryInsert(22)) return -2; // Reuses both freed nodes
+	int sum = 0;
+	tree.forEach([&sum](int value, size_t count) { sum += value * (int)count; });
+	return sum;
+}
+
+static_assert(fixedTreeSum() == 120 - 15 + 3 + 20 + 21, "FixedRedBlackTree works in constant expressions");
+static_assert(is_trivially_copyable<FixedRedBlackTree<int, 64> >::value, "FixedRedBlackTree of ints can be copied with memcpy");
+
+TEST_F(RedBlackTreeTest, FixedTreeTest) {
+	FixedTreeTest<1>();
+	FixedTreeTest<100>();
+	FixedTreeTest<1000>();
+	FixedTreeTest<70000>();
+}
+
+void RedBlackTreeTest::SmallTreeTest() {
+	int num_ops = 20000;
+	int modulo = 40;
+	cout << "Growing and shrinking a small tree of 8 inline values with " << num_ops
+	     << " random integers [0, " << modulo-1 << "], comparing it to a multiset.\n";
+	SmallRedBlackTree<int, 8> tree;
+	multiset<int> expected;
+	int promotions = 0, demotions = 0;
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		bool wasPromoted = tree.promoted();
+		bool grow = (i / 500) % 2 == 0; // Alternate between growing and draining phases
+		if (grow && rand()%4 != 0) {
+			tree.insert(next);
+			expected.insert(next);
+		} else if (!grow && !expected.empty()) { // Remove a value that is there
+			multiset<int>::iterator held = expected.lower_bound(next);
+			if (held == expected.end()) held = expected.begin();
+			tree.remove(*held);
+			expected.erase(held);
+		} else if (expected.count(next) > 0) {
+			tree.remove(next);
+			expected.erase(expected.find(next));
+		} else EXPECT_THROW(tree.remove(next), invalid_argument);
+		if (tree.promoted() && !wasPromoted) promotions++;
+		if (!tree.promoted() && wasPromoted) demotions++;
+		ASSERT_TRUE(tree.verifyArray()) << "Operation " << i;
+		if (tree.promoted()) {
+			ASSERT_TRUE(tree.tree->verifyProperties());
+		}
+		ASSERT_EQ((int)expected.size(), tree.size());
+		if (!expected.empty()) {
+			ASSERT_EQ(*expected.begin(), tree.min());
+			ASSERT_EQ(*expected.rbegin(), tree.max());
+		}
+	}
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(expected.count(i), tree.count(i));
+	EXPECT_GT(promotions, 0);
+	EXPECT_GT(demotions, 0);
+
+	cout << "Checking the thresholds, copies and clear().\n";
+	SmallRedBlackTree<int, 8> small;
+	for (int i = 0; i < 8; i++) small.insert(i);
+	for (int i = 0; i < 8; i++) small.insert(i);
+	EXPECT_FALSE(small.promoted()); // Duplicates never promote
+	for (int i = 0; i < 100000; i++) small.insert(3);
+	small.insert(8);
+	EXPECT_TRUE(small.promoted());
+	EXPECT_EQ(100002u, small.count(3));
+	EXPECT_EQ(9u, small.tree->memoryUsage().nodes); // One node per distinct value
+	EXPECT_TRUE(small.tree->verifyProperties());
+	for (int i = 0; i < 100000; i++) small.remove(3);
+	SmallRedBlackTree<int, 8> copy(small);
+	while (copy.size() > 5) copy.remove(copy.max());
+	EXPECT_TRUE(copy.promoted());
+	copy.remove(copy.max());
+	EXPECT_FALSE(copy.promoted());
+	EXPECT_TRUE(copy.verifyArray());
+	copy = small;
+	EXPECT_TRUE(copy.promoted());
+	EXPECT_EQ(17, copy.size());
+	vector<int> order;
+	copy.forEach([&order](int value, size_t count) { order.insert(order.end(), count, value); });
+	EXPECT_EQ(17u, order.size());
+	EXPECT_TRUE(is_sorted(order.begin(), order.end()));
+	copy.clear();
+	EXPECT_FALSE(copy.promoted());
+	EXPECT_TRUE(copy.empty());
+	EXPECT_THROW(copy.min(), out_of_range);
+
+	cout << "Failing each allocation of a promotion and a copy in turn, which leaves the tree as it was.\n";
+	SmallRedBlackTree<int, 8> full;
+	for (int i = 0; i < 8; i++) full.insert(i);
+	bool threw = true;
+	for (int budget = 0; threw; budget++) {
+		allocationsLeft = budget;
+		try {
+			full.insert(8);
+			threw = false;
+		} catch (const bad_alloc&) {}
+		allocationsLeft = -1;
+		ASSERT_EQ(!threw, full.promoted()) << "With " << budget << " allocations.\n";
+		ASSERT_EQ(threw ? 8 : 9, full.size());
+		ASSERT_TRUE(full.verifyArray());
+	}
+	copy.insert(-1);
+	threw = true;
+	for (int budget = 0; threw; budget++) {
+		allocationsLeft = budget;
+		try {
+			copy = full;
+			threw = false;
+		} catch (const bad_alloc&) {}
+		allocationsLeft = -1;
+		ASSERT_EQ(threw ? 1 : 9, copy.size()) << "With " << budget << " allocations.\n";
+		ASSERT_EQ(!threw, copy.promoted());
+	}
+	EXPECT_EQ(0u, copy.count(-1));
+	EXPECT_EQ(1u, copy.count(8));
+}
+
+TEST_F(RedBlackTreeTest, SmallTreeTest) {
+	SmallTreeTest();
+}
+
+void RedBlackTreeTest::HashIndexTest() {
+	int num_ops = 20000;
+	int modulo = 3000;
+	cout << "Running " << num_ops << " mixed operations on a tree with a hash index, comparing it to a multiset.\n";
+	RedBlackTree<int> tree;
+	tree.setHashIndex(true);
+	multiset<int> expected;
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		int op = rand()%100;
+		if (op < 50) {
+			tree.insert(next);
+			expected.insert(next);
+		} else if (op < 75) {
+			if (expected.count(next) > 0) {
+				tree.remove(next);
+				expected.erase(expected.find(next));
+			} else EXPECT_THROW(tree.remove(next), invalid_argument);
+		} else if (op < 80 && !expected.empty()) {
+			ASSERT_EQ(*expected.begin(), tree.popMin());
+			expected.erase(expected.begin());
+		} else if (op < 85) { // Move a value through a handle
+			RedBlackTree<int>::node_type handle = tree.extract(next);
+			size_t moved = handle.empty() ? 0 : handle.count();
+			for (size_t j = 0; j < moved; j++) {
+				expected.erase(expected.find(next));
+				expected.insert(next + 1);
+			}
+			if (!handle.empty()) handle.value() = next + 1;
+			tree.insert(move(handle));
+		} else if (op < 88) {
+			tree.removeRange(next, next + ((op == 87) ? 1500 : 10));
+			expected.erase(expected.lower_bound(next), expected.upper_bound(next + ((op == 87) ? 1500 : 10)));
+		} else if (op < 90) {
+			vector<RedBlackTree<int>::BatchOp> ops;
+			for (int j = 0; j < ((op == 89) ? 2000 : 20); j++) {
+				RedBlackTree<int>::BatchOp batch = {rand()%modulo, true};
+				expected.insert(batch.value);
+				ops.push_back(batch);
+			}
+			tree.applyBatch(ops);
+		} else if (op < 92) {
+			tree.setLazyRemove(op == 90);
+		} else if (op < 94) {
+			tree.purgeTombstones(50);
+		} else if (op < 97) {
+			tree.compactStep(100);
+		} else if (op < 98) {
+			tree.compact();
+		} else if (op < 99) {
+			RedBlackTree<int> copy(tree);
+			ASSERT_TRUE(copy.verifyProperties());
+			tree.clear();
+			ASSERT_TRUE(tree.verifyProperties());
+			tree.merge(copy);
+			ASSERT_TRUE(copy.verifyProperties());
+		} else {
+			RedBlackTree<int> other;
+			other.setHashIndex(true);
+			for (int j = 0; j < 100; j++) {
+				other.insert(next + j);
+				expected.insert(next + j);
+			}
+			tree.merge(other);
+			ASSERT_TRUE(other.verifyProperties());
+		}
+		ASSERT_EQ((int)expected.size(), tree.size()) << "Operation " << i << " (" << op << ")";
+		if (i%100 == 0 || op >= 85) {
+			ASSERT_TRUE(tree.verifyProperties()) << "Operation " << i << " (" << op << ")";
+		}
+	}
+	for (int i = 0; i < modulo + 100; i++) EXPECT_EQ(expected.count(i), tree.count(i));
+
+	cout << "Turning the index off and on again.\n";
+	tree.setHashIndex(false);
+	EXPECT_EQ(0u, tree.memoryUsage().indexBytes);
+	EXPECT_TRUE(tree.verifyProperties());
+	tree.setHashIndex(true);
+	EXPECT_GT(tree.memoryUsage().indexBytes, 0u);
+	EXPECT_TRUE(tree.verifyProperties());
+
+	cout << "Compacting string keys, whose values are moved out of the old nodes.\n";
+	RedBlackTree<string> strings;
+	strings.setHashIndex(true);
+	for (int i = 0; i < 2000; i++) strings.insert(randomKey(5000));
+	strings.compact();
+	EXPECT_TRUE(strings.verifyProperties());
+	string last = strings.max();
+	EXPECT_TRUE(strings.contains(last));
+	while (strings.count(last) > 0) strings.remove(last);
+	EXPECT_FALSE(strings.contains(last));
+	EXPECT_TRUE(strings.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, HashIndexTest) {
+	HashIndexTest();
+}
+
+/** A value whose comparison may throw, so removals on it cannot be noexcept */
+struct ThrowingKey {
+	int key;
+	bool operator<(const ThrowingKey& other) const { return key < other.key; }
+	bool operator==(const ThrowingKey& other) const { return key == other.key; }
+};
+
+static_assert(RedBlackTree<int>::kNothrowRemove, "Removing ints should be noexcept.");
+static_assert(noexcept(declval<RedBlackTree<int>&>().tryRemove(0)), "tryRemove() on ints should be noexcept.");
+static_assert(!RedBlackTree<ThrowingKey>::kNothrowRemove, "Removals that may throw are not noexcept.");
+
+/** A stream buffer that takes writes until it is marked full */
+struct FillingBuffer: streambuf {
+	bool full = false;
+	int overflow(int c) override { return full ? traits_type::eof() : c; }
+};
+
+void RedBlackTreeTest::TryRemoveTest(bool lazy) {
+	typedef RedBlackTree<int, RedBlackBalance, true> Tree;
+	int num_insert = 3000;
+	int num_ops = 6000;
+	int modulo = 1000;
+	cout << "Inserting " << num_insert << " random integers [0, " << modulo-1 << "] into a "
+	     << (lazy ? "lazy " : "") << "tree with Merkle hashes, then removing with tryRemove(), removeN(), "
+	     << "eraseAll() and erase() against a multiset.\n";
+	Tree tree;
+	tree.setLazyRemove(lazy, 0.3);
+	tree.setMerkleHashes(true);
+	multiset<int> expected;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		tree.insert(next);
+		expected.insert(next);
+	}
+	size_t misses = 0;
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%(modulo + modulo / 2); // A third miss at first, more as the tree empties
+		size_t had = expected.count(next);
+		size_t removed;
+		int op = rand()%4;
+		if (op == 0) {
+			removed = tree.tryRemove(next) ? 1 : 0;
+			ASSERT_EQ(had != 0, removed == 1);
+		} else if (op == 1) {
+			size_t n = rand()%4;
+			removed = tree.removeN(next, n);
+			ASSERT_EQ(min(had, n), removed);
+		} else if (op == 2) {
+			removed = tree.eraseAll(next);
+			ASSERT_EQ(had, removed);
+		} else {
+			Tree::Position position = tree.find(next);
+			ASSERT_EQ(had != 0, (bool)position);
+			ASSERT_EQ(had, position.count());
+			if (position) {
+				ASSERT_EQ(next, position.value());
+			}
+			removed = tree.erase(position);
+			ASSERT_EQ((size_t)(had != 0), removed);
+		}
+		if (removed == 0) misses++;
+		for (size_t j = 0; j < removed; j++) expected.erase(expected.find(next));
+		ASSERT_EQ((int)expected.size(), tree.size());
+		if (i % 100 == 0) {
+			ASSERT_TRUE(tree.verifyProperties()) << "After " << i << " removals.\n";
+		}
+	}
+	cout << misses << " of " << num_ops << " removals missed.\n";
+	EXPECT_TRUE(tree.verifyProperties());
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(expected.count(i), tree.count(i));
+
+	cout << "Holding positions across removals of other values.\n";
+	tree.clear();
+	vector<Tree::Position> positions;
+	for (int i = 0; i < 200; i++) tree.insert(i);
+	for (int i = 0; i < 200; i += 2) positions.push_back(tree.find(i));
+	for (int i = 1; i < 200; i += 2) EXPECT_TRUE(tree.tryRemove(i));
+	for (size_t i = 0; i < positions.size(); i++) {
+		EXPECT_EQ((int)(2 * i), positions[i].value());
+		EXPECT_EQ(1u, tree.erase(positions[i], 5));
+	}
+	EXPECT_TRUE(tree.empty());
+	EXPECT_TRUE(tree.verifyProperties());
+	EXPECT_EQ(0u, tree.erase(Tree::Position()));
+	EXPECT_FALSE(tree.find(0));
+
+	cout << "Removing while allocations and trace writes fail, which must not throw.\n";
+	FillingBuffer buffer;
+	ostream broken(&buffer);
+	TraceRecorder recorder(broken);
+	broken.exceptions(ios::badbit);
+	buffer.full = true;
+	tree.setHashIndex(true);
+	for (int i = 0; i < 2000; i++) tree.insert(i);
+	tree.setDeferredFree(1);
+	tree.clear(); // Queued, and freed a node per later operation
+	for (int i = 0; i < 1000; i++) tree.insert(i);
+	tree.setRecorder(&recorder);
+	bool removedAll = true;
+	for (int i = 100; i < 1000; i += 2) {
+		tree.freeQueue.shrink_to_fit(); // So freeing a node with two children has to grow it
+		allocationsLeft = i % 5; // Fails each allocation of a tombstone rebuild in turn
+		removedAll = tree.tryRemove(i) && removedAll;
+		allocationsLeft = -1;
+	}
+	EXPECT_TRUE(removedAll);
+	EXPECT_TRUE(broken.bad());
+	EXPECT_EQ(0u, recorder.records());
+	tree.setRecorder(NULL);
+	EXPECT_TRUE(tree.verifyProperties());
+	EXPECT_EQ(550, tree.size());
+	for (int i = 101; i < 1000; i += 2) ASSERT_TRUE(tree.contains(i));
+	EXPECT_TRUE(tree.reclaimPending());
+	EXPECT_TRUE(tree.tryRemove(101));
+	EXPECT_LE(tree.tombstones(), 0.3 * (tree.size() + tree.tombstones()));
+	EXPECT_TRUE(tree.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, TryRemoveTest) {
+	TryRemoveTest(false);
+	TryRemoveTest(true);
+}
+
+template <typename Balance>
+void RedBlackTreeTest::SlidingWindowTest(size_t maxFrees) {
+	int num_seconds = 50;
+	int per_second = 200;
+	int span = 5;
+	int jitter = 30;
+	cout << "Streaming " << num_seconds * per_second << " keys up to " << jitter << " behind the newest, with "
+	     << "one in 20 up to 8 seconds late, through a window of " << span << " seconds, expiring at most 50 "
+	     << "distinct keys per step.\n";
+	SlidingWindow<int, Balance> window(maxFrees);
+	multiset<int> expected;
+	size_t late = 0;
+	for (int second = 0; second < num_seconds; second++) {
+		for (int i = 0; i < per_second; i++) {
+			int now = (second * per_second + i) * 10;
+			int delay = (rand()%20 == 0) ? rand()%(8 * per_second * 10) : rand()%(jitter * 10);
+			int key = now - delay;
+			bool kept = window.insert(key);
+			ASSERT_EQ(second == 0 || key >= (second - span) * per_second * 10, kept); // No cutoff yet in the first second
+			if (kept) expected.insert(key);
+			else late++;
+		}
+		int cutoff = (second + 1 - span) * per_second * 10;
+		do {
+			size_t step = window.expireBefore(cutoff, 50);
+			multiset<int>::iterator front = window.empty() ? expected.end() : expected.lower_bound(window.oldest());
+			ASSERT_LE(set<int>(expected.begin(), front).size(), 50u);
+			ASSERT_EQ((size_t)distance(expected.begin(), front), step);
+			expected.erase(expected.begin(), front);
+		} while (window.expirePending());
+		ASSERT_TRUE(expected.empty() || *expected.begin() >= cutoff);
+		ASSERT_EQ((int)expected.size(), window.size());
+		ASSERT_TRUE(window.tree().verifyProperties()) << "After second " << second << ".\n";
+		if (!expected.empty()) {
+			ASSERT_EQ(*expected.begin(), window.oldest());
+			ASSERT_EQ(*expected.rbegin(), window.newest());
+		}
+	}
+	cout << late << " keys arrived after their cutoff.\n";
+	EXPECT_EQ(late, window.late());
+	for (multiset<int>::const_iterator it = expected.begin(); it != expected.end(); it++)
+		EXPECT_EQ(expected.count(*it), window.count(*it));
+
+	cout << "Expiring a lower cutoff keeps the watermark, and late keys are dropped.\n";
+	int watermark = (num_seconds - span) * per_second * 10;
+	EXPECT_EQ(0u, window.expireBefore(0));
+	EXPECT_FALSE(window.insert(watermark - 1));
+	EXPECT_TRUE(window.insert(watermark));
+	EXPECT_EQ((int)expected.size() + 1, window.size());
+	size_t left = window.size();
+	EXPECT_EQ(left, window.expireBefore(numeric_limits<int>::max()));
+	EXPECT_TRUE(window.empty());
+	EXPECT_FALSE(window.expirePending());
+	EXPECT_THROW(window.oldest(), out_of_range);
+	EXPECT_TRUE(window.tree().verifyProperties());
+
+	cout << "Removing below a cutoff with tombstones and duplicates at the front.\n";
+	RedBlackTree<int, Balance> tree;
+	tree.setLazyRemove(true, 1.0);
+	multiset<int> remaining;
+	for (int i = 0; i < 1000; i++) {
+		int next = rand()%500;
+		tree.insert(next);
+		remaining.insert(next);
+	}
+	for (int i = 0; i < 200; i++) {
+		int next = rand()%500;
+		if (remaining.count(next) == 0) continue;
+		tree.remove(next);
+		remaining.erase(remaining.find(next));
+	}
+	size_t dropped = tree.removeBelow(250);
+	EXPECT_EQ((size_t)distance(remaining.begin(), remaining.lower_bound(250)), dropped);
+	remaining.erase(remaining.begin(), remaining.lower_bound(250));
+	EXPECT_EQ((int)remaining.size(), tree.size());
+	EXPECT_TRUE(tree.verifyProperties());
+	EXPECT_EQ(*remaining.begin(), tree.min());
+	EXPECT_EQ(0u, tree.removeBelow(0));
+	EXPECT_FALSE(tree.append(*remaining.rbegin()));
+	EXPECT_FALSE(tree.append(0));
+	EXPECT_TRUE(tree.append(1000));
+	EXPECT_EQ(1000, tree.max());
+	EXPECT_EQ((int)remaining.size() + 1, tree.size());
+	EXPECT_TRUE(tree.verifyProperties());
+}
+
+TEST_F(RedBlackTreeTest, SlidingWindowTest) {
+	SlidingWindowTest<RedBlackBalance>(0);
+	SlidingWindowTest<RedBlackBalance>(64);
+	SlidingWindowTest<LeftLeaningBalance>(64);
+	SlidingWindowTest<AvlBalance>(64);
+	SlidingWindowTest<WavlBalance>(64);
+}
+
+TEST_F(RedBlackTreeTest, TraceTest) {
+	int num_ops = 5000;
+	cout << "Recording " << num_ops << " operations with keys far apart and of both signs, then reading them back.\n";
+	stringstream trace;
+	TraceRecorder recorder(trace);
+	RedBlackTree<long long> tree;
+	tree.setRecorder(&recorder);
+	vector<TraceEvent> expected;
+	for (int i = 0; i < num_ops; i++) {
+		long long key = (long long)(rand()%2000 - 1000) * ((i%7 == 0) ? 1000000000000LL : 1);
+		TraceEvent event = {(TraceOp)(rand()%4), key, 0};
+		if (event.op == kTraceRemove) { // Only remove values in the tree
+			expected.push_back(TraceEvent{kTraceContains, key, 0});
+			if (!tree.contains(key)) event.op = kTraceInsert;
+		}
+		if (event.op == kTraceInsert) tree.insert(key);
+		else if (event.op == kTraceRemove) tree.remove(key);
+		else if (event.op == kTraceContains) tree.contains(key);
+		else tree.count(key);
+		expected.push_back(event);
+	}
+	cout << "Checking that removeN() of zero copies records nothing.\n";
+	tree.insert(1);
+	expected.push_back(TraceEvent{kTraceInsert, 1, 0});
+	EXPECT_EQ(0u, tree.removeN(1, 0));
+	EXPECT_EQ(0u, tree.removeN(1000000000000000LL, 0));
+	EXPECT_EQ(1u, tree.removeN(1, 1));
+	expected.push_back(TraceEvent{kTraceRemove, 1, 0});
+	tree.setRecorder(NULL);
+	tree.insert(0);
+	EXPECT_EQ(expected.size(), recorder.records());
+
+	TraceReader reader(trace);
+	TraceEvent event;
+	uint64_t last = 0;
+	for (size_t i = 0; i < expected.size(); i++) {
+		ASSERT_TRUE(reader.next(event));
+		ASSERT_EQ(expected[i].op, event.op);
+		ASSERT_EQ(expected[i].key, event.key);
+		ASSERT_LE(last, event.nanos);
+		last = event.nanos;
+	}
+	EXPECT_FALSE(reader.next(event));
+
+	cout << "Checking that bad and truncated traces are rejected.\n";
+	stringstream bad("RBTRACE0");
+	EXPECT_THROW(TraceReader reader(bad), runtime_error);
+	string bytes = trace.str();
+	stringstream truncated(bytes.substr(0, bytes.size() - 1));
+	TraceReader partial(truncated);
+	EXPECT_THROW(while (partial.next(event)) {}, runtime_error);
+}
+
+TEST_F(RedBlackTreeTest, ChangeFeedTest) {
+	int num_ops = 50000;
+	int modulo = 2000;
+	cout << "Making " << num_ops << " random changes while a follower thread mirrors them from the feed.\n";
+	ChangeFeed<int> feed(1 << 16);
+	RedBlackTree<int> tree;
+	tree.subscribe(&feed);
+	atomic<bool> done(false);
+	map<int, size_t> mirror;
+	uint64_t expectedSequence = 0;
+	bool inOrder = true;
+	thread follower([&]() {
+		vector<ChangeEvent<int> > events;
+		while (true) {
+			bool finished = done.load();
+			events.clear();
+			feed.poll(events);
+			for (size_t i = 0; i < events.size(); i++) {
+				inOrder = inOrder && events[i].sequence == expectedSequence++;
+				if (events[i].op == kChangeClear) mirror.clear();
+				else if (events[i].count == 0) mirror.erase(events[i].value);
+				else mirror[events[i].value] = events[i].count;
+			}
+			if (finished && events.empty()) return;
+		}
+	});
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		int op = rand()%100;
+		if (op < 55) tree.insert(next);
+		else if (op < 90) {
+			if (tree.contains(next)) tree.remove(next);
+		} else if (op < 99) {
+			if (!tree.empty()) tree.popMin();
+		} else if (i % 20 == 0) tree.clear();
+		else tree.extract(next);
+	}
+	done = true;
+	follower.join();
+	EXPECT_TRUE(inOrder);
+	EXPECT_EQ(0u, feed.dropped());
+	EXPECT_EQ(feed.nextSequence(), expectedSequence);
+	map<int, size_t> expected;
+	tree.forEach([&expected](int value, size_t count) { expected[value] = count; });
+	EXPECT_TRUE(expected == mirror);
+
+	cout << "Overfilling a small feed and checking the follower can see the gap.\n";
+	ChangeFeed<int> small(6);
+	EXPECT_EQ(8u, small.capacity());
+	tree.subscribe(&small);
+	tree.subscribe(&small);
+	for (int i = 0; i < 20; i++) tree.insert(i);
+	EXPECT_EQ(12u, small.dropped());
+	vector<ChangeEvent<int> > events;
+	EXPECT_EQ(3u, small.poll(events, 3));
+	EXPECT_EQ(5u, small.poll(events));
+	EXPECT_EQ(0u, small.poll(events));
+	for (size_t i = 0; i < events.size(); i++) EXPECT_EQ(i, events[i].sequence);
+	tree.insert(0);
+	ASSERT_EQ(1u, small.poll(events));
+	EXPECT_EQ(20u, events.back().sequence); // Sequences 8 through 19 never arrive
+	EXPECT_EQ(kChangeInsert, events.back().op);
+	EXPECT_EQ(tree.count(0), events.back().count);
+
+	cout << "Checking bulk changes ask followers to resync.\n";
+	events.clear();
+	vector<RedBlackTree<int>::BatchOp> ops(1, RedBlackTree<int>::BatchOp{5, true});
+	tree.applyBatch(ops);
+	tree.removeRange(-10, -1); // Nothing in range, nothing published
+	tree.removeRange(0, 2);
+	tree.unsubscribe(&small);
+	tree.insert(3);
+	ASSERT_EQ(2u, small.poll(events));
+	EXPECT_EQ(kChangeResync, events[0].op);
+	EXPECT_EQ(kChangeResync, events[1].op);
+	tree.unsubscribe(&feed);
+}
+
+template <typename Balance>
+void RedBlackTreeTest::BalancePolicyTest() {
+	int num_insert = 5000;
+	int modulo = 3000;
+	cout << "Inserting and removing " << num_insert << " random integers [0, " << modulo-1
+	     << "] in a " << Balance::name() << " tree and verifying its properties.\n";
+	RedBlackTree<int, Balance> tree;
+	map<int, int> in_tree;
+	vector<int> order;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		order.push_back(next);
+		in_tree[next]++;
+		tree.insert(next);
+		ASSERT_TRUE(tree.verifyProperties()) << "Inserted " << i << " elements.\n";
+	}
+	EXPECT_EQ(num_insert, tree.size());
+	EXPECT_LE(tree.height(), 2 * 12);
+
+	random_shuffle(order.begin(), order.end());
+	for (int i = 0; i < num_insert / 2; i++) {
+		tree.remove(order.back());
+		in_tree[order.back()]--;
+		order.pop_back();
+		ASSERT_TRUE(tree.verifyProperties()) << "Removed " << i << " elements.\n";
+	}
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], tree.count(i));
+
+	cout << "Rebuilding through a large batch, then copying, extracting and merging.\n";
+	vector<typename RedBlackTree<int, Balance>::BatchOp> ops;
+	for (int i = 0; i < num_insert; i++) {
+		typename RedBlackTree<int, Balance>::BatchOp op = {rand()%modulo, true};
+		in_tree[op.value]++;
+		ops.push_back(op);
+	}
+	tree.applyBatch(ops);
+	EXPECT_TRUE(tree.verifyProperties());
+	for (int n = 1; n <= 64; n++) { // Inserts below the red bottom level of small rebuilds
+		RedBlackTree<int, Balance> grown;
+		vector<typename RedBlackTree<int, Balance>::BatchOp> evens;
+		for (int i = 0; i < n; i++) evens.push_back({2 * i, true});
+		grown.applyBatch(evens);
+		for (int i = 0; i < n; i++) {
+			grown.insert(2 * (rand()%n) + 1);
+			ASSERT_TRUE(grown.verifyProperties()) << "Inserted " << i << " elements after rebuilding " << n << ".\n";
+		}
+	}
+	RedBlackTree<int, Balance> copy(tree);
+	EXPECT_TRUE(copy.verifyProperties());
+	RedBlackTree<int, Balance> other;
+	for (int i = 0; i < modulo; i += 3) {
+		typename RedBlackTree<int, Balance>::node_type handle = copy.extract(i);
+		other.insert(move(handle));
+		ASSERT_TRUE(copy.verifyProperties());
+		ASSERT_TRUE(other.verifyProperties());
+	}
+	for (int i = 0; i < modulo; i += 2) {
+		while (tree.contains(i)) tree.remove(i);
+		ASSERT_TRUE(tree.verifyProperties());
+	}
+	copy.merge(other);
+	EXPECT_TRUE(copy.verifyProperties());
+	for (int i = 0; i < modulo; i++) {
+		EXPECT_EQ(in_tree[i], copy.count(i));
+		EXPECT_EQ((i%2 == 0) ? 0 : in_tree[i], tree.count(i));
+	}
+}
+
+TEST_F(RedBlackTreeTest, RedBlackPolicyTest) {
+	BalancePolicyTest<RedBlackBalance>();
+}
+
+TEST_F(RedBlackTreeTest, LeftLeaningPolicyTest) {
+	BalancePolicyTest<LeftLeaningBalance>();
+}
+
+TEST_F(RedBlackTreeTest, AvlPolicyTest) {
+	BalancePolicyTest<AvlBalance>();
+}
+
+TEST_F(RedBlackTreeTest, WavlPolicyTest) {
+	BalancePolicyTest<WavlBalance>();
+}
+
+template <typename Balance>
+void RedBlackTreeTest::MerkleTest() {
+	typedef RedBlackTree<int, Balance, true> Tree;
+	int num_ops = 4000;
+	int modulo = 1500;
+	cout << "Making " << num_ops << " random changes to a " << Balance::name()
+	     << " tree with Merkle hashes and verifying every subtree hash.\n";
+	EXPECT_EQ(sizeof(typename RedBlackTree<int, Balance>::Node) + sizeof(uint64_t), sizeof(typename Tree::Node))
+		<< "Only trees declared with Merkle set should hold a hash per node.\n";
+	Tree tree;
+	tree.setMerkleHashes(true);
+	map<int, size_t> in_tree;
+	for (int i = 0; i < num_ops; i++) {
+		int next = rand()%modulo;
+		int op = rand()%10;
+		if (op < 6) {
+			tree.insert(next);
+			in_tree[next]++;
+		} else if (op < 8 && in_tree[next] != 0) {
+			tree.remove(next);
+			in_tree[next]--;
+		} else if (op == 8 && !tree.empty()) {
+			in_tree[tree.min()]--;
+			tree.popMin();
+		} else if (op == 9) {
+			typename Tree::NodeHandle handle = tree.extract(next);
+			if (handle && rand()%2 == 0) tree.insert(std::move(handle));
+			else in_tree[next] = 0;
+		}
+		ASSERT_TRUE(tree.verifyProperties()) << "After " << i << " changes.\n";
+	}
+
+	cout << "Building the same contents in another shape and comparing in O(1).\n";
+	vector<typename Tree::BatchOp> ops;
+	for (map<int, size_t>::iterator it = in_tree.begin(); it != in_tree.end(); ++it)
+		for (size_t i = 0; i < it->second; i++) ops.push_back(typename Tree::BatchOp{it->first, true});
+	Tree rebuilt;
+	rebuilt.setLazyRemove(true, 0.9);
+	rebuilt.applyBatch(ops);
+	int absent = tree.min() + 1;
+	while (in_tree[absent] != 0) absent++; // The ends keep no tombstones, so leave one inside
+	rebuilt.insert(absent);
+	rebuilt.remove(absent); // Leaves a tombstone, which hashes as absent
+	EXPECT_EQ(1u, rebuilt.tombstones());
+	rebuilt.setMerkleHashes(true);
+	EXPECT_TRUE(rebuilt.verifyProperties());
+	EXPECT_EQ(tree.contentHash(), rebuilt.contentHash());
+	EXPECT_TRUE(tree.sameContents(rebuilt));
+	EXPECT_TRUE(tree.diff(rebuilt).empty());
+	Tree copy(tree);
+	copy.compact();
+	EXPECT_TRUE(copy.verifyProperties());
+	EXPECT_TRUE(copy.sameContents(tree));
+
+	cout << "Assigning a tree without hashes to one with them.\n";
+	Tree plain;
+	plain.applyBatch(ops);
+	Tree assigned;
+	assigned.setMerkleHashes(true);
+	assigned.insert(modulo);
+	assigned = plain;
+	EXPECT_TRUE(assigned.verifyProperties());
+	EXPECT_EQ(tree.contentHash(), assigned.contentHash());
+	EXPECT_TRUE(assigned.sameContents(tree));
+	EXPECT_TRUE(assigned.diff(tree).empty());
+
+	cout << "Changing a few values of the copy and diffing both ways.\n";
+	map<int, size_t> changed = in_tree;
+	for (int i = 0; i < 10; i++) {
+		int next = rand()%(modulo + 100);
+		if (i%2 == 0 || changed[next] == 0) {
+			copy.insert(next);
+			changed[next]++;
+		} else {
+			copy.remove(next);
+			changed[next]--;
+		}
+	}
+	copy.removeRange(modulo / 2, modulo / 2 + 5);
+	for (int i = modulo / 2; i <= modulo / 2 + 5; i++) changed[i] = 0;
+	EXPECT_TRUE(copy.verifyProperties());
+	EXPECT_FALSE(copy.sameContents(tree));
+	vector<typename Tree::DiffEntry> forward = tree.diff(copy);
+	vector<typename Tree::DiffEntry> backward = copy.diff(tree);
+	vector<int> expected;
+	for (int i = 0; i < modulo + 100; i++)
+		if (in_tree[i] != changed[i]) expected.push_back(i);
+	ASSERT_EQ(expected.size(), forward.size());
+	ASSERT_EQ(expected.size(), backward.size());
+	for (size_t i = 0; i < expected.size(); i++) {
+		EXPECT_EQ(expected[i], forward[i].value);
+		EXPECT_EQ(in_tree[expected[i]], forward[i].count);
+		EXPECT_EQ(changed[expected[i]], forward[i].otherCount);
+		EXPECT_EQ(expected[i], backward[i].value);
+		EXPECT_EQ(changed[expected[i]], backward[i].count);
+	}
+
+	cout << "Merging trees and diffing against an empty tree.\n";
+	Tree empty;
+	empty.setMerkleHashes(true);
+	EXPECT_EQ(0u, empty.contentHash());
+	size_t distinct = 0;
+	for (map<int, size_t>::iterator it = in_tree.begin(); it != in_tree.end(); ++it) distinct += (it->second != 0);
+	EXPECT_EQ(distinct, empty.diff(tree).size());
+	Tree unhashed(tree);
+	unhashed.setMerkleHashes(false);
+	EXPECT_THROW(unhashed.contentHash(), logic_error);
+	empty.merge(unhashed);
+	EXPECT_TRUE(empty.verifyProperties());
+	EXPECT_TRUE(empty.sameContents(tree));
+	Tree half;
+	half.setMerkleHashes(true);
+	for (int i = 0; i < modulo; i += 2) half.insert(i);
+	tree.merge(half);
+	EXPECT_TRUE(tree.verifyProperties());
+	for (int i = 0; i < modulo; i += 2) in_tree[i]++;
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], tree.count(i));
+	EXPECT_EQ((size_t)modulo / 2, tree.diff(empty).size());
+}
+
+TEST_F(RedBlackTreeTest, MerkleTest) {
+	MerkleTest<RedBlackBalance>();
+	MerkleTest<LeftLeaningBalance>();
+	MerkleTest<AvlBalance>();
+	MerkleTest<WavlBalance>();
+}
+
+template <size_t BlockSize, typename Balance>
+void RedBlackTreeTest::BlockedTreeTest() {
+	int num_insert = 5000;
+	int modulo = 3000;
+	cout << "Inserting and removing " << num_insert << " random integers [0, " << modulo-1
+	     << "] in a " << Balance::name() << " tree of blocks of " << BlockSize
+	     << " and verifying its properties.\n";
+	BlockedRedBlackTree<int, BlockSize, Balance> tree;
+	map<int, int> in_tree;
+	vector<int> order;
+	for (int i = 0; i < num_insert; i++) {
+		int next = rand()%modulo;
+		order.push_back(next);
+		in_tree[next]++;
+		tree.insert(next);
+		ASSERT_TRUE(tree.verifyProperties()) << "Inserted " << i << " elements.\n";
+	}
+	EXPECT_EQ(num_insert, tree.size());
+	EXPECT_LE(tree.blocks(), in_tree.size() / (BlockSize / 4));
+
+	cout << "Checking that forEach visits every value in order with its count.\n";
+	map<int, int>::const_iterator expected = in_tree.begin();
+	tree.forEach([&](int value, size_t count) {
+		ASSERT_TRUE(expected != in_tree.end());
+		EXPECT_EQ(expected->first, value);
+		EXPECT_EQ(expected->second, count);
+		++expected;
+	});
+	EXPECT_TRUE(expected == in_tree.end());
+
+	cout << "Copying, then removing from the original until it is empty.\n";
+	BlockedRedBlackTree<int, BlockSize, Balance> copy(tree);
+	EXPECT_TRUE(copy.verifyProperties());
+	random_shuffle(order.begin(), order.end());
+	while (!order.empty()) {
+		tree.remove(order.back());
+		order.pop_back();
+		ASSERT_TRUE(tree.verifyProperties()) << order.size() << " elements left.\n";
+	}
+	EXPECT_TRUE(tree.empty());
+	EXPECT_EQ(0u, tree.blocks());
+	EXPECT_THROW(tree.remove(0), invalid_argument);
+	for (int i = 0; i < modulo; i++) EXPECT_EQ(in_tree[i], copy.count(i));
+	EXPECT_EQ(num_insert, copy.size());
+}
+
+TEST_F(RedBlackTreeTest, BlockedTreeTest) {
+	BlockedTreeTest<4, RedBlackBalance>();
+	BlockedTreeTest<16, RedBlackBalance>();
+}
+
+TEST_F(RedBlackTreeTest, BlockedAvlTreeTest) {
+	BlockedTreeTest<8, AvlBalance>();
+}
+
+static int occurrences(const string& text, const string& pattern) {
+	int found = 0;
+	for (size_t pos = text.find(pattern); pos != string::npos; pos = text.find(pattern, pos + 1)) found++;
+	return found;
+}
+
+TEST_F(RedBlackTreeTest, ExportTest) {
+	int num_insert = 100000;
+
+	cout << "Inserting integers 0 to " << num_insert-1 << " in order and exporting the whole tree.\n";
+	for (int i = 0; i < num_insert; i++) myTree.insert(i);
+	myTree.insert(42);
+
+	stringstream dot;
+	myTree.exportDot(dot);
+	EXPECT_EQ(num_insert, occurrences(dot.str(), " [label="));
+	EXPECT_EQ(num_insert-1, occurrences(dot.str(), " -> "));
+	EXPECT_EQ(1, occurrences(dot.str(), "label=\"42\", xlabel=2"));
+
+	stringstream json;
+	myTree.exportJson(json);
+	EXPECT_EQ(num_insert, occurrences(json.str(), "\"value\":"));
+	EXPECT_NE(string::npos, json.str().find("\"value\":42,\"color\":"));
+
+	cout << "Checking that the level order debug string covers every node.\n";
+	EXPECT_EQ(num_insert, occurrences(myTree.debugString(), "(") - occurrences(myTree.debugString(), "NULL"));
+
+	cout << "Exporting a depth-limited view and the key range [1000, 1100].\n";
+	stringstream shallow;
+	myTree.exportJson(shallow, 2);
+	EXPECT_EQ(7, occurrences(shallow.str(), "\"value\":"));
+	EXPECT_EQ(4, occurrences(shallow.str(), "\"truncated\":true"));
+
+	stringstream range;
+	myTree.exportDot(range, 1000, 1100);
+	EXPECT_EQ(101, occurrences(range.str(), " [label="));
+	EXPECT_EQ(100, occurrences(range.str(), " -> "));
+
+	stringstream rangeJson;
+	myTree.exportJson(rangeJson, 1000, 1100);
+	EXPECT_EQ(101, occurrences(rangeJson.str(), "\"value\":"));
+}
+
+TEST(ExportTests, StringValueTest) {
+	cout << "Checking that string values are quoted and escaped.\n";
+	RedBlackTree<string> tree;
+	tree.insert("say \"hi\"");
+	stringstream json;
+	tree.exportJson(json);
+	EXPECT_EQ("{\"size\":1,\"root\":{\"value\":\"say \\\"hi\\\"\",\"color\":\"black\",\"count\":1,"
+		  "\"left\":null,\"right\":null}}\n", json.str());
+}
+
+TEST(ExportTests, ControlCharacterTest) {
+	cout << "Checking that control characters are escaped in JSON.\n";
+	RedBlackTree<string> tree;
+	tree.insert("a\tb\r\n\x01");
+	stringstream json;
+	tree.exportJson(json);
+	EXPECT_NE(string::npos, json.str().find("\"value\":\"a\\u0009b\\u000d\\u000a\\u0001\""));
+	stringstream dot;
+	tree.exportDot(dot);
+	EXPECT_NE(string::npos, dot.str().find("a\tb\r\\n\x01"));
+}
+
+TEST(ExportTests, ScalarValueTest) {
+	cout << "Checking that NaN, infinities, chars and bools are valid JSON.\n";
+	RedBlackTree<double> nan;
+	nan.insert(numeric_limits<double>::quiet_NaN());
+	stringstream nanJson;
+	nan.exportJson(nanJson);
+	EXPECT_NE(string::npos, nanJson.str().find("nan\",\"color\""));
+	EXPECT_EQ(string::npos, nanJson.str().find("\"value\":nan"));
+	EXPECT_EQ(string::npos, nanJson.str().find("\"value\":-nan"));
+	RedBlackTree<double> numbers;
+	numbers.insert(numeric_limits<double>::infinity());
+	numbers.insert(2.5);
+	stringstream numberJson;
+	numbers.exportJson(numberJson);
+	EXPECT_NE(string::npos, numberJson.str().find("\"value\":2.5,"));
+	EXPECT_NE(string::npos, numberJson.str().find("\"value\":\"inf\","));
+	RedBlackTree<char> chars;
+	chars.insert('"');
+	stringstream charJson;
+	chars.exportJson(charJson);
+	EXPECT_NE(string::npos, charJson.str().find("\"value\":\"\\\"\","));
+	RedBlackTree<bool> bools;
+	bools.insert(true);
+	stringstream boolJson;
+	bools.exportJson(boolJson);
+	EXPECT_NE(string::npos, boolJson.str().find("\"value\":true,"));
+}
+
 class ConstructorTests: public ::testing::Test {
 	protected:
 		RedBlackTree<int> myTree;
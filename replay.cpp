@@ -0,0 +1,148 @@
+#include "RedBlackTree.h"
+#include "TraceRecorder.h"
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <set>
+#include <stdexcept>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+/** Replays a trace written by TraceRecorder against RedBlackTree and std::multiset,
+ * reporting throughput and per-operation latency for each. Build with `make replay`.
+ *
+ *   ./replay <trace>                      Replays a trace
+ *   ./replay --record <trace> [num_ops]   Records a random workload to replay */
+
+typedef chrono::steady_clock Clock;
+
+static const char* kOpNames[] = {"insert", "remove", "contains", "count"};
+
+static double secondsSince(const Clock::time_point& start) {
+	return chrono::duration<double>(Clock::now() - start).count();
+}
+
+/** Adapts RedBlackTree to the calls a trace makes. Removing a missing value throws in
+ * the tree, as it did when the trace was recorded, and is ignored. */
+struct TreeTarget {
+	static const char* name() { return "RedBlackTree"; }
+	RedBlackTree<long long> tree;
+	void insert(long long key) { tree.insert(key); }
+	void remove(long long key) {
+		try {
+			tree.remove(key);
+		} catch (const invalid_argument&) {}
+	}
+	size_t count(long long key) const { return tree.count(key); }
+};
+
+struct MultisetTarget {
+	static const char* name() { return "std::multiset"; }
+	multiset<long long> tree;
+	void insert(long long key) { tree.insert(key); }
+	void remove(long long key) {
+		multiset<long long>::iterator found = tree.find(key);
+		if (found != tree.end()) tree.erase(found);
+	}
+	size_t count(long long key) const { return tree.count(key); }
+};
+
+/** Runs one event. Returns the lookup result, or 0 for updates, for cross-checking. */
+template <typename Target>
+static size_t apply(Target& target, const TraceEvent& event) {
+	switch (event.op) {
+		case kTraceInsert: target.insert(event.key); return 0;
+		case kTraceRemove: target.remove(event.key); return 0;
+		case kTraceContains: return target.count(event.key) != 0;
+		default: return target.count(event.key);
+	}
+}
+
+static void reportLatency(const char* label, vector<double>& nanos) {
+	if (nanos.empty()) return;
+	sort(nanos.begin(), nanos.end());
+	cout << "    " << label << " (" << nanos.size() << "): p50 " << nanos[nanos.size() / 2]
+	     << " ns, p90 " << nanos[nanos.size() * 9 / 10] << " ns, p99 " << nanos[nanos.size() * 99 / 100]
+	     << " ns, p99.9 " << nanos[nanos.size() * 999 / 1000] << " ns, max " << nanos.back() << " ns\n";
+}
+
+/** Replays the trace twice on fresh targets: untimed per operation for throughput, then
+ * timing every operation for latency. Returns a checksum of the lookup results. */
+template <typename Target>
+static size_t replay(const vector<TraceEvent>& events) {
+	cout << "  " << Target::name() << "\n";
+	size_t checksum = 0;
+	{
+		Target target;
+		Clock::time_point start = Clock::now();
+		for (size_t i = 0; i < events.size(); i++) checksum += apply(target, events[i]) * (i + 1);
+		double seconds = secondsSince(start);
+		cout << "    throughput: " << seconds * 1000 << " ms, " << events.size() / seconds / 1e6 << " Mops/s\n";
+	}
+	Target target;
+	vector<double> nanos[4];
+	for (size_t i = 0; i < events.size(); i++) {
+		Clock::time_point start = Clock::now();
+		apply(target, events[i]);
+		nanos[events[i].op].push_back(secondsSince(start) * 1e9);
+	}
+	for (int op = 0; op < 4; op++) reportLatency(kOpNames[op], nanos[op]);
+	return checksum;
+}
+
+/** Writes a trace of a random mix of operations, drawn as an application might make them */
+static void record(const char* path, int num_ops) {
+	ofstream out(path, ios::binary);
+	if (!out) throw runtime_error("Could not open the trace for writing.");
+	TraceRecorder recorder(out);
+	RedBlackTree<long long> tree;
+	tree.setRecorder(&recorder);
+	int modulo = num_ops / 2 + 1;
+	for (int i = 0; i < num_ops; i++) {
+		long long key = rand()%modulo;
+		int op = rand()%10;
+		if (op < 4) tree.insert(key);
+		else if (op < 6) {
+			if (tree.count(key) != 0) tree.remove(key);
+		} else tree.contains(key);
+	}
+	tree.setRecorder(NULL);
+	recorder.flush();
+	cout << "Recorded " << recorder.records() << " operations to " << path << "\n";
+}
+
+int main(int argc, char **argv) {
+	srand(42);
+	try {
+		if (argc >= 3 && strcmp(argv[1], "--record") == 0) {
+			record(argv[2], (argc >= 4) ? atoi(argv[3]) : 1000000);
+			return 0;
+		}
+		if (argc != 2) {
+			cerr << "Usage: " << argv[0] << " <trace>\n       " << argv[0] << " --record <trace> [num_ops]\n";
+			return 1;
+		}
+		ifstream in(argv[1], ios::binary);
+		if (!in) throw runtime_error("Could not open the trace.");
+		TraceReader reader(in);
+		vector<TraceEvent> events;
+		TraceEvent event;
+		while (reader.next(event)) events.push_back(event);
+		double span = events.empty() ? 0 : events.back().nanos / 1e9;
+		cout << "Replaying " << events.size() << " operations recorded over " << span << " s\n";
+		size_t treeSum = replay<TreeTarget>(events);
+		size_t setSum = replay<MultisetTarget>(events);
+		if (treeSum != setSum) {
+			cerr << "Lookup results differ between RedBlackTree and std::multiset.\n";
+			return 1;
+		}
+	} catch (const exception& e) {
+		cerr << e.what() << "\n";
+		return 1;
+	}
+	return 0;
+}